@@ -0,0 +1,179 @@
+/**
+ * Microbenchmark della tabella hash ad indirizzamento aperto (hashlib)
+ * confrontata con icl_hash sul registro utenti: 100k nickname casuali
+ * (da 4 a MAX_NAME_LENGTH caratteri) inseriti, cercati (presenti e assenti)
+ * ed eliminati. hashlib parte da 32 posizioni (come MaxConnections in
+ * chatty.conf1) e cresce da sola; icl_hash ha un numero fisso di bucket e
+ * viene creata con un bucket per nickname, il caso più favorevole.
+ *
+ * Uso: hashbench [numero di nickname]
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Confronto fra hashlib e icl_hash
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "icl_hash.h"
+#include "hashlib.h"
+
+#define INITIAL 32
+#define ROUNDS 5
+
+static long n;
+static char ** names;   //nickname inseriti
+static char ** missing; //nickname mai inseriti
+static volatile long sink;
+
+static double nowSec(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec+t.tv_nsec/1e9;
+}
+
+/**
+ * @brief Genera un nickname casuale (lettere, cifre e '_') di lunghezza fra 4 e MAX_NAME_LENGTH
+ */
+static char * randomName(unsigned int * seed){
+	static const char set[]="abcdefghijklmnopqrstuvwxyz0123456789_";
+	int len=4+rand_r(seed)%(MAX_NAME_LENGTH-3);
+	char * s=malloc(MAX_NAME_LENGTH+1);
+	if(!s){
+		perror("malloc in randomName");
+		exit(EXIT_FAILURE);
+	}
+	for(int i=0; i<len; i++) s[i]=set[rand_r(seed)%(sizeof(set)-1)];
+	s[len]='\0';
+	return s;
+}
+
+/**
+ * @brief Esegue le quattro fasi su icl_hash
+ * @param t tempi (ns per operazione) di inserimento, ricerca, ricerca fallita, cancellazione
+ */
+static void runIcl(double t[4]){
+	double t0;
+	long hits=0;
+	icl_hash_t * h=icl_hash_create(n,NULL,NULL);
+
+	t0=nowSec();
+	for(long i=0; i<n; i++) icl_hash_insert(h,names[i],names[i]);
+	t[0]+=(nowSec()-t0)*1e9/n;
+
+	t0=nowSec();
+	for(long i=0; i<n; i++) hits+=icl_hash_find(h,names[i])!=NULL;
+	t[1]+=(nowSec()-t0)*1e9/n;
+
+	t0=nowSec();
+	for(long i=0; i<n; i++) hits+=icl_hash_find(h,missing[i])!=NULL;
+	t[2]+=(nowSec()-t0)*1e9/n;
+
+	t0=nowSec();
+	for(long i=0; i<n; i++) icl_hash_delete(h,names[i],NULL,NULL);
+	t[3]+=(nowSec()-t0)*1e9/n;
+
+	sink=hits;
+	icl_hash_destroy(h,NULL,NULL);
+}
+
+/**
+ * @brief Esegue le quattro fasi su hashlib
+ * @param t tempi (ns per operazione) di inserimento, ricerca, ricerca fallita, cancellazione
+ */
+static void runMap(double t[4]){
+	double t0;
+	long hits=0;
+	hashmap * m=createHashMap(INITIAL*HASHMAP_MAX_LOAD/100);
+
+	t0=nowSec();
+	for(long i=0; i<n; i++) hashMapInsert(m,names[i],names[i]);
+	t[0]+=(nowSec()-t0)*1e9/n;
+
+	t0=nowSec();
+	for(long i=0; i<n; i++) hits+=hashMapFind(m,names[i])!=NULL;
+	t[1]+=(nowSec()-t0)*1e9/n;
+
+	t0=nowSec();
+	for(long i=0; i<n; i++) hits+=hashMapFind(m,missing[i])!=NULL;
+	t[2]+=(nowSec()-t0)*1e9/n;
+
+	t0=nowSec();
+	for(long i=0; i<n; i++) hashMapDelete(m,names[i],NULL);
+	t[3]+=(nowSec()-t0)*1e9/n;
+
+	sink=hits;
+	destroyHashMap(m,NULL);
+}
+
+int main(int argc, char * argv[]){
+	n=(argc>1) ? atol(argv[1]) : 100000;
+	if(n<=0){
+		fprintf(stderr,"usage: %s [numero di nickname]\n",argv[0]);
+		return EXIT_FAILURE;
+	}
+	unsigned int seed=534919;
+	names=malloc(sizeof(char *)*n);
+	missing=malloc(sizeof(char *)*n);
+	if(!names || !missing){
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	//I nickname duplicati vengono rigenerati
+	hashmap * uniq=createHashMap(2*n);
+	for(long i=0; i<2*n; i++){
+		char * s=randomName(&seed);
+		while(hashMapInsert(uniq,s,NULL)!=0){
+			free(s);
+			s=randomName(&seed);
+		}
+		if(i<n) names[i]=s;
+		else missing[i-n]=s;
+	}
+	destroyHashMap(uniq,NULL);
+
+	double ticl[4]={0}, tmap[4]={0};
+	for(int r=0; r<ROUNDS; r++){
+		runIcl(ticl);
+		runMap(tmap);
+	}
+
+	//Stato delle tabelle piene
+	icl_hash_t * h=icl_hash_create(n,NULL,NULL);
+	hashmap * m=createHashMap(INITIAL*HASHMAP_MAX_LOAD/100);
+	for(long i=0; i<n; i++){
+		icl_hash_insert(h,names[i],names[i]);
+		hashMapInsert(m,names[i],names[i]);
+	}
+	int used=0, maxchain=0;
+	for(int b=0; b<h->nbuckets; b++){
+		int len=0;
+		for(icl_entry_t * e=h->buckets[b]; e; e=e->next) len++;
+		used+=(len>0);
+		if(len>maxchain) maxchain=len;
+	}
+	hashmap_stats ms;
+	hashMapStats(m,&ms);
+
+	printf("%ld nickname, media di %d giri (ns per operazione)\n",n,ROUNDS);
+	printf("%-20s %12s %12s\n","","icl_hash","hashlib");
+	const char * phase[4]={"inserimento","ricerca","ricerca fallita","cancellazione"};
+	for(int i=0; i<4; i++) printf("%-20s %12.1f %12.1f\n",phase[i],ticl[i]/ROUNDS,tmap[i]/ROUNDS);
+	printf("icl_hash: %d bucket (%d usati), catena max %d\n",h->nbuckets,used,maxchain);
+	printf("hashlib: %zu posizioni, distanza max %zu, %d ampliamenti\n",ms.nslots,ms.maxdist,ms.nresize);
+
+	icl_hash_destroy(h,NULL,NULL);
+	destroyHashMap(m,NULL);
+	for(long i=0; i<n; i++){
+		free(names[i]);
+		free(missing[i]);
+	}
+	free(names);
+	free(missing);
+	return 0;
+}
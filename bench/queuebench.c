@@ -0,0 +1,200 @@
+/**
+ * Microbenchmark della coda concorrente dei fd (queuelib) confrontata con
+ * la versione precedente basata su mutex e variabile di condizione.
+ * Ogni thread alterna un inserimento ed un'estrazione, con 1-64 thread.
+ * Prima del benchmark verifica che un consumatore sospeso venga risvegliato
+ * anche dopo un risveglio "consumato" da chi ha trovato l'elemento senza
+ * sospendersi (vedi checkLostWakeup).
+ *
+ * Uso: queuebench [operazioni per thread]
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Confronto fra la coda senza lock e quella con mutex/condvar
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "queuelib.h"
+
+#define MAXTHREADS 64
+#define QDIM 1024
+
+/* ### Coda con mutex e variabile di condizione (implementazione precedente) ### */
+
+typedef struct{
+	int front;
+	int rear;
+	int dim;
+	int * elem;
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd1;
+}lockqueue;
+
+static lockqueue * lockCreate(int dim){
+	lockqueue * q=malloc(sizeof(lockqueue));
+	if(!q || !(q->elem=malloc(sizeof(int)*dim))){
+		perror("malloc in lockCreate");
+		exit(EXIT_FAILURE);
+	}
+	q->front=q->rear=-1;
+	q->dim=dim;
+	pthread_mutex_init(&(q->mtx),NULL);
+	pthread_cond_init(&(q->cnd1),NULL);
+	return q;
+}
+
+static int lockEnQueue(lockqueue * q, int elem){
+	int ret=-1;
+	pthread_mutex_lock(&(q->mtx));
+	if(q->rear!=((q->front-1)%q->dim+q->dim)%q->dim){
+		if(q->front==-1) q->front=0;
+		q->rear=(q->rear+1)%q->dim;
+		q->elem[q->rear]=elem;
+		ret=0;
+		pthread_cond_signal(&(q->cnd1));
+	}
+	pthread_mutex_unlock(&(q->mtx));
+	return ret;
+}
+
+static int lockDeQueue(lockqueue * q){
+	pthread_mutex_lock(&(q->mtx));
+	while(q->front==-1) pthread_cond_wait(&(q->cnd1),&(q->mtx));
+	int ret=q->elem[q->front];
+	if(q->front==q->rear) q->front=q->rear=-1;
+	else q->front=(q->front+1)%q->dim;
+	pthread_mutex_unlock(&(q->mtx));
+	return ret;
+}
+
+static void lockDestroy(lockqueue * q){
+	pthread_mutex_destroy(&(q->mtx));
+	pthread_cond_destroy(&(q->cnd1));
+	free(q->elem);
+	free(q);
+}
+
+/* ### Benchmark ### */
+
+static long nops;
+static lockqueue * lq;
+static queue * fq;
+static pthread_barrier_t start;
+
+static void * lockWorker(void * arg){
+	long id=(long)arg;
+	pthread_barrier_wait(&start);
+	for(long i=0; i<nops; i++){
+		lockEnQueue(lq,(int)id);
+		lockDeQueue(lq);
+	}
+	return NULL;
+}
+
+static void * freeWorker(void * arg){
+	long id=(long)arg;
+	pthread_barrier_wait(&start);
+	for(long i=0; i<nops; i++){
+		while(enQueue(fq,(int)id)<0);
+		deQueue(fq);
+	}
+	return NULL;
+}
+
+static void * parkWorker(void * arg){
+	long got=deQueue((queue *)arg);
+	return (void *)got;
+}
+
+/**
+ * @brief Verifica che un risveglio non vada perso
+ *
+ * Riproduce in modo deterministico la corsa fra un produttore e un
+ * consumatore che si è registrato in sleepers ma trova l'elemento con il
+ * secondo tentativo, senza sospendersi: il produttore lo risveglia comunque.
+ * Poi un altro consumatore si sospende davvero e deve ricevere l'elemento
+ * successivo entro un secondo.
+ *
+ * @return 0 se il consumatore viene risvegliato, -1 altrimenti
+ */
+static int checkLostWakeup(void){
+	queue * q=createQueue(QDIM);
+	pthread_t th;
+	void * res;
+	struct timespec deadline;
+	//Consumatore registrato che trova l'elemento senza sospendersi
+	__atomic_add_fetch(&(q->sleepers),1,__ATOMIC_SEQ_CST);
+	enQueue(q,1);
+	deQueue(q);
+	__atomic_sub_fetch(&(q->sleepers),1,__ATOMIC_SEQ_CST);
+	//Consumatore che si sospende
+	if(pthread_create(&th,NULL,parkWorker,q)!=0){
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	while(__atomic_load_n(&(q->sleepers),__ATOMIC_SEQ_CST)==0) usleep(1000);
+	usleep(50000);
+	enQueue(q,2);
+	clock_gettime(CLOCK_REALTIME,&deadline);
+	deadline.tv_sec+=1;
+	int ret=(pthread_timedjoin_np(th,&res,&deadline)==0 && (long)res==2) ? 0 : -1;
+	if(ret<0){ //Lo sblocco per poter terminare
+		closeQueue(q);
+		pthread_join(th,NULL);
+	}
+	destroyQueue(q);
+	return ret;
+}
+
+/**
+ * @brief Esegue il benchmark con n thread
+ * @return milioni di coppie inserimento/estrazione al secondo
+ */
+static double run(int n, void * (*fun)(void *)){
+	pthread_t th[MAXTHREADS];
+	struct timespec t0, t1;
+	pthread_barrier_init(&start,NULL,n+1);
+	for(long i=0; i<n; i++){
+		if(pthread_create(&th[i],NULL,fun,(void *)i)!=0){
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	pthread_barrier_wait(&start);
+	for(int i=0; i<n; i++) pthread_join(th[i],NULL);
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	pthread_barrier_destroy(&start);
+	double secs=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+	return (double)n*nops/secs/1e6;
+}
+
+int main(int argc, char * argv[]){
+	nops=(argc>1) ? atol(argv[1]) : 200000;
+	if(nops<=0){
+		fprintf(stderr,"usage: %s [operazioni per thread]\n",argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(checkLostWakeup()<0){
+		fprintf(stderr,"ERRORE: consumatore sospeso non risvegliato\n");
+		return EXIT_FAILURE;
+	}
+	printf("risveglio dopo una corsa: OK\n");
+	printf("%8s %16s %16s\n","thread","mutex Mop/s","lock-free Mop/s");
+	for(int n=1; n<=MAXTHREADS; n*=2){
+		lq=lockCreate(QDIM);
+		fq=createQueue(QDIM);
+		double lk=run(n,lockWorker);
+		double lf=run(n,freeWorker);
+		printf("%8d %16.2f %16.2f\n",n,lk,lf);
+		lockDestroy(lq);
+		destroyQueue(fq);
+	}
+	return 0;
+}
@@ -10,7 +10,8 @@
  * in ascolto su un socket di tipo AF_UNIX per servire i client.
  * Il main quindi accoglie i fd dei client da servire, e schedula i Worker per
  * poter eseguire l'operazione richiesta dagli utenti della chat.
- * I Worker cicleranno all'infinito estraendo da una coda i filedescriptor da servire,
+ * I Worker cicleranno all'infinito estraendo dalla propria coda (o rubando da quelle
+ * degli altri Worker) i filedescriptor da servire,
  * aspettando di essere terminati da uno dei segnali registrati dal main.
  *
  *	@author Stefano Spadola 534919
@@ -29,24 +30,33 @@
 #include <pthread.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <getopt.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <sys/un.h>
 
 #include <fcntl.h>
-#include <sys/mman.h>
 
 #include "connections.h"
-#include "queuelib.h"
 #include "threadlib.h"
 #include "parser.h"
-#include "icl_hash.h"
 #include "userlib.h"
 #include "stats.h"
+#include "reactorlib.h"
+#include "connlib.h"
+#include "uringlib.h"
+
+//Operazioni massime raccolte in una sola chiamata io_uring da un ciclo degli eventi
+#define URING_ENTRIES 256
+//Connessioni massime le cui code in uscita vengono inviate con una sola chiamata io_uring
+#define WRITE_BATCH 64
+//Evento non letto con io_uring (runLoop)
+#define NOREAD INT_MIN
 
 static void printMsg(message_t *msg){
 	printf("|Messaggio letto:\n");
@@ -62,23 +72,59 @@ static void printMsg(message_t *msg){
 //Struttura per le var di configurazione del Server
 conf_var * config;
 
-//Coda per i filedescriptor dei client
-queue * coda;
+//Pool dei worker, con le code locali dei fd dei client da servire
+pool * workers;
+//Pool di I/O per le richieste che lavorano su file (NULL se FileThreadsInPool è 0)
+static pool * iopool;
+
+//Modalità affinity: reactor e mailbox di ogni worker (NULL in modalità shared)
+static reactor ** wrct;
+static mailbox_t ** mbox;
 
 //Struttura che memorizza gli utenti registrati/connessi
 users_struct_t * usr;
 
-//fd_set per la select
-fd_set set;
-//Mutex per: fd_set set
-static pthread_mutex_t mtx_set = PTHREAD_MUTEX_INITIALIZER;
+//Reactor (epoll) del main: socket di ascolto e, in modalità shared, la prima parte dei client
+reactor * rct;
+//Reactor fra cui vengono distribuiti i client in modalità shared (loops[0]==rct),
+//quelli successivi al primo hanno ciascuno un proprio thread
+static reactor ** loops;
+static int nloops;
+static pthread_t * loopthreads;
+//Socket di ascolto del server
+static int fd_sk;
+
+//Stato delle connessioni (parser incrementale), indicizzato per fd
+static conn_t ** conns;
+static long maxconns;
 
-//MUTEXAGGIUNTA ESKEREEE
-static pthread_mutex_t mtx_online=PTHREAD_MUTEX_INITIALIZER;
+//Mutex per le scritture sui socket dei client, indicizzate per fd
+static pthread_mutex_t * mtx_fd;
+
+/**
+ * @brief Restituisce il reactor in cui è registrata una connessione
+ */
+static inline reactor * connReactor(conn_t * c){
+	return wrct ? wrct[c->worker] : loops[c->loop];
+}
+
+/**
+ * @brief Restituisce l'istante corrente in ns (CLOCK_MONOTONIC)
+ */
+static long long nowNs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
 
 //Struttura che memorizza le statistiche del server
-struct statistics chattyStats = {0,0,0,0,0,0,0};
+struct statistics chattyStats = {0,0,0,0,0,0,0,0};
 static pthread_mutex_t mtxstats = PTHREAD_MUTEX_INITIALIZER;
+
+//Ridimensionamenti del pool non ancora scritti nel file delle statistiche (i più recenti)
+#define RESIZE_LOG 64
+static char resizeLog[RESIZE_LOG][64];
+static int nresize;
 //Funzione che aggiorna le statistiche del server
 static void updateStats(int reg, int conn, int del, int ndel, int fdel, int fndel, int err){
 	pthread_mutex_lock(&mtxstats);
@@ -90,6 +136,8 @@ static void updateStats(int reg, int conn, int del, int ndel, int fdel, int fnde
 	chattyStats.nfilenotdelivered+=fndel;
 	chattyStats.nerrors+=err;
 	pthread_mutex_unlock(&mtxstats);
+	//Si è liberato un posto: riarmo il socket di ascolto nel caso il main avesse sospeso le accept
+	if(conn<0) reactorRearmListen(rct,fd_sk);
 }
 
 //Variabile per terminazione Server
@@ -97,21 +145,54 @@ volatile sig_atomic_t alive=1;
 
 /**
  * @brief Funzione di terminazione Server (SIGINT/SIGQUIT/SIGTERM)
+ *
+ * Nel signal handler si eseguono solo operazioni async-signal-safe:
+ * si azzera alive e si risveglia il main tramite il canale di notifica
+ * del reactor, sarà poi il main a inviare il messaggio di terminazione ai worker.
  */
 void terminateServer(){
 	alive=0;
-	enQueue(coda,KILLTHREAD); //Messaggio speciale di terminazione
-	pthread_cond_broadcast(&(coda->cnd1));
+	if(rct) reactorWakeup(rct);
+}
+
+/**
+ * @brief Registra un ridimensionamento del pool dei worker (pool_policy::report)
+ *
+ * @param from worker attivi prima della decisione
+ * @param to worker attivi dopo la decisione
+ * @param wait attesa in coda (ns) che ha causato l'ampliamento, 0 per le riduzioni
+ */
+static void reportResize(int from, int to, long wait){
+	pthread_mutex_lock(&mtxstats);
+	chattyStats.nworkers=to;
+	char * line=resizeLog[nresize%RESIZE_LOG];
+	if(to>from) snprintf(line,64,"%ld # pool %d -> %d (attesa %ld ms)",(long)time(NULL),from,to,wait/1000000);
+	else snprintf(line,64,"%ld # pool %d -> %d (inattivo)",(long)time(NULL),from,to);
+	nresize++;
+	pthread_mutex_unlock(&mtxstats);
 }
 
 /**
  * @brief Funzione che stampa le statistiche del Server (SIGUSR1)
+ *
+ * Prima della riga delle statistiche vengono scritte, come commenti ("#"),
+ * le decisioni di ridimensionamento del pool prese dalla stampa precedente.
  */
 void plotStats(){
 	FILE * fd;
 	fd=fopen(config->StatFileName,"a");
 	if(fd){
+		//Stato delle tabelle hash degli utenti (per dimensionare MaxConnections)
+		hashmap_stats hs;
+		int nread=getUsersHashStats(usr,&hs);
+		fprintf(fd,"%ld # utenti %zu, %zu posizioni, distanza max %zu, %d ampliamenti, %d in rehash",
+			(long)time(NULL),hs.count,hs.nslots,hs.maxdist,hs.nresize,hs.rehashing);
+		if(nread<USER_SHARDS) fprintf(fd," (%d partizioni occupate)",USER_SHARDS-nread);
+		fprintf(fd,"\n");
 		pthread_mutex_lock(&mtxstats);
+		int first=(nresize>RESIZE_LOG) ? nresize-RESIZE_LOG : 0;
+		for(int i=first; i<nresize; i++) fprintf(fd,"%s\n",resizeLog[i%RESIZE_LOG]);
+		nresize=0;
 		printStats(fd);
 		pthread_mutex_unlock(&mtxstats);
 	}
@@ -162,6 +243,238 @@ void signalHandler(){
 	}
 }
 
+/**
+ * @brief Avvia l'invio della coda in uscita di una connessione (mtx_fd[fd] acquisita)
+ *
+ * Se la coda era vuota prima dell'ultimo inserimento si prova subito a svuotarla,
+ * altrimenti un invio è già in corso ed i nuovi dati verranno raccolti nella
+ * stessa writev. Se il socket non accetta tutto si attende che torni scrivibile.
+ *
+ * @param c connessione
+ * @param wasEmpty 1 se la coda era vuota prima dell'inserimento
+ * @return 1 in caso di successo, -1 in caso di errore
+ */
+static int startFlush(conn_t * c, int wasEmpty){
+	if(!wasEmpty) return 1;
+	int ret=flushConn(c);
+	if(ret==0 && reactorWatchWrite(connReactor(c),c->fd)==-1) return -1;
+	return (ret<0) ? -1 : 1;
+}
+
+/**
+ * @brief Invia un messaggio ad un client senza mai bloccarsi (mtx_fd[fd] acquisita)
+ *
+ * Il messaggio viene scritto con una sola writev direttamente dai buffer del
+ * chiamante; solo la parte che il socket non accetta viene copiata nella coda
+ * in uscita, e in quel caso si attende che il fd torni scrivibile.
+ *
+ * @param c connessione del destinatario
+ * @param hdr header da inviare
+ * @param reqid id della richiesta a cui si risponde (0 per le notifiche)
+ * @param data parte dati da inviare (NULL se va inviato solo l'header)
+ * @return 1 in caso di successo, -1 in caso di errore
+ */
+static int pushMsg(conn_t * c, message_hdr_t * hdr, unsigned int reqid, message_data_t * data){
+	int wasEmpty=(c->outhead==NULL);
+	int ret=sendConnMsg(c,hdr,reqid,data);
+	if(ret==0 && wasEmpty && reactorWatchWrite(connReactor(c),c->fd)==-1) return -1;
+	return (ret<0) ? -1 : 1;
+}
+
+/**
+ * @brief Invia una risposta (header ed eventuale parte dati) ad un client
+ *
+ * Il Worker non resta mai bloccato su un client lento (ciò che il socket non
+ * accetta resta nella coda in uscita) e le scritture verso lo stesso fd
+ * (risposte e consegne) non possono mescolarsi fra loro.
+ *
+ * @param fd fd del client
+ * @param hdr header da inviare
+ * @param data parte dati da inviare (NULL se va inviato solo l'header)
+ * @return 1 in caso di successo, <=0 in caso di errore
+ */
+static int sendReply(int fd, message_hdr_t * hdr, message_data_t * data){
+	int ret=-1;
+	pthread_mutex_lock(&mtx_fd[fd]);
+	conn_t * c=conns[fd];
+	if(c) ret=pushMsg(c,hdr,c->reqid,data);
+	pthread_mutex_unlock(&mtx_fd[fd]);
+	return ret;
+}
+
+/**
+ * @brief Invia la risposta ad una CONNECT_OP ed attiva le opzioni di protocollo accettate
+ *
+ * La risposta viene inviata ancora nel formato precedente, le opzioni valgono
+ * dal messaggio successivo. Il cambio avviene con mtx_fd[fd] acquisita, quindi
+ * nessuna consegna concorrente può finire a metà fra i due formati.
+ *
+ * @param fd fd del client
+ * @param hdr header da inviare
+ * @param data parte dati da inviare (NULL se va inviato solo l'header)
+ * @param proto opzioni di protocollo accettate
+ * @return 1 in caso di successo, <=0 in caso di errore
+ */
+static int sendConnectReply(int fd, message_hdr_t * hdr, message_data_t * data, unsigned int proto){
+	int ret=-1;
+	pthread_mutex_lock(&mtx_fd[fd]);
+	conn_t * c=conns[fd];
+	if(c){
+		ret=pushMsg(c,hdr,c->reqid,data);
+		c->proto=proto;
+	}
+	pthread_mutex_unlock(&mtx_fd[fd]);
+	return ret;
+}
+
+/**
+ * @brief Invia un messaggio inoltrato ad un client online
+ *
+ * A differenza delle risposte, se il client non sta smaltendo la propria coda
+ * (oltre OutQueueHighWater byte) il messaggio viene scartato: resta comunque
+ * nella history del destinatario come messaggio non consegnato.
+ * In modalità affinity, se il destinatario appartiene ad un altro worker, il
+ * messaggio viene lasciato nella mailbox di quel worker, che lo invierà dal
+ * proprio thread (vedi drainMailbox).
+ *
+ * @param from connessione del mittente (servita dal worker chiamante)
+ * @param fd fd del destinatario
+ * @param hdr header da inviare
+ * @param data parte dati da inviare
+ * @return 1 se il messaggio è stato inviato (o accodato), 0 se è stato scartato, -1 in caso di errore
+ */
+static int deliverMsg(conn_t * from, int fd, message_hdr_t * hdr, message_data_t * data){
+	int ret=-1, owner=-1;
+	pthread_mutex_lock(&mtx_fd[fd]);
+	conn_t * c=conns[fd];
+	if(c){
+		if(c->outbytes>config->OutQueueHighWater) ret=0;
+		else if(mbox && c->worker!=from->worker){
+			int wasEmpty=postMail(mbox[c->worker],c,hdr,data);
+			if(wasEmpty==1) owner=c->worker;
+			ret=(wasEmpty<0) ? -1 : 1;
+		}
+		else ret=pushMsg(c,hdr,0,data);
+	}
+	pthread_mutex_unlock(&mtx_fd[fd]);
+	//Il proprietario viene risvegliato solo dal primo messaggio, gli altri li trova insieme
+	if(owner>=0) reactorWakeup(wrct[owner]);
+	return ret;
+}
+
+/**
+ * @brief Invia con una sola chiamata io_uring le code in uscita di più connessioni
+ *
+ * Il chiamante ha accodato dei messaggi in code che erano vuote, quindi è lui
+ * a doverle inviare (come in startFlush): gli altri thread nel frattempo
+ * possono solo accodare. Le mtx_fd delle connessioni restano acquisite fino
+ * al completamento delle scritture (un socket non bloccante completa subito);
+ * nessun altro thread acquisisce più di una mtx_fd alla volta, quindi non
+ * possono esserci attese circolari. Ciò che il socket non accetta viene
+ * inviato come in startFlush.
+ *
+ * @param ring istanza io_uring del chiamante
+ * @param fds fd delle connessioni
+ * @param ids conn_t::id delle connessioni al momento dell'inserimento
+ * @param n numero di connessioni
+ * @return 0 in caso di successo, -1 se io_uring ha restituito un errore (le
+ * code vengono comunque inviate con writev, ma l'istanza non va più usata)
+ */
+static int batchSend(uring * ring, long * fds, unsigned long * ids, int n){
+	struct iovec iov[WRITE_BATCH][OUT_IOV];
+	int res[WRITE_BATCH];
+	int prepared=0, ret=0;
+	for(int i=0; i<n; i++){
+		pthread_mutex_lock(&mtx_fd[fds[i]]);
+		conn_t * c=conns[fds[i]];
+		res[i]=0;
+		if(!c || c->id!=ids[i]) continue;
+		int cnt=outIov(c,iov[i]);
+		if(cnt>0 && uringPrepWritev(ring,fds[i],iov[i],cnt,i)==0) prepared++;
+	}
+	if(prepared>0){
+		if(uringRun(ring)<0){
+			perror("io_uring: torno alle writev");
+			ret=-1;
+		}
+		unsigned long long tag;
+		int r;
+		while(uringReap(ring,&tag,&r)) res[tag]=r;
+	}
+	for(int i=0; i<n; i++){
+		conn_t * c=conns[fds[i]];
+		if(c && c->id==ids[i]){
+			if(res[i]>0) outSent(c,res[i]);
+			//Il resto (o tutto, se la scrittura non è riuscita) lo invia startFlush
+			if(c->outhead) startFlush(c,1);
+		}
+		pthread_mutex_unlock(&mtx_fd[fds[i]]);
+	}
+	return ret;
+}
+
+/**
+ * @brief Costruisce il path in DirName in cui salvare il file di una POSTFILE_OP
+ *
+ * Dal nome inviato dal client viene tolto l'eventuale percorso ("./", "dir/").
+ *
+ * @param msg richiesta POSTFILE_OP (msg->data.buf contiene il nome del file)
+ * @return il path allocato sullo heap
+ */
+static char * uploadPath(message_t * msg){
+	char * filep;
+	int len=strlen(config->DirName)+1;
+	//Cerco eventuali "./"
+	char * bslash;
+	bslash=strrchr(msg->data.buf,'/');
+	if(bslash){
+		bslash++;
+		len=len+strlen(bslash)+1;
+	}
+	else{
+		len=len+msg->data.hdr.len;
+	}
+	filep=malloc(sizeof(char)*len);
+	strncpy(filep,config->DirName,strlen(config->DirName)+1);
+	strncat(filep,"/",2);
+	if(bslash) strncat(filep,bslash,strlen(bslash)+1);
+	else strncat(filep,msg->data.buf,msg->data.hdr.len);
+	return filep;
+}
+
+/**
+ * @brief Prepara la destinazione del file in arrivo con una POSTFILE_OP
+ *
+ * Chiamata dal reactor appena letto l'header del file: se il file supera
+ * MaxFileSize i suoi byte verranno scartati senza essere memorizzati, altrimenti
+ * vengono scritti in un file temporaneo che il Worker rinomina a richiesta
+ * completata (così un upload interrotto non lascia file parziali in DirName).
+ *
+ * @param c connessione del client
+ * @return 0 in caso di successo, -1 in caso di errore
+ */
+static int openUpload(conn_t * c){
+	if(c->file.hdr.len/1024>config->MaxFileSize) return setFileSink(c,-1,NULL);
+	char * filep=uploadPath(&(c->msg));
+	size_t len=strlen(filep)+32;
+	char * tmp=malloc(sizeof(char)*len);
+	if(!tmp){
+		free(filep);
+		return -1;
+	}
+	snprintf(tmp,len,"%s.part%ld",filep,c->fd);
+	free(filep);
+	int f=open(tmp,O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0666);
+	if(f<0){
+		perror("Open file in POSTFILE_OP");
+		free(tmp);
+		return -1;
+	}
+	int ret=setFileSink(c,f,tmp);
+	free(tmp);
+	return ret;
+}
+
 /**
  * @brief Funzione usata dai Thread Worker per gestire le OP
  *
@@ -171,10 +484,11 @@ void signalHandler(){
  *
  * @param fd filedescriptor del client da servire
  * @param msg il messaggio letto dal socket
+ * @param conn connessione del client (contiene il file ricevuto con una POSTFILE_OP)
  * @return 0 in caso di successo (il Server è riuscito a gestire la richiesta del client)
  * @return -1 in caso di fallimento
  */
-int executeReq(int fd, message_t msg){
+int executeReq(int fd, message_t msg, conn_t * conn){
 
 	//Messaggio di risposta
 	message_t reply;
@@ -182,7 +496,7 @@ int executeReq(int fd, message_t msg){
 	//Se il sender è nullo OP_FAIL
 	if(msg.hdr.sender == NULL || strlen(msg.hdr.sender)==0){
 		setHeader(&(reply.hdr),OP_FAIL,"");
-		sendHeader(fd,&(reply.hdr));
+		sendReply(fd,&(reply.hdr),NULL);
 		return -1;
 	}
 
@@ -190,18 +504,17 @@ int executeReq(int fd, message_t msg){
 
 	switch(op){ //Vari casi
 		case REGISTER_OP:{
-			int nOnline=-1;
-			char * usrOn;
+			online_list_t * usrOn=NULL;
 			if(registerUser(usr,msg.hdr.sender,fd)==0){
 				//OK! Nick registrato e connesso
 				updateStats(1,1,0,0,0,0,0);
 				printf("Registrato e Connesso\n");
 				fflush(stdout);
 
-				//Otteniamo ora la lista degli utenti connessi
-				nOnline = getOnlineList(usr,&usrOn);
+				//Otteniamo ora la lista degli utenti connessi (condivisa, non va modificata)
+				usrOn = getOnlineList(usr);
 				setHeader(&(reply.hdr), OP_OK, "");
-				setData(&(reply.data),"",usrOn,nOnline*(MAX_NAME_LENGTH+1));
+				if(usrOn) setData(&(reply.data),"",usrOn->names,usrOn->n*(MAX_NAME_LENGTH+1));
 			}
 			else{//Errore Registrazione
 				//Aggiorno le statistiche (operazioni fallite)
@@ -212,26 +525,21 @@ int executeReq(int fd, message_t msg){
 				setHeader(&(reply.hdr), OP_NICK_ALREADY, "");
 				//L'errore comprende anche l'inserimento in hashtable...
 			}
-			//Invio i messaggi al client
-			if(sendHeader(fd,&(reply.hdr))<=0){ //Se c'è un errore
-				printf("Errore in REGISTER_OP: sendHeader\n");
+			//Invio i messaggi al client (la lista online solo se la richiesta è andata a buon fine)
+			if(sendReply(fd,&(reply.hdr),(usrOn) ? &(reply.data) : NULL)<=0){
+				printf("Errore in REGISTER_OP: sendReply\n");
+				releaseOnlineList(usrOn);
 				return -1;
 			}
-			if(nOnline>=0){//Se devo inviare anche lista online
-				if(sendData(fd,&(reply.data))<=0){
-					printf("Errore in REGISTER_OP: sendData\n");
-					free(usrOn);
-					return -1;
-				}
-				free(usrOn);
-			}
+			releaseOnlineList(usrOn);
 			printf("FINE REGISTER_OP\n");
 		}break;
 
 		case CONNECT_OP:{
 			int ret;
-			int nOnline=-1;
-			char * usrOn;
+			online_list_t * usrOn=NULL;
+			unsigned int proto=0;
+			char caps[MAX_NAME_LENGTH+1];
 			//Provo a connettermi
 			ret=connectUser(usr,msg.hdr.sender,fd);
 			if(ret==0){//CONNESSO!
@@ -239,9 +547,12 @@ int executeReq(int fd, message_t msg){
 				fflush(stdout);
 				updateStats(0,1,0,0,0,0,0);
 				//Otteniamo la lista degli utenti connessi
-				nOnline = getOnlineList(usr,&usrOn);
+				usrOn = getOnlineList(usr);
+				//Opzioni di protocollo richieste dal client (campo receiver) ed accettate
+				proto=parseProto(msg.data.hdr.receiver,MAX_NAME_LENGTH+1) & PROTO_ALL;
+				protoToString(proto,caps);
 				setHeader(&(reply.hdr), OP_OK, "");
-				setData(&(reply.data),"",usrOn,nOnline*(MAX_NAME_LENGTH+1));
+				if(usrOn) setData(&(reply.data),caps,usrOn->names,usrOn->n*(MAX_NAME_LENGTH+1));
 			}
 			else{//Errore nella connessione
 				updateStats(0,0,0,0,0,0,1);
@@ -256,20 +567,13 @@ int executeReq(int fd, message_t msg){
 				}
 			}
 
-			//Invio i messaggi al client
-			//Invio header
-			if(sendHeader(fd,&(reply.hdr))<=0){ //Se c'è un errore, dealloco
-				printf("Errore in CONNECT_OP: sendHeader\n");
+			//Invio i messaggi al client (la lista online solo se la richiesta è andata a buon fine)
+			if(sendConnectReply(fd,&(reply.hdr),(usrOn) ? &(reply.data) : NULL,proto)<=0){
+				printf("Errore in CONNECT_OP: sendReply\n");
+				releaseOnlineList(usrOn);
 				return -1;
 			}
-			if(nOnline>=0){ //Se ho da inviare data invio
-				if(sendData(fd,&(reply.data))<=0){
-					printf("Errore in CONNECT_OP: sendData\n");
-					free(usrOn);
-					return -1;
-				}
-				free(usrOn);
-			}
+			releaseOnlineList(usrOn);
 			printf("Fine CONNECT_OP\n");
 			fflush(stdout);
 		}break;
@@ -286,7 +590,7 @@ int executeReq(int fd, message_t msg){
 				updateStats(0, 0, 0, 0, 0, 0, 1);
 				setHeader(&(reply.hdr), OP_MSG_TOOLONG, "");
 				//Invio il messaggio di errore
-				if(sendHeader(fd,&(reply.hdr))<=0){ //Se c'è un errore, dealloco
+				if(sendReply(fd,&(reply.hdr),NULL)<=0){ //Se c'è un errore, dealloco
 					printf("Errore in POSTTXT_OP: sendHeader\n");
 					return -1;
 				}
@@ -302,26 +606,24 @@ int executeReq(int fd, message_t msg){
 					updateStats(0, 0, 0, 1, 0, 0, 0);
 					setHeader(&(reply.hdr),OP_OK,"");
 				}
-				else{
+				else{//Non entra nella history: non lo consegno e lo segnalo al mittente
 					printf("Errore in POSTTXT_OP: postOnHistory\n");
 					fflush(stdout);
-					return -1;
+					updateStats(0, 0, 0, 0, 0, 0, 1);
+					setHeader(&(reply.hdr),OP_FAIL,"");
 				}
-				if(receiver_fd!=0){//Vuol dire che l'user è online, invio direttamente
+				if(reply.hdr.op==OP_OK && receiver_fd!=0){//Vuol dire che l'user è online, invio direttamente
 					//Travasiamo il messaggio
 					char * buf = malloc(sizeof(char)*msg.data.hdr.len);
 					strncpy(buf,msg.data.buf,msg.data.hdr.len);
 					setHeader(&(new.hdr),msg.hdr.op,msg.hdr.sender);
 					setData(&(new.data),msg.data.hdr.receiver,buf,msg.data.hdr.len);
-					pthread_mutex_lock(&mtx_online);
-					if(sendRequest(receiver_fd,&new)==1){
-						pthread_mutex_unlock(&mtx_online);
+					if(deliverMsg(conn,receiver_fd,&(new.hdr),&(new.data))==1){
 						printf("Messaggio inviato all'utente online!!!\n");
 						updateStats(0, 0, 1, -1, 0, 0, 0);
 						free(buf); //buf==new.data.buf
 					}
 					else{
-						pthread_mutex_unlock(&mtx_online);
 						printf("Errore in POSTTXT_OP: l'user si è scollegato\n");
 						free(buf);  //buf==new.data.buf
 						fflush(stdout);
@@ -333,7 +635,7 @@ int executeReq(int fd, message_t msg){
 				setHeader(&(reply.hdr),OP_NICK_UNKNOWN,"");
 			}
 			//Invio finale messaggio
-			if(sendHeader(fd,&(reply.hdr))<=0){ //Se c'è un errore, dealloco
+			if(sendReply(fd,&(reply.hdr),NULL)<=0){ //Se c'è un errore, dealloco
 				printf("Errore in POSTTXT_OP: sendHeader\n");
 				return -1;
 			}
@@ -377,13 +679,10 @@ int executeReq(int fd, message_t msg){
 					setData(&(new.data),msg.data.hdr.receiver,buf,msg.data.hdr.len);
 					//Inviamo a tutti gli user online
 					for(int i=0; i<nOnline; i++){
-						pthread_mutex_lock(&mtx_online);
-						if(sendRequest(fdlist[i],&new)==1){ //ignoriamo eventuali users disconnessi
-							pthread_mutex_unlock(&mtx_online);
+						if(deliverMsg(conn,fdlist[i],&(new.hdr),&(new.data))==1){ //ignoriamo eventuali users disconnessi
 							updateStats(0,0,1,0,0,0,0);
 						}
 						else{
-							pthread_mutex_unlock(&mtx_online);
 						}
 						printf("Inviato a %d!\n",fdlist[i]);
 						fflush(stdout);
@@ -393,64 +692,29 @@ int executeReq(int fd, message_t msg){
 				free(fdlist);
 			}
 			//rispondo al client che ne ha fatto richiesta:
-			if(sendHeader(fd,&(reply.hdr))<=0){ //Se c'è un errore, dealloco
+			if(sendReply(fd,&(reply.hdr),NULL)<=0){ //Se c'è un errore, dealloco
 				printf("Errore in POSTTXT_OP: sendHeader\n");
 				return -1;
 			}
 		}break;
 
 	    case POSTFILE_OP:{
-			message_data_t new;
-			readData(fd,&new);
-			//Controllo la lunghezza
-			int len=new.hdr.len;
-			if(len/1024>config->MaxFileSize){
+			//Il contenuto del file è già stato scritto dal reactor in un file temporaneo
+			//(o scartato, se l'header indicava un file troppo grande)
+			int len=conn->file.hdr.len;
+			//Il nome del file finisce nella history: deve entrare in una sua posizione
+			if(len/1024>config->MaxFileSize || msg.data.hdr.len>msgQueueSlot(usr->msgsize)){
 				//Messaggio troppo lungo
 				printf("Messaggio troppo lungo\n");
 				fflush(stdout);
 				updateStats(0, 0, 0, 0, 0, 0, 1);
 				setHeader(&(reply.hdr), OP_MSG_TOOLONG, "");
-				free(new.buf);
 			}
 			else{
-				//Mi costruisco il path
-				char * filep;
-				int len=strlen(config->DirName)+1;
-				//Cerco eventuali "./"
-				char * bslash;
-				bslash=strrchr(msg.data.buf,'/');
-				if(bslash){
-					bslash++;
-					len=len+strlen(bslash)+1;
-				}
-				else{
-					len=len+msg.data.hdr.len;
-				}
-				filep=malloc(sizeof(char)*len);
-				strncpy(filep,config->DirName,strlen(config->DirName)+1);
-				strncat(filep,"/",2);
-				if(bslash) strncat(filep,bslash,strlen(bslash)+1);
-				else strncat(filep,msg.data.buf,msg.data.hdr.len);
-
-				//File pronto!
-				FILE * fsend;
-				fsend=fopen(filep,"wb");
-				if(fsend){//Se riesco ad aprirlo
+				//Sposto il file ricevuto nella cartella dei file
+				char * filep=uploadPath(&msg);
+				if(commitFileSink(conn,filep)==0){//Se riesco a spostarlo
 					free(filep);
-					//Scrivo
-					int wt;
-					wt = fwrite(new.buf,sizeof(char),new.hdr.len,fsend);
-					fflush(fsend);
-					if(wt!=new.hdr.len){
-						printf("Damn...\n");
-						fflush(stdout);
-						fclose(fsend);
-						free(new.buf);
-						return -1; //Errore
-					}
-					//Sono riuscito a scrivere!
-					free(new.buf);
-					fclose(fsend);
 					//Mi faccio dare il fd del receiver
 					int receiver_fd=getUserFD(usr,msg.data.hdr.receiver);
 					if(receiver_fd>=0){//Se l'user esiste (e ho/non ho il suo fd)
@@ -462,24 +726,23 @@ int executeReq(int fd, message_t msg){
 							updateStats(0, 0, 0, 0, 0, 1, 0);
 							setHeader(&(reply.hdr),OP_OK,"");
 						}
-						else{
+						else{//Non entra nella history: non lo consegno e lo segnalo al mittente
 							printf("Errore in POSTFILE_OP: postOnHistory\n");
 							fflush(stdout);
+							updateStats(0, 0, 0, 0, 0, 0, 1);
+							setHeader(&(reply.hdr),OP_FAIL,"");
 						}
-						if(receiver_fd!=0){//Vuol dire che l'user è online, invio direttamente
+						if(reply.hdr.op==OP_OK && receiver_fd!=0){//Vuol dire che l'user è online, invio direttamente
 							message_t new1;
 							setHeader(&(new1.hdr),msg.hdr.op,msg.hdr.sender);
 							setData(&(new1.data),msg.data.hdr.receiver,msg.data.buf,msg.data.hdr.len);
 							printMsg(&new1);
-							pthread_mutex_lock(&mtx_online);
-							if(sendRequest(receiver_fd,&new1)==1){
-								pthread_mutex_unlock(&mtx_online);
+							if(deliverMsg(conn,receiver_fd,&(new1.hdr),&(new1.data))==1){
 								printf("FILE inviato direttamente\n");
 								fflush(stdout);
 								updateStats(0, 0, 0, 0, 1, -1, 0);
 							}
 							else{
-								pthread_mutex_unlock(&mtx_online);
 								printf("Errore in POSTTXT_OP: sendRequest\n");
 								fflush(stdout);
 							}
@@ -490,16 +753,15 @@ int executeReq(int fd, message_t msg){
 						setHeader(&(reply.hdr),OP_NICK_UNKNOWN,"");
 					}
 				}
-				else{//Fail! Non sono riuscito ad aprirlo
-					perror("Open file in POSTFILE_OP");
-					free(new.buf);
+				else{//Fail! Non sono riuscito a spostarlo
+					perror("Rename file in POSTFILE_OP");
 					free(filep);
 					return -1;
 				}
 
 			}
 			//Invio il messaggio di risposta
-			if(sendHeader(fd,&(reply.hdr))<=0){ //Se c'è un errore, dealloco
+			if(sendReply(fd,&(reply.hdr),NULL)<=0){ //Se c'è un errore, dealloco
 				printf("Errore in POSTTXT_OP: sendHeader\n");
 				return -1;
 			}
@@ -514,60 +776,36 @@ int executeReq(int fd, message_t msg){
 			strncat(filep,"/",strlen("/")+1);
 			strncat(filep,msg.data.buf,strlen(msg.data.buf)+1);
 
-			//Lo mappo in memoria
 			int f = open(filep, O_RDONLY);
+			free(filep);
 			if(f<0){//Se non riesco ad aprire il file: mando errore
 				setHeader(&(reply.hdr),OP_NO_SUCH_FILE,"");
-				if(sendHeader(fd,&(reply.hdr))<=0){ //Errore
-					free(filep);
-					return -1;
-				}
+				if(sendReply(fd,&(reply.hdr),NULL)<=0) return -1; //Errore
 			}
 			else{
-				char * filem;
 				struct stat st;
-		        if (stat(filep, &st) == -1 || !S_ISREG(st.st_mode)) {
-					updateStats(0, 0, 0, 0, 0, 0, 1);
-					setHeader(&(reply.hdr), OP_NO_SUCH_FILE, "");
-					if(sendHeader(fd, &(reply.hdr))<= 0){
-						close(f);
-						free(filep);
-						return -1;
-					}
-		        }
-
-		        // Leggo il file
-		   		filem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f, 0);
-
-		        // Errore mmap mando errore al client
-				if (filem == MAP_FAILED) {
+		        if (fstat(f, &st) == -1 || !S_ISREG(st.st_mode)) {
 					close(f);
 					updateStats(0, 0, 0, 0, 0, 0, 1);
 					setHeader(&(reply.hdr), OP_NO_SUCH_FILE, "");
-					if(sendHeader(fd, &(reply.hdr))<=0){
-						free(filep);
-						return -1;
-					}
+					if(sendReply(fd,&(reply.hdr),NULL)<= 0) return -1;
 		        }
 		        // File pronto per essere inviato
 				else{
-					close(f);
 					updateStats(0, 0, 0, 0, 1, -1, 0);
-					// Invio header
 					setHeader(&(reply.hdr), OP_OK, "");
-					if(sendHeader(fd, &(reply.hdr))<=0){
-						free(filep);
-						return -1;
-	          		}
-
-					// Invio dati
-					setData(&(reply.data), "", filem, st.st_size);
-					if(sendData(fd, &(reply.data))<0){
-						free(filep);
-						return -1;
+					setData(&(reply.data), "", NULL, st.st_size);
+					//Il contenuto non passa dalla memoria del server: la coda lo invia con sendfile
+					int ret=-1;
+					pthread_mutex_lock(&mtx_fd[fd]);
+					conn_t * c=conns[fd];
+					if(c){
+						int wasEmpty=(c->outhead==NULL);
+						if(queueFile(c,&(reply.hdr),c->reqid,&(reply.data),f)==0) ret=startFlush(c,wasEmpty);
 					}
-					munmap(filem,st.st_size);
-					free(filep);
+					else close(f);
+					pthread_mutex_unlock(&mtx_fd[fd]);
+					if(ret<0) return -1;
 		        }
 		      }
 			  printf("FINE OP GETFILE SENDER[%s]\n", msg.hdr.sender);
@@ -575,32 +813,36 @@ int executeReq(int fd, message_t msg){
 		}break;
 
 	    case GETPREVMSGS_OP:{
-			msgqueue_t * ret=getHistory(usr,msg.hdr.sender);
-			if(ret){//Se va a buon fine
-				size_t nummsg= ret->size;
+			message_t * hist;
+			int n=getHistory(usr,msg.hdr.sender,&hist);
+			if(n>=0){//Se va a buon fine
+				size_t nummsg= n;
 				setHeader(&(reply.hdr), OP_OK, "");
 				setData(&(reply.data),"",(char *)&nummsg,sizeof(size_t));
-				//Invio l'esito che siamo pronti ad inviare altri messsaggi
-				if(sendRequest(fd,&reply)<=0){ //Se c'è un errore nell'invio esco
+				//La history viene accodata per intero senza consegne intermedie
+				int sent=-1;
+				pthread_mutex_lock(&mtx_fd[fd]);
+				conn_t * c=conns[fd];
+				if(c){
+					int wasEmpty=(c->outhead==NULL);
+					//Invio l'esito che siamo pronti ad inviare altri messsaggi
+					sent=queueMsg(c,&(reply.hdr),c->reqid,&(reply.data));
+					for(int i=0; sent==0 && i<n; i++){
+						printMsg(&hist[i]);
+						sent=queueMsg(c,&(hist[i].hdr),c->reqid,&(hist[i].data));
+					}
+					if(sent==0) sent=startFlush(c,wasEmpty);
+				}
+				pthread_mutex_unlock(&mtx_fd[fd]);
+				freeHistory(hist,n);
+				if(sent<0){ //Se c'è un errore nell'invio esco
 					printf("Errore in GETPREVMSGS_OP: sendHeader\n");
 					return -1;
 				}
-				if(ret->size>0){
-					msgnode_t * curr = ret->head;
-					while(curr){
-						printMsg(curr->msg);
-						if(sendRequest(fd,curr->msg)<=0){
-							printf("Errore in GETPREVMSGS_OP: sendHeader\n");
-							return -1;
-						}
-						curr=curr->next;
-					}
-				}
-				destroyMsgQueue(ret);
 			}
 			else{//Non c'è nessuna lista
 				setHeader(&(reply.hdr), OP_FAIL, "");
-				if(sendHeader(fd,&(reply.hdr))<=0){ //Se c'è un errore
+				if(sendReply(fd,&(reply.hdr),NULL)<=0){ //Se c'è un errore
 					printf("Errore in GETPREVMSGS_OP: sendHeader\n");
 					return -1;
 				}
@@ -609,25 +851,19 @@ int executeReq(int fd, message_t msg){
 		}break;
 
 	    case USRLIST_OP:{
-			int nOnline=-1;
-			char * usrOn;
-			nOnline = getOnlineList(usr,&usrOn);
+			online_list_t * usrOn = getOnlineList(usr);
 			setHeader(&(reply.hdr), OP_OK, "");
-			setData(&(reply.data),"",usrOn,usr->usersOnline*(MAX_NAME_LENGTH+1));
+			if(usrOn){
+				if(conn->proto & PROTO_V2) setData(&(reply.data),"",usrOn->packed,usrOn->packedlen);
+				else setData(&(reply.data),"",usrOn->names,usrOn->n*(MAX_NAME_LENGTH+1));
+			}
 			//Invio i messaggi al client
-			if(sendHeader(fd,&(reply.hdr))<=0){ //Se c'è un errore, dealloco
-				printf("Errore in USRLIST_OP: sendHeader\n");
-				free(usrOn);
+			if(sendReply(fd,&(reply.hdr),(usrOn) ? &(reply.data) : NULL)<=0){ //Se c'è un errore, dealloco
+				printf("Errore in USRLIST_OP: sendReply\n");
+				releaseOnlineList(usrOn);
 				return -1;
 			}
-			if(nOnline!=-1){
-				if(sendData(fd,&(reply.data))<=0){
-					printf("Errore in USRLIST_OP: sendData\n");
-					free(usrOn);
-					return -1;
-				}
-				free(usrOn);
-			}
+			releaseOnlineList(usrOn);
 		}break;
 
 	    case UNREGISTER_OP:{
@@ -642,7 +878,7 @@ int executeReq(int fd, message_t msg){
 				setHeader(&(reply.hdr),OP_NICK_UNKNOWN,"");
 			}
 			//Invio il messaggio
-			if(sendHeader(fd, &(reply.hdr))<=0)	return -1;
+			if(sendReply(fd,&(reply.hdr),NULL)<=0)	return -1;
 		}break;
 
 	    case DISCONNECT_OP:{
@@ -657,67 +893,514 @@ int executeReq(int fd, message_t msg){
 				setHeader(&(reply.hdr),OP_NICK_UNKNOWN,"");
 			}
 			//Invio il messaggio
-			if(sendHeader(fd, &(reply.hdr))<=0)	return -1;
+			if(sendReply(fd,&(reply.hdr),NULL)<=0)	return -1;
 			//Andata a buon fine
 		}break;
 
 		default:{
 			//Operazione sconosciuta
 			setHeader(&(reply.hdr),OP_FAIL,"");
-			sendHeader(fd,&(reply.hdr));
+			sendReply(fd,&(reply.hdr),NULL);
 			return -1; //Comunico al chiamante che deve disconnettere
 		}
 	}
 	return 0; //Tutto andato a buon fine!
 }
 
+/**
+ * @brief Disconnette e chiude il fd di un client
+ *
+ * Chiudendo il fd questo viene rimosso automaticamente dalle istanze epoll.
+ * Prima di chiudere si tenta un ultimo invio (non bloccante) dei dati in coda.
+ */
+static void closeClient(int client){
+	if(disconnectUser(usr,NULL,client)==0) updateStats(0,-1,0,0,0,0,0);
+	pthread_mutex_lock(&mtx_fd[client]);
+	if(conns[client]) flushConn(conns[client]);
+	destroyConn(conns[client]);
+	conns[client]=NULL;
+	close(client);
+	pthread_mutex_unlock(&mtx_fd[client]);
+}
+
+static void dispatchConn(int client, int buffered);
+
+/**
+ * @brief Riprende l'invio della coda in uscita di un client tornato scrivibile
+ *
+ * Se la lettura del client era sospesa (vedi dispatchConn) e la coda è scesa
+ * sotto OutQueueHighWater, la lettura riprende dalle richieste già nel buffer.
+ * Anche in caso di errore si riprende la lettura: la connessione viene chiusa
+ * dal lato lettura.
+ */
+static void resumeFlush(int client){
+	int resume=0;
+	pthread_mutex_lock(&mtx_fd[client]);
+	conn_t * c=conns[client];
+	if(c){
+		int ret=flushConn(c);
+		if(ret==0) reactorWatchWrite(connReactor(c),client);
+		if(c->readpaused && (ret<0 || c->outbytes<=config->OutQueueHighWater)){
+			c->readpaused=0;
+			resume=1;
+		}
+	}
+	pthread_mutex_unlock(&mtx_fd[client]);
+	if(resume) dispatchConn(client,1);
+}
+
+/**
+ * @brief Sospende la lettura di un client che non smaltisce le risposte
+ *
+ * Oltre OutQueueHighWater byte in coda il fd non viene riarmato in lettura:
+ * la coda non è vuota, quindi il fd è osservato in scrittura e resumeFlush
+ * riprenderà la lettura quando la coda scende sotto la soglia (nessun altro
+ * thread svuota una coda che non era vuota quando ha accodato).
+ *
+ * @return 1 se la lettura è stata sospesa, 0 altrimenti
+ */
+static int pauseRead(conn_t * c){
+	pthread_mutex_lock(&mtx_fd[c->fd]);
+	if(c->outbytes>config->OutQueueHighWater) c->readpaused=1;
+	int ret=c->readpaused;
+	pthread_mutex_unlock(&mtx_fd[c->fd]);
+	return ret;
+}
+
+/**
+ * @brief Esegue la richiesta completa di un client
+ *
+ * @param client fd del client
+ * @return 0 se la richiesta è andata a buon fine, -1 se il client va disconnesso
+ */
+static int serveReq(int client){
+	conn_t * c=conns[client];
+	printf("*------@START@------*\n");
+	printf("Client: %d\n",client);
+	printMsg(&(c->msg));
+	//Servo la richiesta del client
+	int esito=executeReq(client,c->msg,c);
+	resetConn(c);
+	//Controllo l'esito della richiesta
+	if(esito==0) printf("@OK: Servito\n\n");
+	else printf("@ERR: Client non servito!\n\n");
+	printf("*-------@END@-------*\n\n");
+	fflush(stdout);
+	return esito;
+}
+
+/**
+ * @brief Verifica se la richiesta completa di un client lavora su file
+ */
+static inline int fileReq(conn_t * c){
+	return (c->msg.hdr.op==POSTFILE_OP || c->msg.hdr.op==GETFILE_OP);
+}
+
+/**
+ * @brief Accoda un client in un pool, preferendo la coda locale di un worker
+ *
+ * Se la coda del worker è piena si prova con quelle degli altri: i lavori
+ * di qualunque coda vengono comunque rubati dai worker senza lavoro.
+ *
+ * @param p pool
+ * @param worker indice del worker preferito
+ * @param client fd del client
+ * @return 0 in caso di successo, -1 se tutte le code sono piene o il pool è chiuso
+ */
+static int submitConn(pool * p, int worker, int client){
+	for(int i=0; i<p->size; i++){
+		if(poolSubmit(p,(worker+i)%p->size,client)==0) return 0;
+	}
+	return -1;
+}
+
+/**
+ * @brief Prosegue la lettura di un client e decide come continuare
+ *
+ * Se il messaggio è completo viene accodato ai Worker (il fd resta disarmato
+ * grazie a EPOLLONESHOT finchè il worker non lo riarma), se è incompleto il fd
+ * viene riarmato, altrimenti il client viene disconnesso. Se nessuna coda dei
+ * worker ha posto la richiesta viene eseguita dal chiamante, che non può
+ * lasciare il fd disarmato senza che nessuno lo serva.
+ * In modalità affinity il chiamante è già il worker proprietario, che esegue
+ * subito la richiesta e passa a quelle successive già presenti nel buffer.
+ * Le richieste che lavorano su file (il contenuto di una POSTFILE_OP da
+ * scrivere su disco, una GETFILE_OP da aprire) passano invece al pool di I/O;
+ * se le sue code sono piene si procede come senza pool di I/O.
+ * Se il client non legge le risposte (coda in uscita oltre OutQueueHighWater)
+ * non si estraggono altre richieste e il fd non viene riarmato (vedi pauseRead).
+ *
+ * @param client fd del client
+ * @param buffered se diverso da 0 usa solo i byte già ricevuti (nessuna read)
+ */
+static void dispatchConn(int client, int buffered){
+	conn_t * c=conns[client];
+	//Un file in arrivo viene letto dal pool di I/O
+	if(iopool && c->state==PARSE_FILEBODY && submitConn(iopool,client%iopool->size,client)==0) return;
+	for(;;){
+		if(pauseRead(c)) return;
+		int ret=buffered ? readMsgBuffered(c) : readMsgNonBlock(c);
+		if(ret==2 && iopool && submitConn(iopool,client%iopool->size,client)==0){
+			//Header di un file in arrivo: il resto lo legge il pool di I/O
+			return;
+		}
+		if(ret==2){
+			//Header di un file in arrivo: scelgo dove scriverlo e continuo
+			if(openUpload(c)==0) ret=buffered ? readMsgBuffered(c) : readMsgNonBlock(c);
+			else{
+				ret=-1;
+				errno=EIO; //Non è un "riprova": chiudo la connessione
+			}
+		}
+		if(ret==1){
+			//Messaggio completo
+			if(iopool && fileReq(c) && submitConn(iopool,client%iopool->size,client)==0) return;
+			if(!mbox){
+				c->queued=nowNs();
+				if(submitConn(workers,c->worker,client)==0) return;
+				//Tutte le code sono piene (o il pool è in chiusura): la servo io
+				fprintf(stderr,"Code dei worker piene: client %d servito dal thread corrente\n",client);
+			}
+			if(serveReq(client)!=0) break;
+			buffered=1;
+		}
+		else if(ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+			//Messaggio incompleto: aspetto altri byte
+			reactorRearm(connReactor(c),client);
+			return;
+		}
+		else break; //Connessione chiusa o errore
+	}
+	closeClient(client);
+}
+
+/**
+ * @brief Restituisce una connessione al worker proprietario (modalità affinity)
+ *
+ * Il pool di I/O si ferma quando il lavoro su file è finito: il resto della
+ * richiesta e le richieste successive le serve il proprietario (vedi
+ * drainMailbox), l'unico che tocca lo stato della connessione e dei suoi
+ * destinatari.
+ *
+ * @param client fd del client
+ */
+static void handBack(int client){
+	conn_t * c=conns[client];
+	int owner=c->worker;
+	int wasEmpty=postResume(mbox[owner],c);
+	if(wasEmpty<0){
+		perror("postResume");
+		closeClient(client);
+	}
+	else if(wasEmpty==1) reactorWakeup(wrct[owner]);
+}
+
+/**
+ * @brief Prosegue nel pool di I/O una richiesta che lavora su file
+ *
+ * Il contenuto di una POSTFILE_OP viene trasferito nel file temporaneo finchè
+ * il socket ha byte disponibili (poi il fd viene riarmato e il reactor lo
+ * riaccoda qui); a richiesta completa la si esegue e si torna al percorso
+ * normale con le richieste successive già ricevute.
+ * In modalità affinity la connessione torna invece al worker proprietario
+ * appena finisce il lavoro su file: il trasferimento del contenuto per una
+ * POSTFILE_OP, l'invio del file per una GETFILE_OP.
+ *
+ * @param client fd del client
+ */
+static void serveFile(int client){
+	conn_t * c=conns[client];
+	int ret=1;
+	if(c->state!=PARSE_DONE) ret=readMsgNonBlock(c);
+	if(ret==2){
+		//Header del file appena letto: scelgo dove scriverlo e continuo
+		if(openUpload(c)==0) ret=readMsgNonBlock(c);
+		else{
+			ret=-1;
+			errno=EIO; //Non è un "riprova": chiudo la connessione
+		}
+	}
+	if(ret==1){
+		//In modalità affinity il resto di una POSTFILE_OP lo esegue il proprietario
+		if(mbox && c->msg.hdr.op==POSTFILE_OP) handBack(client);
+		else if(serveReq(client)!=0) closeClient(client);
+		else if(mbox) handBack(client);
+		else dispatchConn(client,1);
+	}
+	else if(ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) reactorRearm(connReactor(c),client);
+	else closeClient(client);
+}
+
+/**
+ * @brief Prosegue nel worker proprietario una connessione restituita dal pool di I/O
+ *
+ * Se il contenuto di una POSTFILE_OP è stato ricevuto la richiesta viene
+ * eseguita qui, poi si passa alle richieste successive già ricevute.
+ *
+ * @param client fd del client
+ */
+static void resumeConn(int client){
+	if(conns[client]->state==PARSE_DONE && serveReq(client)!=0) closeClient(client);
+	else dispatchConn(client,1);
+}
+
+/**
+ * @brief Funzione passata ai thread del pool di I/O
+ *
+ * Come i worker, estrae i fd dalle code del proprio pool: i trasferimenti di
+ * file, anche lunghi, occupano soltanto questi thread e non ritardano le
+ * richieste testuali e di controllo servite dai worker.
+ */
+void * ioWorker(void * arg){
+	int self=(int)(long)arg; //Indice del thread nel pool di I/O
+
+	while(alive){
+		int client=poolTake(iopool,self); //Si blocca sennò
+		if(!alive || client==-1) break; //Terminazione thread (pool chiuso)
+		serveFile(client);
+	}
+	return NULL;
+}
+
 /**
  * @brief Funzione passata ai thread worker
  *
  * La funzione esegue un ciclo infinito (finchè non viene interrotto da uno dei segnali mascherati)
- * dentro il quale estrae da una coda concorrente i file descriptor dei client che devono essere serviti.
- * Appena estratto, legge dal socket l'intero messaggio e lo passa alla funzione executeReq che lo processa.
- * In base all'esito della funzione decide se rimettere il tutto dentro al set dei fd da servire,
- * oppure di disconnettere il client
+ * dentro il quale estrae dalla propria coda locale (o ruba dalle code degli altri worker) i file
+ * descriptor dei client che devono essere serviti. La connessione resta al worker che l'ha servita,
+ * così le richieste successive dello stesso client tornano sullo stesso thread.
+ * Il reactor accoda un fd solo quando il parser incrementale della connessione ha letto
+ * un messaggio completo, quindi il worker non legge mai dal socket e un client lento
+ * non può tenerlo occupato. Il messaggio viene passato alla funzione executeReq che lo processa.
+ * In base all'esito della funzione decide se passare alla richiesta successiva (se è già
+ * nel buffer di ricezione) o riarmare il fd nel reactor, oppure di disconnettere il client
  */
 void * worker(void * arg){
-	message_t new;
+	int self=(int)(long)arg; //Indice del worker nel pool
 
 	while(alive){
 
-		int client=deQueue(coda); //Si blocca sennò
-		if(!alive) break; //Terminazione thread
-		if(client==-1) continue; //cuncurrency
-		printf("*------@START@------*\n");
-		printf("Client: %d\n",client);
-
-		if(readMsg(client,&new)==1){ //Lettura andata a buon fine
-			printMsg(&new);
-			//Servo la richiesta del client
-			int esito=executeReq(client,new);
-			free(new.data.buf);
-			new.data.buf=NULL;
-			//Controllo l'esito della richiesta
-		    if(esito==0){ //Se è andata a buon fine, metto in coda il client!
-				printf("@OK: Servito\n\n");
-				fflush(stdout);
-				pthread_mutex_lock(&mtx_set);
-				FD_SET(client,&set);
-				pthread_mutex_unlock(&mtx_set);
+		int client=poolTake(workers,self); //Si blocca sennò
+		if(!alive || client==-1) break; //Terminazione thread (pool chiuso)
+
+		conn_t * c=conns[client];
+		c->worker=self; //Le prossime richieste restano a questo worker (anche se rubata)
+		poolObserve(workers,(long)(nowNs()-c->queued)); //Il pool si amplia se l'attesa è eccessiva
+	    if(serveReq(client)==0){ //Se è andata a buon fine, passo alla richiesta successiva
+			//Le richieste già ricevute vengono estratte dal buffer, altrimenti riarmo il fd
+			dispatchConn(client,1);
+		}
+	    else closeClient(client); //Esito negativo, disconnetto il client
+	}
+	return NULL;
+}
+
+/**
+ * @brief Accetta una nuova connessione e la assegna ad un reactor
+ *
+ * In modalità shared i client vengono distribuiti a turno fra i reactor, in
+ * modalità affinity vengono registrati nel reactor del worker proprietario.
+ */
+static void acceptConn(void){
+	static unsigned long nextid=0;
+	static int nextloop=0;
+
+	// Controlliamo se non supera il massimo di connessione
+	int ok = 1;
+	pthread_mutex_lock(&mtxstats);
+	if( chattyStats.nonline >= config->MaxConnections ) ok = 0;
+	pthread_mutex_unlock(&mtxstats);
+	//Non riarmo il socket di ascolto: lo riarma closeClient quando si libera un posto
+	if( !ok ) return;
+
+	// Ok! Creo il file descriptor e lo stato della connessione
+	int fd_c=accept(fd_sk,NULL,NULL);
+	if(fd_c>=0 && fd_c>=maxconns) close(fd_c);
+	else if(fd_c>=0){
+		pthread_mutex_lock(&mtx_fd[fd_c]);
+		if((conns[fd_c]=createConn(fd_c))==NULL){
+			close(fd_c);
+		}
+		else{
+			//Proprietario iniziale (definitivo in modalità affinity)
+			conns[fd_c]->worker=fd_c%workers->size;
+			conns[fd_c]->loop=nextloop;
+			conns[fd_c]->id=++nextid;
+			nextloop=(nextloop+1)%nloops;
+			if(reactorAdd(connReactor(conns[fd_c]),fd_c)==-1){
+				perror("reactorAdd");
+				destroyConn(conns[fd_c]);
+				conns[fd_c]=NULL;
+				close(fd_c);
 			}
-		    else{ //Esito negativo, disconnetto il client
-				printf("@ERR: Client non servito!\n\n");
-				fflush(stdout);
-				if(disconnectUser(usr,NULL,client)==0) updateStats(0,-1,0,0,0,0,0);
-				close(client);
+		}
+		pthread_mutex_unlock(&mtx_fd[fd_c]);
+	}
+	reactorRearmListen(rct,fd_sk);
+}
+
+/**
+ * @brief Legge con una sola chiamata io_uring tutti i client pronti di un reactor
+ *
+ * Vengono letti i client il cui parser riempirebbe il buffer di ricezione
+ * con la prossima read; per gli altri got[i] resta NOREAD.
+ *
+ * @param r reactor
+ * @param ring istanza io_uring del chiamante
+ * @param nready numero di eventi in r->events
+ * @param got esito della lettura per ogni evento (come la read, -errno in caso di errore)
+ * @return 0 in caso di successo, -1 se l'istanza io_uring non va più usata
+ */
+static int batchRecv(reactor * r, uring * ring, int nready, int * got){
+	int prepared=0;
+	for(int i=0; i<nready; i++){
+		int fd=r->events[i].data.fd;
+		char * buf;
+		size_t len;
+		got[i]=NOREAD;
+		if(fd==r->wakefd || fd==r->wepfd || fd==fd_sk) continue;
+		if((len=recvSpace(conns[fd],&buf))>0 && uringPrepRecv(ring,fd,buf,len,i)==0) prepared++;
+	}
+	if(prepared==0) return 0;
+	if(uringRun(ring)<0){
+		perror("io_uring: torno alle read");
+		for(int i=0; i<nready; i++) got[i]=NOREAD;
+		return -1;
+	}
+	unsigned long long tag;
+	int res;
+	while(uringReap(ring,&tag,&res)) got[tag]=res;
+	return 0;
+}
+
+/**
+ * @brief Invia i messaggi lasciati nella mailbox di un worker (modalità affinity)
+ *
+ * I messaggi destinati ad una connessione chiusa nel frattempo (anche se il
+ * suo fd è già stato riassegnato ad un nuovo client) vengono scartati.
+ * Con io_uring i messaggi diretti a connessioni con la coda in uscita vuota
+ * vengono inviati tutti insieme da batchSend.
+ * Le connessioni restituite dal pool di I/O (postResume) proseguono qui la
+ * loro richiesta (vedi resumeConn).
+ *
+ * @param self indice del worker chiamante
+ * @param ring istanza io_uring del chiamante (NULL per usare le writev)
+ * @return 0 in caso di successo, -1 se l'istanza io_uring non va più usata
+ */
+static int drainMailbox(int self, uring * ring){
+	long fds[WRITE_BATCH];
+	unsigned long ids[WRITE_BATCH];
+	int n=0;
+	mail_t * m=takeMail(mbox[self]);
+	while(m){
+		mail_t * next=m->next;
+		if(m->resume){
+			//La connessione è disarmata: nessun altro thread può chiuderla
+			if(conns[m->fd] && conns[m->fd]->id==m->id) resumeConn(m->fd);
+			freeMail(m);
+			m=next;
+			continue;
+		}
+		pthread_mutex_lock(&mtx_fd[m->fd]);
+		conn_t * c=conns[m->fd];
+		if(c && c->id==m->id){
+			int dup=0;
+			for(int i=0; i<n; i++) dup|=(fds[i]==m->fd);
+			//Con io_uring il messaggio viene solo accodato, batchSend invierà insieme tutte le code
+			if(ring && c->outhead==NULL && n<WRITE_BATCH && !dup && queueMsg(c,&(m->hdr),0,&(m->data))==0){
+				fds[n]=m->fd;
+				ids[n++]=m->id;
 			}
+			else pushMsg(c,&(m->hdr),0,&(m->data));
+		}
+		pthread_mutex_unlock(&mtx_fd[m->fd]);
+		freeMail(m);
+		m=next;
+	}
+	return (n>0) ? batchSend(ring,fds,ids,n) : 0;
+}
+
+/**
+ * @brief Ciclo degli eventi di un reactor, fino alla terminazione del server
+ *
+ * Il canale di notifica del reactor risveglia il thread per la terminazione
+ * e, nei worker in modalità affinity, per i messaggi arrivati nella mailbox.
+ * Con IOEngine = uring ogni ciclo ha la propria istanza io_uring, con cui
+ * legge insieme i client pronti (e, nei worker, invia insieme i messaggi
+ * della mailbox); se l'istanza fallisce il ciclo torna alle read/writev.
+ *
+ * @param r reactor
+ * @param self indice del worker proprietario del reactor (-1 se non è un worker)
+ */
+static void runLoop(reactor * r, int self){
+	uring * ring=NULL;
+	int * got=NULL;
+	if(config->Uring && (ring=createUring(URING_ENTRIES))!=NULL){
+		got=malloc(sizeof(int)*r->nevents);
+		if(!got){perror("malloc runLoop");exit(EXIT_FAILURE);}
+	}
+	uring * broken=NULL; //Istanza fallita: resta aperta, ma non viene più usata
+
+	while(alive){
+		//Nessun timeout: i segnali di terminazione risvegliano il main con reactorWakeup
+		int nready=reactorWait(r,-1);
+		if(nready<0) continue;
+		if(ring && batchRecv(r,ring,nready,got)<0){
+			broken=ring;
+			ring=NULL;
 		}
-		else{ //Il client si è disconnesso
-			if(disconnectUser(usr,NULL,client)==0) updateStats(0,-1,0,0,0,0,0);
-			close(client);
+
+		//Scandisco solo i fd pronti
+		for(int i=0; i<nready && alive; i++){
+			int fd=r->events[i].data.fd;
+			if(fd==r->wakefd){
+				reactorDrainWakeup(r);
+				if(self>=0 && drainMailbox(self,ring)<0){
+					broken=ring;
+					ring=NULL;
+				}
+			}
+			else if(fd==r->wepfd){
+				//Client tornati scrivibili: riprendo l'invio delle loro code
+				int nw=reactorWritable(r);
+				for(int j=0; j<nw; j++) resumeFlush(r->wevents[j].data.fd);
+			}
+			else if(fd==fd_sk) acceptConn(); //Registrato solo nel reactor del main
+			else if(got && got[i]!=NOREAD){
+				//Byte già letti con io_uring: EOF ed errori li ritrova la read del parser
+				if(got[i]>0) recvDone(conns[fd],got[i]);
+				dispatchConn(fd,got[i]>0);
+			}
+			else dispatchConn(fd,0); //Leggo i byte disponibili senza bloccarmi
 		}
-		printf("*-------@END@-------*\n\n");
 	}
+	destroyUring(ring);
+	destroyUring(broken);
+	free(got);
+}
+
+/**
+ * @brief Funzione passata ai thread worker in modalità affinity
+ *
+ * Ogni worker attende sul proprio reactor gli eventi delle sole connessioni
+ * che gli sono state assegnate all'accept, le legge ed esegue le richieste
+ * senza passare dal pool: stato della connessione, utente e buffer del socket
+ * restano sempre allo stesso thread.
+ */
+void * affinityWorker(void * arg){
+	int self=(int)(long)arg; //Indice del worker nel pool
+	runLoop(wrct[self],self);
+	return NULL;
+}
+
+/**
+ * @brief Funzione dei thread reactor aggiuntivi (ReactorThreads > 1)
+ *
+ * Ogni thread rileva gli eventi dei client assegnati al proprio reactor ed
+ * accoda ai worker quelli con un messaggio completo, come fa il main con i suoi.
+ */
+void * reactorThread(void * arg){
+	runLoop(loops[(long)arg],-1);
 	return NULL;
 }
 
@@ -752,23 +1435,20 @@ int main(int argc, char * argv[]){
 	//Avvio l'handler che gestisce i segnali
 	signalHandler();
 
-	//creo coda per i fd
-	coda=createQueue(config->MaxConnections);
-	if(!coda) exit(EXIT_FAILURE);
-
-	//creo struttura per registrare utenti
-	usr = createUsersStruct(config->MaxHistMsgs,config->MaxConnections);
-	if(!usr) exit(EXIT_FAILURE);
+	//Motore di I/O: se il kernel non supporta io_uring si usano le normali chiamate
+	if(config->Uring){
+		uring * probe=createUring(URING_ENTRIES);
+		if(!probe){
+			perror("io_uring non disponibile, uso read/writev");
+			config->Uring=0;
+		}
+		destroyUring(probe);
+	}
 
 	//Scollego vecchio socket
 	unlink(config->UnixPath);
 
 	//Preparo i fd per la comunicazione con il socket
-	int fd_sk;
-	int fd_c;
-	int fd_num=0;
-	int fd;
-	fd_set rdset;
 	int notused;
 
 	//Creiamo il socket
@@ -784,66 +1464,108 @@ int main(int argc, char * argv[]){
 	notused=listen(fd_sk,config->MaxConnections);
 	if(notused==-1){perror("listen");exit(EXIT_FAILURE);}
 
-	FD_ZERO(&set);
-	FD_ZERO(&rdset);
-	FD_SET(fd_sk,&set);
-
-	if(fd_sk>fd_num) fd_num=fd_sk;
-
-	//Creo il pool di thread worker
-	pool * pool=createPool(config->ThreadsInPool);
-	initPool(pool,&worker);
-
-	while(alive){
+	//Tabella delle connessioni: un fd non può superare il limite RLIMIT_NOFILE
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE,&rl)==-1){perror("getrlimit");exit(EXIT_FAILURE);}
+	maxconns=(rl.rlim_cur==RLIM_INFINITY) ? 65536 : (long)rl.rlim_cur;
+	conns=calloc(maxconns,sizeof(conn_t *));
+	if(!conns){perror("calloc conns");exit(EXIT_FAILURE);}
+	mtx_fd=malloc(sizeof(pthread_mutex_t)*maxconns);
+	if(!mtx_fd){perror("malloc mtx_fd");exit(EXIT_FAILURE);}
+	for(long i=0; i<maxconns; i++) pthread_mutex_init(&mtx_fd[i],NULL);
+
+	//creo struttura per registrare utenti (vettore fd -> user grande quanto conns)
+	usr = createUsersStruct(config->MaxHistMsgs,config->MaxMsgSize,config->MaxConnections,maxconns);
+	if(!usr) exit(EXIT_FAILURE);
 
-		//Necessario ridefinire il timeout
-		struct timeval timeout={0,150};
-
-		//aggiorno
-		pthread_mutex_lock(&mtx_set);
-		rdset=set;
-		pthread_mutex_unlock(&mtx_set);
-		int notused;
-		notused=select(fd_num+1,&rdset,NULL,NULL,&timeout);
-		if(notused<0){continue;}
-
-		//Scandisco la maschera
-		for(fd=0; fd<=fd_num; fd++){
-			if(FD_ISSET(fd,&rdset)){
-				if(fd==fd_sk){
-
-					// Controlliamo se non supera il massimo di connessione
-					int ok = 1;
-					pthread_mutex_lock(&mtxstats);
-					if( chattyStats.nonline >= config->MaxConnections ) ok = 0;
-					pthread_mutex_unlock(&mtxstats);
-	  				if( !ok ) continue ;
-
-					// Ok! Creo il file descriptor
-					fd_c=accept(fd_sk,NULL,NULL);
-					pthread_mutex_lock(&mtx_set);
-					FD_SET(fd_c,&set);
-					pthread_mutex_unlock(&mtx_set);
-					if(fd_c>fd_num) fd_num=fd_c;
-				}
-				else{
-					pthread_mutex_lock(&mtx_set);
-					FD_CLR(fd,&set);
-					pthread_mutex_unlock(&mtx_set);
-					enQueue(coda,fd);
-				}
-			}
+	//Creo il reactor e registro il socket di ascolto
+	rct=createReactor(config->EdgeTriggered,config->MaxConnections+1);
+	if(reactorListen(rct,fd_sk)==-1){perror("reactorListen");exit(EXIT_FAILURE);}
+
+	//Creo il pool di thread worker, ognuno con una coda locale per i fd
+	if(config->Affinity){
+		//Le code locali non vengono usate: ogni worker ha reactor e mailbox propri
+		workers=createPool(config->ThreadsInPool,1,NULL);
+		wrct=malloc(sizeof(reactor *)*workers->size);
+		mbox=malloc(sizeof(mailbox_t *)*workers->size);
+		if(!wrct || !mbox){perror("malloc reactor worker");exit(EXIT_FAILURE);}
+		for(int i=0; i<workers->size; i++){
+			wrct[i]=createReactor(config->EdgeTriggered,config->MaxConnections+1);
+			mbox[i]=createMailbox();
+		}
+		initPool(workers,&affinityWorker);
+	}
+	else{
+		//Il numero di worker varia fra MinThreadsInPool e MaxThreadsInPool
+		pool_policy policy;
+		policy.min=config->MinThreadsInPool;
+		policy.max=config->MaxThreadsInPool;
+		policy.growwait=config->PoolGrowWait*1000000L;
+		policy.idle=config->PoolIdleTime*1000L;
+		policy.report=&reportResize;
+		workers=createPool(config->ThreadsInPool,config->MaxConnections,&policy);
+		initPool(workers,&worker);
+	}
+	chattyStats.nworkers=workers->active;
+	//Pool di I/O separato per le richieste che lavorano su file
+	if(config->FileThreadsInPool>0){
+		iopool=createPool(config->FileThreadsInPool,config->MaxConnections,NULL);
+		initPool(iopool,&ioWorker);
+	}
+	//Reactor dei client: il primo è quello del main, gli altri hanno un thread ciascuno
+	nloops=(config->Affinity) ? 1 : config->ReactorThreads;
+	loops=malloc(sizeof(reactor *)*nloops);
+	loopthreads=malloc(sizeof(pthread_t)*nloops);
+	if(!loops || !loopthreads){perror("malloc reactor");exit(EXIT_FAILURE);}
+	loops[0]=rct;
+	for(long i=1; i<nloops; i++){
+		loops[i]=createReactor(config->EdgeTriggered,config->MaxConnections+1);
+		if(pthread_create(&loopthreads[i],NULL,&reactorThread,(void *)i)!=0){
+			perror("pthread_create reactor");
+			exit(EXIT_FAILURE);
 		}
 	}
+
+	runLoop(rct,-1);
+
 	printf("Termino MAIN\n");
-	for (int i = 0; i < config->ThreadsInPool; i++) {
-      printf("*Thread %d terminated\n", i);
-      pthread_join(pool->thread[i], NULL);
-  	}
+	closePool(workers); //Risveglia i worker sospesi, che terminano
+	if(wrct) for(int i=0; i<workers->size; i++) reactorWakeup(wrct[i]);
+	for(int i=1; i<nloops; i++){
+		reactorWakeup(loops[i]);
+		pthread_join(loopthreads[i],NULL);
+	}
+	printf("*%d Thread terminated\n",joinPool(workers));
+	if(iopool){
+		closePool(iopool);
+		printf("*%d Thread I/O terminated\n",joinPool(iopool));
+	}
 
 	printf("Cleaning up...\n");
-	destroyQueue(coda);
-	destroyPool(pool);
+	if(wrct){
+		for(int i=0; i<workers->size; i++){
+			destroyReactor(wrct[i]);
+			destroyMailbox(mbox[i]);
+		}
+		free(wrct);
+		free(mbox);
+	}
+	destroyPool(workers);
+	if(iopool) destroyPool(iopool);
+	for(int i=1; i<nloops; i++) destroyReactor(loops[i]);
+	free(loops);
+	free(loopthreads);
+	destroyReactor(rct);
+	close(fd_sk);
+	for(long i=0; i<maxconns; i++){
+		if(conns[i]){
+			destroyConn(conns[i]);
+			close(i);
+		}
+	}
+	free(conns);
+	for(long i=0; i<maxconns; i++) pthread_mutex_destroy(&mtx_fd[i]);
+	free(mtx_fd);
 	destroyUsersStruct(usr);
 	free(config->UnixPath);
 	free(config->DirName);
@@ -46,6 +46,10 @@ static message_t  *MSGS = NULL;
 static const int   msgbatch = 100;
 static size_t      msgcur=0;
 static size_t      msglen=0;     
+#define ISPOST(op) ((op)==POSTTXT_OP || (op)==POSTTXTALL_OP || (op)==POSTFILE_OP)
+// risposte arrivate prima di essere attese (indicizzate per id di richiesta)
+static op_t       *REPLIES = NULL;
+static size_t      nreplies = 0;
 /* ------------------------------------------------------- */
 
 // usage function
@@ -131,13 +135,20 @@ static int downloadFile(int connfd, char *filename, char *sender) {
     return -1;
 }
 
-// gestisce operazioni di tipo richiesta-risposta
-static int execute_requestreply(int connfd, operation_t *o) {
+// spedisce la richiesta di una operazione (con id di richiesta reqid)
+static int send_request(int connfd, operation_t *o, unsigned int reqid) {
     char *sname = o->sname;
     char *rname = o->rname?o->rname:"";
     op_t op     = o->op;
     message_t msg;
     char  *mappedfile = NULL;
+    char   caps[MAX_NAME_LENGTH+1];
+
+    // con la CONNECT_OP propongo al server le opzioni di protocollo supportate
+    if (op == CONNECT_OP) {
+	protoToString(PROTO_ALL, caps);
+	rname = caps;
+    }
     
     //setData(&msg.data, "", NULL, 0);
     setData(&msg.data, rname, NULL, 0);
@@ -170,7 +181,7 @@ static int execute_requestreply(int connfd, operation_t *o) {
     } 
     
     // spedizione effettiva
-    if (sendRequest(connfd, &msg) == -1) {
+    if (sendMsg(connfd, &msg.hdr, &msg.data, reqid) == -1) {
 	perror("request");
 	return -1;
     }
@@ -185,14 +196,36 @@ static int execute_requestreply(int connfd, operation_t *o) {
 	}
 	munmap(mappedfile, o->size);
     } else if (msg.data.buf) free(msg.data.buf);
+    return 0;
+}
+
+// attende la risposta alla richiesta reqid e la gestisce
+static int wait_reply(int connfd, operation_t *o, unsigned int reqid) {
+    char *sname = o->sname;
+    op_t op     = o->op;
+    message_t msg;
+    unsigned int id;
 
+    setData(&msg.data, "", NULL, 0);
     // devo ricevere l'ack
     int ackok = 0;
     while(!ackok) {
-	// aspetto di ricevere la risposta alla richiesta
-	if (readHeader(connfd, &msg.hdr) <= 0) {
-	    perror("reply header");
-	    return -1;
+	if (reqid < nreplies && REPLIES[reqid] != 0) {
+	    // la risposta e' arrivata mentre ne attendevo un'altra
+	    msg.hdr.op = REPLIES[reqid];
+	    REPLIES[reqid] = 0;
+	} else {
+	    // aspetto di ricevere la risposta alla richiesta
+	    if (readHeaderId(connfd, &msg.hdr, &id) <= 0) {
+		perror("reply header");
+		return -1;
+	    }
+	    // risposta ad un'altra richiesta in volo: la conservo
+	    if (id != reqid && id != 0 && id < nreplies &&
+		msg.hdr.op != TXT_MESSAGE && msg.hdr.op != FILE_MESSAGE) {
+		REPLIES[id] = msg.hdr.op;
+		continue;
+	    }
 	}
 	
 	// differenti tipi di risposta che posso ricevere
@@ -225,13 +258,24 @@ static int execute_requestreply(int connfd, operation_t *o) {
     case REGISTER_OP:
     case CONNECT_OP:
     case USRLIST_OP: {  // ... ricevere la lista degli utenti
+	// nel formato v2 i nomi sono uno dopo l'altro, terminati da '\0'
+	int packed = (getProto(connfd) & PROTO_V2) != 0;
 	if (readData(connfd, &msg.data) <= 0) {
 	    perror("reply data");
 	    return -1; 
 	}	
+	// nella risposta alla CONNECT_OP il server indica le opzioni accettate
+	if (op == CONNECT_OP)
+	    setProto(connfd, parseProto(msg.data.hdr.receiver, MAX_NAME_LENGTH+1));
+	printf("Lista utenti online:\n");
+	if (packed) {
+	    assert(msg.data.hdr.len > 0);
+	    for(size_t p=0; p<msg.data.hdr.len; p+=strlen(&msg.data.buf[p])+1)
+		printf(" %s\n", &msg.data.buf[p]);
+	    break;
+	}
 	int nusers = msg.data.hdr.len / (MAX_NAME_LENGTH+1);
 	assert(nusers > 0);
-	printf("Lista utenti online:\n");
 	for(int i=0,p=0;i<nusers; ++i, p+=(MAX_NAME_LENGTH+1)) {
 	    printf(" %s\n", &msg.data.buf[p]);
 	}
@@ -285,6 +329,12 @@ static int execute_requestreply(int connfd, operation_t *o) {
     return 0;   
 }
 
+// gestisce operazioni di tipo richiesta-risposta
+static int execute_requestreply(int connfd, operation_t *o) {
+    if (send_request(connfd, o, 0) == -1) return -1;
+    return wait_reply(connfd, o, 0);
+}
+
 // gestisce operazioni di tipo richiesta-risposta
 static int execute_receive(int connfd, operation_t *o) {
     char *sname = o->sname;
@@ -564,8 +614,33 @@ int main(int argc, char *argv[]) {
     }
     msglen = msgbatch;
   
+    REPLIES = calloc(k+1, sizeof(op_t));
+    if (!REPLIES) {
+	perror("calloc");
+	fprintf(stderr, "ERRORE: Out of memory\n");
+	return -1;
+    }
+    nreplies = k+1;
+
     int r=0;
     for(int i=0;i<k;++i) {
+	/* Se il server accetta gli id di richiesta e non devo attendere tra
+	 * una operazione e l'altra, spedisco in blocco le POST consecutive
+	 * (id = indice+1) e poi ne attendo le risposte.
+	 */
+	if (msleep==0 && (getProto(connfd) & PROTO_REQID) && ISPOST(ops[i].op)) {
+	    int j, sent, failed;
+	    for(j=i; j<k && ISPOST(ops[j].op); ++j)
+		if (send_request(connfd, &ops[j], j+1) == -1) break;
+	    sent = j;
+	    failed = (j<k && ISPOST(ops[j].op));
+	    for(r=0; i<sent && (r = wait_reply(connfd, &ops[i], i+1)) == 0; ++i)
+		printf("Operazione %d eseguita con successo!\n", i);
+	    if (r == 0 && failed) r = -1;
+	    if (r != 0) break;  // non appena una operazione fallisce esco
+	    --i;
+	    continue;
+	}
 	if (ops[i].op != OP_END) 
 	    r = execute_requestreply(connfd, &ops[i]);
 	else 
@@ -581,6 +656,7 @@ int main(int argc, char *argv[]) {
     close(connfd);
     if (ops) free(ops);
     if (MSGS) free(MSGS);
+    if (REPLIES) free(REPLIES);
     return r;
 }
 
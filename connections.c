@@ -20,11 +20,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
 #include "connections.h"
 #include "message.h"
 #include "ops.h"
 #include "config.h"
 
+//Opzioni di protocollo negoziate per ogni fd (lato client)
+static unsigned int fdproto[PROTO_MAXFD];
+
+/**
+ * @brief Attende che un socket non bloccante torni scrivibile
+ *
+ * Le funzioni di scrittura bloccanti devono completare l'invio anche se il
+ * socket (non bloccante) del destinatario è momentaneamente pieno.
+ */
+static int waitWritable(int fd){
+	struct pollfd pfd;
+	pfd.fd=fd;
+	pfd.events=POLLOUT;
+	pfd.revents=0;
+	int ret;
+	while((ret=poll(&pfd,1,-1))<0 && errno==EINTR);
+	return ret<0 ? -1 : 0;
+}
+
 //Crediti per readn e writen: Unix Network Programming, Volume 1: The Sockets Networking API, 3rd Edition
 ssize_t readn(int fd, void *vptr, size_t n){
 	size_t  nleft;
@@ -56,6 +76,10 @@ ssize_t writen(int fd, void *vptr, size_t n){
 	while (nleft > 0) {
 		if ( (nwritten = write(fd, ptr, nleft)) <= 0) {
 			if (nwritten < 0 && errno == EINTR)	nwritten = 0;   /* and call write() again */
+			else if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				if (waitWritable(fd) < 0) return (-1);
+				nwritten = 0;   /* socket non bloccante pieno */
+			}
 			else return (-1);    /* error */
 		}
 		nleft -= nwritten;
@@ -77,10 +101,13 @@ ssize_t writen(int fd, void *vptr, size_t n){
  * @returno -1 se c'è un errore
  */
 static int read_buffer(long connfd, char *buffer, unsigned int length){
-	char *tmp=buffer;
 	while(length>0){
-		int rd=read(connfd,tmp,length);
-		if(rd<0) return -1;
+		int rd=read(connfd,buffer,length);
+		if(rd<0){
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		if(rd==0) return -1; //EOF prima della fine del buffer
 		buffer += rd;
 		length -= rd;
 	}
@@ -88,22 +115,222 @@ static int read_buffer(long connfd, char *buffer, unsigned int length){
 }
 
 /**
- * @brief Funzione che esegue la scrittura di un buffer su un socket
- * @param connfd fd del client
- * @param buffer buffer di caratteri
- * @param length lunghezza buffer
+ * @brief Funzione interna che codifica un intero in formato varint
+ * @return numero di byte scritti
+ */
+static size_t putVarint(char * p, unsigned int v){
+	size_t n=0;
+	while(v>=0x80){
+		p[n++]=(char)((v & 0x7f) | 0x80);
+		v>>=7;
+	}
+	p[n++]=(char)v;
+	return n;
+}
+
+/**
+ * @brief Funzione interna che codifica un nome (lunghezza varint e caratteri)
+ * @return numero di byte scritti
+ */
+static size_t putName(char * p, const char * name){
+	size_t len=0;
+	while(len<MAX_NAME_LENGTH && name[len]!='\0') len++;
+	size_t n=putVarint(p,len);
+	memcpy(p+n,name,len);
+	return n+len;
+}
+
+/**
+ * @brief Funzione interna che decodifica un intero varint
+ * @return byte consumati, 0 se buf è incompleto, -1 se l'intero non è valido
+ */
+static int getVarint(const char * buf, size_t len, unsigned int * v){
+	unsigned int val=0;
+	for(size_t i=0; i<VARINT_MAX; i++){
+		if(i>=len) return 0;
+		unsigned char b=(unsigned char)buf[i];
+		if(i==VARINT_MAX-1 && b>0x0f) return -1; //Non sta in 32 bit
+		val|=(unsigned int)(b & 0x7f)<<(7*i);
+		if(!(b & 0x80)){
+			*v=val;
+			return i+1;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Funzione interna che decodifica un nome in un campo di MAX_NAME_LENGTH+1 caratteri
+ * @return byte consumati, 0 se buf è incompleto, -1 se il nome non è valido
+ */
+static int getName(const char * buf, size_t len, char * name){
+	unsigned int nlen;
+	int n=getVarint(buf,len,&nlen);
+	if(n<=0) return n;
+	if(nlen>MAX_NAME_LENGTH) return -1;
+	if(len-n<nlen) return 0;
+	memset(name,0,MAX_NAME_LENGTH+1);
+	memcpy(name,buf+n,nlen);
+	return n+nlen;
+}
+
+/**
+ * @brief Decodifica un header (ed il suo id di richiesta) in formato v2
  *
- * @return 0 se va a buon fine
- * @return-1 se c'è un errore
+ * @param buf byte ricevuti
+ * @param len numero di byte in buf
+ * @param proto opzioni di protocollo della connessione
+ * @param hdr header da riempire
+ * @param reqid id di richiesta da riempire (0 se non negoziato)
+ * @return numero di byte consumati, 0 se buf non contiene ancora l'header intero
+ * @return -1 se l'header non è valido
  */
-static int write_buffer(long connfd, char *buffer, unsigned int length){
-	while(length>0){
-		int wt=write(connfd,buffer,length);
-		if(wt<0) return -1;
-		buffer += wt;
-		length -= wt;
+int decodeHdr(const char * buf, size_t len, unsigned int proto, message_hdr_t * hdr, unsigned int * reqid){
+	unsigned int op, id=0;
+	int n, off=0;
+	if((n=getVarint(buf,len,&op))<=0) return n;
+	off+=n;
+	if((n=getName(buf+off,len-off,hdr->sender))<=0) return n;
+	off+=n;
+	if(proto & PROTO_REQID){
+		if((n=getVarint(buf+off,len-off,&id))<=0) return n;
+		off+=n;
 	}
-	return 0;
+	hdr->op=(op_t)op;
+	*reqid=id;
+	return off;
+}
+
+/**
+ * @brief Decodifica un header dati in formato v2
+ *
+ * @param buf byte ricevuti
+ * @param len numero di byte in buf
+ * @param dhdr header dati da riempire
+ * @return numero di byte consumati, 0 se buf non contiene ancora l'header intero
+ * @return -1 se l'header non è valido
+ */
+int decodeDataHdr(const char * buf, size_t len, message_data_hdr_t * dhdr){
+	unsigned int dlen;
+	int n, off=0;
+	if((n=getName(buf,len,dhdr->receiver))<=0) return n;
+	off+=n;
+	if((n=getVarint(buf+off,len-off,&dlen))<=0) return n;
+	dhdr->len=dlen;
+	return off+n;
+}
+
+/**
+ * @brief Funzione interna che legge (bloccante) un intero varint
+ * @return 1 in caso di successo, <=0 in caso di errore o connessione chiusa
+ */
+static int readVarint(long fd, unsigned int * v){
+	char buf[VARINT_MAX];
+	for(size_t i=0; i<VARINT_MAX; i++){
+		int rd=readn(fd,buf+i,1);
+		if(rd<=0) return rd;
+		if(!(buf[i] & 0x80)) break;
+	}
+	if(getVarint(buf,VARINT_MAX,v)<=0){
+		errno=EPROTO;
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * @brief Funzione interna che legge (bloccante) un nome
+ * @return 1 in caso di successo, <=0 in caso di errore o connessione chiusa
+ */
+static int readName(long fd, char * name){
+	unsigned int len;
+	int rd=readVarint(fd,&len);
+	if(rd<=0) return rd;
+	if(len>MAX_NAME_LENGTH){
+		errno=EPROTO;
+		return -1;
+	}
+	memset(name,0,MAX_NAME_LENGTH+1);
+	if(len>0 && (rd=readn(fd,name,len))<(int)len) return (rd<0) ? -1 : 0;
+	return 1;
+}
+
+/**
+ * @brief Prepara il vettore di buffer con cui inviare un messaggio con writev
+ *
+ * @param iov vettore di almeno MSG_IOV elementi da riempire
+ * @param wire buffer di almeno WIRE_MAX byte in cui codificare gli header (formato v2)
+ * @param proto opzioni di protocollo della connessione
+ * @param hdr header del messaggio
+ * @param reqid id di richiesta da inviare dopo l'header (usato solo con PROTO_REQID)
+ * @param data parte dati (NULL se va inviato solo l'header)
+ * @return numero di elementi di iov usati
+ */
+int msgToIov(struct iovec * iov, char * wire, unsigned int proto, message_hdr_t * hdr, unsigned int * reqid, message_data_t * data){
+	int n=0;
+	if(proto & PROTO_V2){ //Header codificati di seguito in wire
+		size_t len=putVarint(wire,hdr->op);
+		len+=putName(wire+len,hdr->sender);
+		if(proto & PROTO_REQID) len+=putVarint(wire+len,*reqid);
+		if(data){
+			len+=putName(wire+len,data->hdr.receiver);
+			len+=putVarint(wire+len,data->hdr.len);
+		}
+		iov[n].iov_base=wire;
+		iov[n++].iov_len=len;
+	}
+	else{
+		iov[n].iov_base=hdr;
+		iov[n++].iov_len=sizeof(message_hdr_t);
+		if(proto & PROTO_REQID){
+			iov[n].iov_base=reqid;
+			iov[n++].iov_len=sizeof(unsigned int);
+		}
+		if(data){
+			iov[n].iov_base=&(data->hdr);
+			iov[n++].iov_len=sizeof(message_data_hdr_t);
+		}
+	}
+	if(data && data->hdr.len>0){
+		iov[n].iov_base=data->buf;
+		iov[n++].iov_len=data->hdr.len;
+	}
+	return n;
+}
+
+/**
+ * @brief Scrive per intero un vettore di buffer con writev
+ *
+ * @param fd descrittore della connessione
+ * @param iov vettore di buffer (viene modificato)
+ * @param iovcnt numero di elementi di iov
+ * @return numero di byte scritti, -1 in caso di errore
+ */
+ssize_t writevn(long fd, struct iovec * iov, int iovcnt){
+	ssize_t tot=0;
+	while(iovcnt>0){
+		ssize_t wt=writev(fd,iov,iovcnt);
+		if(wt<0){
+			if(errno==EINTR) continue;
+			if(errno==EAGAIN || errno==EWOULDBLOCK){ //Socket non bloccante pieno
+				if(waitWritable(fd)<0) return -1;
+				continue;
+			}
+			return -1;
+		}
+		tot+=wt;
+		//Salto i buffer scritti per intero e avanzo quello parziale
+		while(iovcnt>0 && (size_t)wt>=iov->iov_len){
+			wt-=iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0){
+			iov->iov_base=(char *)iov->iov_base+wt;
+			iov->iov_len-=wt;
+		}
+	}
+	return tot;
 }
 
 /* ### Fine #### */
@@ -165,13 +392,44 @@ int openConnection(char* path, unsigned int ntimes, unsigned int secs){
  * @return 1 in caso di successo
  */
 int readHeader(long connfd, message_hdr_t *hdr){
+	return readHeaderId(connfd,hdr,NULL);
+}
+
+/**
+ * @brief Legge l'header del messaggio e l'eventuale id di richiesta
+ *
+ * @param connfd descrittore della connessione
+ * @param hdr puntatore all'header del messaggio da ricevere
+ * @param reqid se non NULL vi viene scritto l'id di richiesta
+ *
+ * @return <=0 se c'e' stato un errore (se <0 errno deve essere settato,
+ *         se == 0 connessione chiusa)
+ */
+int readHeaderId(long connfd, message_hdr_t *hdr, unsigned int *reqid){
+	unsigned int id=0;
 	memset(hdr, 0, sizeof(message_hdr_t));
 	if(connfd<0 || hdr==NULL){
 		fprintf(stdout,"readHeader: parametri nulli\n");
 		return 0;
 	}
-	int rd=readn(connfd,hdr,sizeof(message_hdr_t));
-	if(rd<=0) return rd; //0 o -1
+	unsigned int proto=getProto(connfd);
+	int rd;
+	if(proto & PROTO_V2){
+		unsigned int op;
+		if((rd=readVarint(connfd,&op))<=0) return rd;
+		hdr->op=(op_t)op;
+		if((rd=readName(connfd,hdr->sender))<=0) return rd;
+		if((proto & PROTO_REQID) && (rd=readVarint(connfd,&id))<=0) return rd;
+	}
+	else{
+		rd=readn(connfd,hdr,sizeof(message_hdr_t));
+		if(rd<=0) return rd; //0 o -1
+		if(proto & PROTO_REQID){
+			rd=readn(connfd,&id,sizeof(unsigned int));
+			if(rd<=0) return rd;
+		}
+	}
+	if(reqid) *reqid=id;
 
 	return 1;
 }
@@ -192,8 +450,12 @@ int readData(long fd, message_data_t *data){
 		return 0;
 	}
 	//Lettura di "data->hdr"
-	int rd=readn(fd,&(data->hdr),sizeof(message_data_hdr_t));
-	if(rd<=0) return rd;
+	int rd;
+	if(getProto(fd) & PROTO_V2){
+		if((rd=readName(fd,data->hdr.receiver))<=0) return rd;
+		if((rd=readVarint(fd,&(data->hdr.len)))<=0) return rd;
+	}
+	else if((rd=readn(fd,&(data->hdr),sizeof(message_data_hdr_t)))<=0) return rd;
 	//Lettura di "data->buf"
 	if(data->hdr.len==0) data->buf=NULL;
 	else{
@@ -240,14 +502,7 @@ int readMsg(long fd, message_t *msg){
  * @return 1 in caso di successo
  */
 int sendRequest(long fd, message_t *msg){
-	//i controlli le fanno le altre func
-	int ret;
-	ret=sendHeader(fd,&(msg->hdr));
-	if (ret==-1) return -1;
-	ret=sendData(fd,&(msg->data));
-	if (ret==-1) return -1;
-
-	return 1; //tutto ok
+	return sendMsg(fd,&(msg->hdr),&(msg->data),0);
 }
 
 /**
@@ -260,16 +515,107 @@ int sendRequest(long fd, message_t *msg){
  * @return 1 in caso di successo
  */
 int sendData(long fd, message_data_t *msg){
-	//Scrivo il data->header
-	int wt=writen(fd,&(msg->hdr),sizeof(message_data_hdr_t));
-	if(wt<0) return -1;
-	//Devo ora scriver il buffer
-	if(write_buffer(fd,msg->buf,msg->hdr.len)==-1){
-		return -1;
+	//Header dei dati e buffer con una sola writev
+	struct iovec iov[2];
+	char wire[WIRE_MAX];
+	int n=1;
+	if(getProto(fd) & PROTO_V2){
+		size_t len=putName(wire,msg->hdr.receiver);
+		len+=putVarint(wire+len,msg->hdr.len);
+		iov[0].iov_base=wire;
+		iov[0].iov_len=len;
+	}
+	else{
+		iov[0].iov_base=&(msg->hdr);
+		iov[0].iov_len=sizeof(message_data_hdr_t);
 	}
+	if(msg->hdr.len>0){
+		iov[1].iov_base=msg->buf;
+		iov[1].iov_len=msg->hdr.len;
+		n++;
+	}
+	if(writevn(fd,iov,n)<0) return -1;
 	return 1;
 }
 
+/**
+ * @brief Scrive un messaggio (header ed eventuale parte dati) con una sola writev
+ *
+ * @param fd descrittore della connessione
+ * @param hdr header del messaggio
+ * @param data parte dati (NULL se va inviato solo l'header)
+ * @param reqid id della richiesta (ignorato se PROTO_REQID non è stato negoziato)
+ * @return <=0 se c'e' stato un errore
+ * @return 1 in caso di successo
+ */
+int sendMsg(long fd, message_hdr_t * hdr, message_data_t * data, unsigned int reqid){
+	struct iovec iov[MSG_IOV];
+	char wire[WIRE_MAX];
+	int n=msgToIov(iov,wire,getProto(fd),hdr,&reqid,data);
+	if(writevn(fd,iov,n)<0) return -1;
+	return 1;
+}
+
+//Nomi testuali delle opzioni di protocollo, nell'ordine dei bit
+static const char * protoNames[]={"reqid","v2"};
+#define NPROTO (sizeof(protoNames)/sizeof(protoNames[0]))
+
+/**
+ * @brief Converte l'elenco testuale delle opzioni di protocollo nella maschera di bit
+ *
+ * @param caps elenco di opzioni separate da virgole (non necessariamente terminato)
+ * @param len lunghezza massima di caps
+ * @return maschera delle opzioni riconosciute
+ */
+unsigned int parseProto(const char * caps, size_t len){
+	unsigned int proto=0;
+	size_t i=0;
+	while(i<len && caps[i]!='\0'){
+		size_t j=i;
+		while(j<len && caps[j]!='\0' && caps[j]!=',') j++;
+		for(size_t k=0; k<NPROTO; k++){
+			if(strlen(protoNames[k])==j-i && strncmp(caps+i,protoNames[k],j-i)==0) proto|=1u<<k;
+		}
+		i=(j<len && caps[j]==',') ? j+1 : j;
+	}
+	return proto;
+}
+
+/**
+ * @brief Scrive l'elenco testuale delle opzioni di protocollo di una maschera
+ *
+ * @param proto maschera di opzioni
+ * @param caps buffer di almeno MAX_NAME_LENGTH+1 caratteri
+ */
+void protoToString(unsigned int proto, char * caps){
+	caps[0]='\0';
+	for(size_t k=0; k<NPROTO; k++){
+		if(!(proto & (1u<<k))) continue;
+		if(caps[0]!='\0') strncat(caps,",",MAX_NAME_LENGTH-strlen(caps));
+		strncat(caps,protoNames[k],MAX_NAME_LENGTH-strlen(caps));
+	}
+}
+
+/**
+ * @brief Registra le opzioni di protocollo negoziate su una connessione
+ *
+ * @param fd descrittore della connessione (minore di PROTO_MAXFD)
+ * @param proto maschera di opzioni
+ */
+void setProto(long fd, unsigned int proto){
+	if(fd>=0 && fd<PROTO_MAXFD) fdproto[fd]=proto;
+}
+
+/**
+ * @brief Restituisce le opzioni di protocollo negoziate su una connessione
+ *
+ * @param fd descrittore della connessione
+ * @return maschera di opzioni (0 se non ne sono state negoziate)
+ */
+unsigned int getProto(long fd){
+	return (fd>=0 && fd<PROTO_MAXFD) ? fdproto[fd] : 0;
+}
+
 /**
  * @brief Scrive l'header del messaggio sul socket
  *
@@ -279,8 +625,5 @@ int sendData(long fd, message_data_t *msg){
  * @return 1 in caso di successo
  */
 int sendHeader(long fd, message_hdr_t *hdr){
-	int wt;
-	wt=writen(fd,hdr,sizeof(message_hdr_t));
-	if(wt<0) return -1;
-	return 1;
+	return sendMsg(fd,hdr,NULL,0);
 }
@@ -30,9 +30,40 @@
 #define UNIX_PATH_MAX  64
 #endif
 
+#include <sys/uio.h>
 #include "message.h"
 #include "connections.h"
 
+//Numero massimo di buffer che compongono un messaggio (header, id richiesta, header dati, buffer)
+#define MSG_IOV 4
+
+/*
+ * Opzioni di protocollo negoziate con CONNECT_OP: il client elenca quelle che
+ * supporta nel campo receiver della richiesta (es. "reqid"), il server risponde
+ * nello stesso campo della risposta con quelle accettate. Le opzioni valgono
+ * per i messaggi successivi alla risposta, in entrambe le direzioni.
+ */
+#define PROTO_REQID  0x1   /// ogni header è seguito da un id di richiesta (unsigned int)
+#define PROTO_V2     0x2   /// formato compatto: interi varint e nomi preceduti dalla lunghezza
+#define PROTO_ALL    (PROTO_REQID | PROTO_V2)
+
+/*
+ * Formato v2 (PROTO_V2). Gli interi sono varint (7 bit per byte, il bit più
+ * alto indica che segue un altro byte), i nomi sono la loro lunghezza (varint)
+ * seguita dai caratteri, senza terminatore:
+ *   header:       op, sender, [id di richiesta se PROTO_REQID]
+ *   header dati:  receiver, len
+ * seguiti dai len byte del buffer dati. Nelle risposte a USRLIST_OP la lista
+ * degli utenti online contiene i nomi terminati da '\0' uno dopo l'altro,
+ * invece che in slot di MAX_NAME_LENGTH+1 caratteri.
+ */
+//Byte massimi di un intero varint
+#define VARINT_MAX   5
+//Byte massimi di header, id di richiesta e header dati nel formato v2
+#define WIRE_MAX     (5*VARINT_MAX+2*MAX_NAME_LENGTH)
+//Numero di fd per cui connections.c ricorda le opzioni negoziate
+#define PROTO_MAXFD  1024
+
 /**
  * @brief Apre una connessione attravverso un socket AF_UNIX verso il server
  *
@@ -59,6 +90,19 @@ int openConnection(char* path, unsigned int ntimes, unsigned int secs);
  */
 int readHeader(long connfd, message_hdr_t *hdr);
 
+/**
+ * @brief Legge l'header del messaggio e l'eventuale id di richiesta
+ *
+ * @param connfd descrittore della connessione
+ * @param hdr puntatore all'header del messaggio da ricevere
+ * @param reqid se non NULL vi viene scritto l'id di richiesta (0 se non negoziato
+ *              o se il messaggio è una notifica)
+ *
+ * @return <=0 se c'e' stato un errore (se <0 errno deve essere settato,
+ *         se == 0 connessione chiusa)
+ */
+int readHeaderId(long connfd, message_hdr_t *hdr, unsigned int *reqid);
+
 /**
  * @brief Legge il body del messaggio dal socket
  *
@@ -110,6 +154,104 @@ int sendData(long fd, message_data_t *msg);
 
 /* da completare da parte dello studente con eventuali altri metodi di interfaccia */
 
+/**
+ * @brief Prepara il vettore di buffer con cui inviare un messaggio con writev
+ *
+ * @param iov vettore di almeno MSG_IOV elementi da riempire
+ * @param wire buffer di almeno WIRE_MAX byte in cui codificare gli header (formato v2)
+ * @param proto opzioni di protocollo della connessione
+ * @param hdr header del messaggio
+ * @param reqid id di richiesta da inviare dopo l'header (usato solo con PROTO_REQID)
+ * @param data parte dati (NULL se va inviato solo l'header)
+ * @return numero di elementi di iov usati
+ */
+int msgToIov(struct iovec * iov, char * wire, unsigned int proto, message_hdr_t * hdr, unsigned int * reqid, message_data_t * data);
+
+/**
+ * @brief Decodifica un header (ed il suo id di richiesta) in formato v2
+ *
+ * @param buf byte ricevuti
+ * @param len numero di byte in buf
+ * @param proto opzioni di protocollo della connessione
+ * @param hdr header da riempire
+ * @param reqid id di richiesta da riempire (0 se non negoziato)
+ * @return numero di byte consumati, 0 se buf non contiene ancora l'header intero
+ * @return -1 se l'header non è valido
+ */
+int decodeHdr(const char * buf, size_t len, unsigned int proto, message_hdr_t * hdr, unsigned int * reqid);
+
+/**
+ * @brief Decodifica un header dati in formato v2
+ *
+ * @param buf byte ricevuti
+ * @param len numero di byte in buf
+ * @param dhdr header dati da riempire
+ * @return numero di byte consumati, 0 se buf non contiene ancora l'header intero
+ * @return -1 se l'header non è valido
+ */
+int decodeDataHdr(const char * buf, size_t len, message_data_hdr_t * dhdr);
+
+/**
+ * @brief Scrive per intero un vettore di buffer con writev
+ *
+ * Gestisce le scritture parziali (riprendendo dal punto raggiunto), EINTR e
+ * i socket non bloccanti pieni. Il contenuto di iov viene modificato.
+ *
+ * @param fd descrittore della connessione
+ * @param iov vettore di buffer
+ * @param iovcnt numero di elementi di iov
+ * @return numero di byte scritti, -1 in caso di errore
+ */
+ssize_t writevn(long fd, struct iovec * iov, int iovcnt);
+
+/**
+ * @brief Scrive un messaggio (header ed eventuale parte dati) con una sola writev
+ *
+ * @param fd descrittore della connessione
+ * @param hdr header del messaggio
+ * @param data parte dati (NULL se va inviato solo l'header)
+ * @param reqid id della richiesta (ignorato se PROTO_REQID non è stato negoziato)
+ * @return <=0 se c'e' stato un errore
+ * @return 1 in caso di successo
+ */
+int sendMsg(long fd, message_hdr_t * hdr, message_data_t * data, unsigned int reqid);
+
+/**
+ * @brief Converte l'elenco testuale delle opzioni di protocollo nella maschera di bit
+ *
+ * @param caps elenco di opzioni separate da virgole (non necessariamente terminato)
+ * @param len lunghezza massima di caps
+ * @return maschera delle opzioni riconosciute
+ */
+unsigned int parseProto(const char * caps, size_t len);
+
+/**
+ * @brief Scrive l'elenco testuale delle opzioni di protocollo di una maschera
+ *
+ * @param proto maschera di opzioni
+ * @param caps buffer di almeno MAX_NAME_LENGTH+1 caratteri
+ */
+void protoToString(unsigned int proto, char * caps);
+
+/**
+ * @brief Registra le opzioni di protocollo negoziate su una connessione
+ *
+ * Le funzioni di lettura e scrittura di questo file le applicano ai messaggi
+ * successivi sullo stesso fd.
+ *
+ * @param fd descrittore della connessione (minore di PROTO_MAXFD)
+ * @param proto maschera di opzioni
+ */
+void setProto(long fd, unsigned int proto);
+
+/**
+ * @brief Restituisce le opzioni di protocollo negoziate su una connessione
+ *
+ * @param fd descrittore della connessione
+ * @return maschera di opzioni (0 se non ne sono state negoziate)
+ */
+unsigned int getProto(long fd);
+
 /**
  * @brief Scrive l'header del messaggio sul socket
  *
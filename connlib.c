@@ -0,0 +1,798 @@
+/**
+ * Connlib implementa lo stato delle connessioni lato server: il parser
+ * incrementale dei messaggi in arrivo su socket non bloccanti e la coda
+ * dei dati in uscita.
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Libreria che gestisce lo stato delle connessioni del server
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "connections.h"
+#include "connlib.h"
+
+//Byte massimi trasferiti da una singola sendfile/splice
+#define FILE_CHUNK (1<<20)
+//Dimensione del buffer usato per i file in arrivo quando splice non è disponibile
+#define SINK_BUF (64*1024)
+//Dimensione del buffer di ricezione di ogni connessione
+#define RBUF_SIZE (16*1024)
+
+/**
+ * @brief Crea lo stato di una connessione e rende il socket non bloccante
+ *
+ * @param fd descrittore della connessione
+ * @return la connessione, NULL in caso di errore
+ */
+conn_t * createConn(long fd){
+	int flags=fcntl(fd,F_GETFL,0);
+	if(flags<0 || fcntl(fd,F_SETFL,flags | O_NONBLOCK)<0) return NULL;
+	conn_t * c=malloc(sizeof(conn_t));
+	if(!c) return NULL;
+	memset(c,0,sizeof(conn_t));
+	c->rbuf=malloc(sizeof(char)*RBUF_SIZE);
+	if(!(c->rbuf)){
+		free(c);
+		return NULL;
+	}
+	c->fd=fd;
+	c->state=PARSE_HDR;
+	c->sinkfd=-1;
+	c->pipefd[0]=c->pipefd[1]=-1;
+	return c;
+}
+
+/**
+ * @brief Funzione interna che consuma fino a len byte dal buffer di ricezione
+ *
+ * @param dst destinazione dei byte (NULL per scartarli)
+ * @return numero di byte consumati
+ */
+static size_t takeBuffered(conn_t * c, void * dst, size_t len){
+	size_t n=c->rend-c->rstart;
+	if(n>len) n=len;
+	if(dst && n>0) memcpy(dst,c->rbuf+c->rstart,n);
+	c->rstart+=n;
+	if(c->rstart==c->rend) c->rstart=c->rend=0;
+	return n;
+}
+
+/**
+ * @brief Legge i byte mancanti della parte corrente del messaggio
+ *
+ * I byte vengono presi dal buffer di ricezione, che quando è vuoto viene
+ * riempito con una sola read (così più messaggi piccoli inviati di seguito
+ * costano una read in tutto). Le parti più grandi del buffer vengono lette
+ * direttamente nella destinazione, senza passare dal buffer.
+ *
+ * @return 1 se la parte è completa, 0 se la connessione è chiusa
+ * @return -1 in caso di errore (errno==EAGAIN se non ci sono altri byte)
+ */
+static int readPart(conn_t * c, void * dst, size_t len){
+	while(c->got<len){
+		size_t need=len-c->got;
+		if(c->rend>c->rstart){
+			c->got+=takeBuffered(c,(char *)dst+c->got,need);
+			continue;
+		}
+		if(c->noread){ //Solo byte già ricevuti
+			errno=EAGAIN;
+			return -1;
+		}
+		ssize_t rd;
+		if(need>=RBUF_SIZE) rd=read(c->fd,(char *)dst+c->got,need);
+		else rd=read(c->fd,c->rbuf,RBUF_SIZE);
+		if(rd<0){
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		if(rd==0) return 0; //EOF
+		if(need>=RBUF_SIZE) c->got+=rd;
+		else c->rend=rd;
+	}
+	c->got=0;
+	return 1;
+}
+
+/**
+ * @brief Legge un header in formato v2 (PROTO_V2)
+ *
+ * La lunghezza dell'header non è nota finchè non lo si decodifica: i byte
+ * vengono accumulati nel buffer di ricezione (che contiene sempre un header
+ * intero) e la decodifica viene ritentata dall'inizio ad ogni lettura.
+ *
+ * @param hdr header da riempire (con l'id di richiesta in c->reqid), NULL per un header dati
+ * @param dhdr header dati da riempire se hdr==NULL
+ * @return 1 se l'header è completo, 0 se la connessione è chiusa
+ * @return -1 in caso di errore (errno==EAGAIN se non ci sono altri byte)
+ */
+static int readWire(conn_t * c, message_hdr_t * hdr, message_data_hdr_t * dhdr){
+	for(;;){
+		const char * buf=c->rbuf+c->rstart;
+		size_t len=c->rend-c->rstart;
+		int n=hdr ? decodeHdr(buf,len,c->proto,hdr,&(c->reqid)) : decodeDataHdr(buf,len,dhdr);
+		if(n<0){
+			errno=EPROTO;
+			return -1;
+		}
+		if(n>0){
+			takeBuffered(c,NULL,n);
+			return 1;
+		}
+		if(c->noread){ //Solo byte già ricevuti
+			errno=EAGAIN;
+			return -1;
+		}
+		//Sposto l'header incompleto all'inizio del buffer per fare spazio
+		if(c->rstart>0){
+			memmove(c->rbuf,c->rbuf+c->rstart,len);
+			c->rstart=0;
+			c->rend=len;
+		}
+		ssize_t rd=read(c->fd,c->rbuf+c->rend,RBUF_SIZE-c->rend);
+		if(rd<0){
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		if(rd==0) return 0; //EOF
+		c->rend+=rd;
+	}
+}
+
+/**
+ * @brief Alloca il buffer per una parte dati di cui si è appena letto l'header
+ */
+static int allocBody(message_data_t * data){
+	data->buf=NULL;
+	if(data->hdr.len==0) return 1;
+	data->buf=malloc(sizeof(char)*data->hdr.len);
+	if(!data->buf){
+		errno=ENOMEM;
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * @brief Funzione interna che scrive per intero un buffer nel file di destinazione
+ */
+static int writeSink(int fd, char * buf, size_t len){
+	while(len>0){
+		ssize_t wt=write(fd,buf,len);
+		if(wt<0){
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		buf+=wt;
+		len-=wt;
+	}
+	return 1;
+}
+
+/**
+ * @brief Funzione interna che trasferisce i byte disponibili del file con un buffer limitato
+ *
+ * Usata per scartare il file (sinkfd<0) o quando splice non è supportata.
+ */
+static int copySink(conn_t * c){
+	char buf[SINK_BUF];
+	while(c->got<c->file.hdr.len){
+		size_t left=c->file.hdr.len-c->got;
+		ssize_t rd=read(c->fd,buf,(left<SINK_BUF) ? left : SINK_BUF);
+		if(rd<0){
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		if(rd==0) return 0; //EOF
+		if(c->sinkfd>=0 && writeSink(c->sinkfd,buf,rd)<0) return -1;
+		c->got+=rd;
+	}
+	return 1;
+}
+
+/**
+ * @brief Funzione interna che trasferisce i byte disponibili del file dal socket al file
+ *
+ * I byte passano per una pipe (splice richiede che uno dei due fd sia una pipe)
+ * senza essere copiati in user space.
+ *
+ * @return 1 se il file è completo, 0 se la connessione è chiusa
+ * @return -1 in caso di errore (errno==EAGAIN se non ci sono altri byte)
+ */
+static int readSink(conn_t * c){
+	//Prima i byte del file già presenti nel buffer di ricezione
+	while(c->got<c->file.hdr.len && c->rend>c->rstart){
+		size_t n=c->rend-c->rstart;
+		if(n>c->file.hdr.len-c->got) n=c->file.hdr.len-c->got;
+		if(c->sinkfd>=0 && writeSink(c->sinkfd,c->rbuf+c->rstart,n)<0) return -1;
+		c->got+=takeBuffered(c,NULL,n);
+	}
+	if(c->got<c->file.hdr.len && c->noread){
+		errno=EAGAIN;
+		return -1;
+	}
+	if(c->sinkfd<0) return copySink(c);
+	if(c->pipefd[0]<0 && pipe2(c->pipefd,O_NONBLOCK | O_CLOEXEC)==-1) return -1;
+	while(c->got<c->file.hdr.len){
+		if(c->inpipe==0){
+			size_t left=c->file.hdr.len-c->got;
+			ssize_t in=splice(c->fd,NULL,c->pipefd[1],NULL,(left<FILE_CHUNK) ? left : FILE_CHUNK,SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(in<0){
+				if(errno==EINTR) continue;
+				if(errno==EINVAL) return copySink(c); //splice non supportata
+				return -1;
+			}
+			if(in==0) return 0; //EOF
+			c->inpipe=in;
+		}
+		ssize_t out=splice(c->pipefd[0],NULL,c->sinkfd,NULL,c->inpipe,SPLICE_F_MOVE);
+		if(out<0){
+			if(errno==EINTR) continue;
+			if(errno==EAGAIN) errno=EIO; //La pipe non può essere vuota: non è un "riprova"
+			return -1;
+		}
+		c->inpipe-=out;
+		c->got+=out;
+	}
+	return 1;
+}
+
+/**
+ * @brief Legge dal socket non bloccante i byte disponibili del messaggio corrente
+ *
+ * Il parser è una macchina a stati: ogni caso legge una parte del messaggio
+ * e, se la completa, passa (fall through) alla successiva. Se i byte disponibili
+ * finiscono si esce con errno==EAGAIN e la lettura riprenderà dallo stesso punto.
+ *
+ * @param c connessione
+ *
+ * @return 1 se il messaggio (c->msg ed eventualmente c->file) è completo
+ * @return 2 se è stato letto l'header di un file in arrivo: va chiamata setFileSink
+ * @return 0 se la connessione è stata chiusa
+ * @return -1 in caso di errore, con errno==EAGAIN se servono altri byte
+ */
+int readMsgNonBlock(conn_t * c){
+	int ret;
+	switch(c->state){
+		case PARSE_HDR:
+			c->reqid=0;
+			if(c->proto & PROTO_V2) ret=readWire(c,&(c->msg.hdr),NULL); //Con l'id di richiesta
+			else ret=readPart(c,&(c->msg.hdr),sizeof(message_hdr_t));
+			if(ret<=0) return ret;
+			c->state=PARSE_REQID;
+			/* fall through */
+		case PARSE_REQID:
+			if((c->proto & PROTO_REQID) && !(c->proto & PROTO_V2)){
+				ret=readPart(c,&(c->reqid),sizeof(unsigned int));
+				if(ret<=0) return ret;
+			}
+			c->state=PARSE_DATAHDR;
+			/* fall through */
+		case PARSE_DATAHDR:
+			if(c->proto & PROTO_V2) ret=readWire(c,NULL,&(c->msg.data.hdr));
+			else ret=readPart(c,&(c->msg.data.hdr),sizeof(message_data_hdr_t));
+			if(ret<=0) return ret;
+			if(allocBody(&(c->msg.data))<0) return -1;
+			c->state=PARSE_BODY;
+			/* fall through */
+		case PARSE_BODY:
+			ret=readPart(c,c->msg.data.buf,c->msg.data.hdr.len);
+			if(ret<=0) return ret;
+			if(c->msg.hdr.op!=POSTFILE_OP){
+				c->state=PARSE_DONE;
+				return 1;
+			}
+			c->state=PARSE_FILEHDR;
+			/* fall through */
+		case PARSE_FILEHDR:
+			if(c->proto & PROTO_V2) ret=readWire(c,NULL,&(c->file.hdr));
+			else ret=readPart(c,&(c->file.hdr),sizeof(message_data_hdr_t));
+			if(ret<=0) return ret;
+			c->file.buf=NULL;
+			c->state=PARSE_FILESINK;
+			/* fall through */
+		case PARSE_FILESINK:
+			return 2; //Il chiamante deve decidere dove scrivere il file
+		case PARSE_FILEBODY:
+			ret=readSink(c);
+			if(ret<=0) return ret;
+			c->got=0;
+			c->state=PARSE_DONE;
+			/* fall through */
+		case PARSE_DONE:
+			return 1;
+	}
+	return -1;
+}
+
+/**
+ * @brief Prosegue il parsing usando solo i byte già presenti nel buffer di ricezione
+ *
+ * @param c connessione
+ * @return come readMsgNonBlock, con errno==EAGAIN se i byte ricevuti non bastano
+ */
+int readMsgBuffered(conn_t * c){
+	c->noread=1;
+	int ret=readMsgNonBlock(c);
+	c->noread=0;
+	return ret;
+}
+
+/**
+ * @brief Restituisce il buffer di ricezione se il parser lo riempirebbe con la prossima lettura
+ *
+ * @param c connessione
+ * @param buf dove scrivere l'indirizzo del buffer
+ * @return byte che si possono leggere nel buffer (0 se non è vuoto o se il parser
+ * non sta leggendo un messaggio)
+ */
+size_t recvSpace(conn_t * c, char ** buf){
+	if(c->rend>c->rstart || c->state==PARSE_FILESINK || c->state==PARSE_FILEBODY || c->state==PARSE_DONE) return 0;
+	*buf=c->rbuf;
+	return RBUF_SIZE;
+}
+
+/**
+ * @brief Registra i byte letti (da un altro meccanismo) nel buffer restituito da recvSpace
+ *
+ * @param c connessione
+ * @param n byte letti
+ */
+void recvDone(conn_t * c, size_t n){
+	c->rstart=0;
+	c->rend=n;
+}
+
+/**
+ * @brief Funzione interna che chiude la pipe usata per i file in arrivo
+ */
+static void closeSinkPipe(conn_t * c){
+	if(c->pipefd[0]<0) return;
+	close(c->pipefd[0]);
+	close(c->pipefd[1]);
+	c->pipefd[0]=c->pipefd[1]=-1;
+	c->inpipe=0;
+}
+
+/**
+ * @brief Indica dove scrivere il file in arrivo di una POSTFILE_OP
+ *
+ * @param c connessione
+ * @param fd file temporaneo aperto in scrittura (la connessione ne diventa proprietaria)
+ * @param path path del file temporaneo (copiato, NULL se fd<0)
+ * @return 0 in caso di successo, -1 in caso di errore (fd viene chiuso)
+ */
+int setFileSink(conn_t * c, int fd, const char * path){
+	if(fd>=0){
+		c->sinkpath=strdup(path);
+		if(!(c->sinkpath)){
+			close(fd);
+			unlink(path);
+			return -1;
+		}
+	}
+	c->sinkfd=fd;
+	c->got=0;
+	c->state=PARSE_FILEBODY;
+	return 0;
+}
+
+/**
+ * @brief Rende definitivo il file ricevuto rinominandolo nella destinazione
+ *
+ * @param c connessione con un messaggio completo
+ * @param path destinazione del file
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int commitFileSink(conn_t * c, const char * path){
+	if(c->sinkfd<0 || !(c->sinkpath)){
+		errno=EINVAL;
+		return -1;
+	}
+	closeSinkPipe(c);
+	int ret=close(c->sinkfd);
+	c->sinkfd=-1;
+	if(ret==0) ret=rename(c->sinkpath,path);
+	if(ret<0) unlink(c->sinkpath);
+	free(c->sinkpath);
+	c->sinkpath=NULL;
+	return ret;
+}
+
+/**
+ * @brief Libera il messaggio consumato e prepara la connessione per il successivo
+ * @param c connessione
+ */
+void resetConn(conn_t * c){
+	if(c->state>=PARSE_BODY) free(c->msg.data.buf);
+	c->msg.data.buf=NULL;
+	//File non reso definitivo (richiesta fallita o connessione chiusa a metà)
+	closeSinkPipe(c);
+	if(c->sinkfd>=0){
+		close(c->sinkfd);
+		c->sinkfd=-1;
+	}
+	if(c->sinkpath){
+		unlink(c->sinkpath);
+		free(c->sinkpath);
+		c->sinkpath=NULL;
+	}
+	c->state=PARSE_HDR;
+	c->got=0;
+}
+
+/**
+ * @brief Funzione interna che aggiunge un buffer in fondo alla coda in uscita
+ */
+static outbuf_t * appendOut(conn_t * c, char * buf, size_t len, outkind_t kind){
+	outbuf_t * ob=malloc(sizeof(outbuf_t));
+	if(!ob) return NULL;
+	ob->buf=buf;
+	ob->len=len;
+	ob->off=0;
+	ob->kind=kind;
+	ob->filefd=-1;
+	ob->pipefd[0]=ob->pipefd[1]=-1;
+	ob->inpipe=0;
+	ob->next=NULL;
+	if(c->outtail) c->outtail->next=ob;
+	else c->outhead=ob;
+	c->outtail=ob;
+	c->outbytes+=len;
+	return ob;
+}
+
+/**
+ * @brief Funzione interna che rilascia un buffer della coda in uscita
+ */
+static void releaseOut(outbuf_t * ob){
+	if(ob->kind==OUT_FILE){
+		close(ob->filefd);
+		if(ob->pipefd[0]>=0){
+			close(ob->pipefd[0]);
+			close(ob->pipefd[1]);
+		}
+	}
+	else free(ob->buf);
+	free(ob);
+}
+
+/**
+ * @brief Funzione interna che copia un messaggio in un unico blocco
+ *
+ * @param withbody se 0 il buffer dati non viene copiato (viene inviato a parte)
+ */
+static char * packMsg(conn_t * c, message_hdr_t * hdr, unsigned int reqid, message_data_t * data, int withbody, size_t * len){
+	struct iovec iov[MSG_IOV];
+	char wire[WIRE_MAX];
+	int n=msgToIov(iov,wire,c->proto,hdr,&reqid,data);
+	if(!withbody && data && data->hdr.len>0) n--;
+	size_t tot=0;
+	for(int i=0; i<n; i++) tot+=iov[i].iov_len;
+	char * buf=malloc(tot);
+	if(!buf) return NULL;
+	for(int i=0, off=0; i<n; off+=iov[i].iov_len, i++) memcpy(buf+off,iov[i].iov_base,iov[i].iov_len);
+	*len=tot;
+	return buf;
+}
+
+/**
+ * @brief Accoda un messaggio (header ed eventuale parte dati) nella coda in uscita
+ *
+ * @param c connessione
+ * @param hdr header del messaggio
+ * @param reqid id della richiesta a cui il messaggio risponde (0 per le notifiche)
+ * @param data parte dati (NULL se va inviato solo l'header)
+ * @return 0 in caso di successo, -1 in caso di errore
+ */
+int queueMsg(conn_t * c, message_hdr_t * hdr, unsigned int reqid, message_data_t * data){
+	size_t len;
+	char * buf=packMsg(c,hdr,reqid,data,1,&len);
+	if(!buf) return -1;
+	if(!appendOut(c,buf,len,OUT_HEAP)){
+		free(buf);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Invia un messaggio con una sola writev, accodando la parte non inviata
+ *
+ * @param c connessione
+ * @param hdr header del messaggio
+ * @param reqid id della richiesta a cui il messaggio risponde (0 per le notifiche)
+ * @param data parte dati (NULL se va inviato solo l'header)
+ * @return 1 se il messaggio è stato inviato per intero
+ * @return 0 se il messaggio è (in parte) in coda
+ * @return -1 in caso di errore
+ */
+int sendConnMsg(conn_t * c, message_hdr_t * hdr, unsigned int reqid, message_data_t * data){
+	if(c->outhead) return (queueMsg(c,hdr,reqid,data)==0) ? 0 : -1;
+	struct iovec iov[MSG_IOV];
+	char wire[WIRE_MAX];
+	int n=msgToIov(iov,wire,c->proto,hdr,&reqid,data);
+	size_t tot=0;
+	for(int i=0; i<n; i++) tot+=iov[i].iov_len;
+	ssize_t wt;
+	while((wt=writev(c->fd,iov,n))<0 && errno==EINTR);
+	if(wt<0){
+		if(errno!=EAGAIN && errno!=EWOULDBLOCK) return -1;
+		wt=0;
+	}
+	if((size_t)wt==tot) return 1;
+	//Il socket è pieno: accodo il messaggio segnando come inviati i primi wt byte
+	if(queueMsg(c,hdr,reqid,data)<0) return -1;
+	c->outtail->off=wt;
+	c->outbytes-=wt;
+	return 0;
+}
+
+/**
+ * @brief Accoda un messaggio il cui buffer dati è il contenuto di un file
+ *
+ * @param c connessione
+ * @param hdr header del messaggio
+ * @param reqid id della richiesta a cui il messaggio risponde
+ * @param data header della parte dati (data->hdr.len è la dimensione del file)
+ * @param filefd file aperto in lettura (la coda ne diventa proprietaria)
+ * @return 0 in caso di successo, -1 in caso di errore (filefd viene chiuso)
+ */
+int queueFile(conn_t * c, message_hdr_t * hdr, unsigned int reqid, message_data_t * data, int filefd){
+	size_t len;
+	char * buf=packMsg(c,hdr,reqid,data,0,&len);
+	if(!buf){
+		close(filefd);
+		return -1;
+	}
+	if(!appendOut(c,buf,len,OUT_HEAP)){
+		free(buf);
+		close(filefd);
+		return -1;
+	}
+	if(data->hdr.len==0){
+		close(filefd);
+		return 0;
+	}
+	outbuf_t * ob=appendOut(c,NULL,data->hdr.len,OUT_FILE);
+	if(!ob){
+		close(filefd);
+		return -1;
+	}
+	ob->filefd=filefd;
+	return 0;
+}
+
+/**
+ * @brief Funzione interna che trasferisce un file con splice attraverso una pipe
+ *
+ * Usata quando sendfile non è supportata per la coppia di fd. I byte già
+ * spostati nella pipe ma non ancora nel socket sono contati in ob->inpipe.
+ */
+static ssize_t spliceOut(conn_t * c, outbuf_t * ob){
+	if(ob->pipefd[0]<0 && pipe2(ob->pipefd,O_NONBLOCK | O_CLOEXEC)==-1) return -1;
+	if(ob->inpipe==0){
+		loff_t pos=ob->off;
+		size_t left=ob->len-ob->off;
+		ssize_t in=splice(ob->filefd,&pos,ob->pipefd[1],NULL,(left<FILE_CHUNK) ? left : FILE_CHUNK,SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(in<=0){
+			if(in==0) errno=EIO; //File troncato nel frattempo
+			return -1;
+		}
+		ob->inpipe=in;
+	}
+	ssize_t wt=splice(ob->pipefd[0],NULL,c->fd,NULL,ob->inpipe,SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if(wt>0) ob->inpipe-=wt;
+	return wt;
+}
+
+/**
+ * @brief Funzione interna che invia il file in testa alla coda senza copiarlo in user space
+ */
+static ssize_t sendFileOut(conn_t * c, outbuf_t * ob){
+	if(ob->pipefd[0]<0){
+		off_t pos=ob->off;
+		size_t left=ob->len-ob->off;
+		ssize_t wt=sendfile(c->fd,ob->filefd,&pos,(left<FILE_CHUNK) ? left : FILE_CHUNK);
+		if(wt>0) return wt;
+		if(wt==0){ //File troncato nel frattempo
+			errno=EIO;
+			return -1;
+		}
+		if(errno!=EINVAL && errno!=ENOSYS) return -1;
+	}
+	return spliceOut(c,ob);
+}
+
+/**
+ * @brief Raccoglie i buffer in testa alla coda in uscita, fino al primo file
+ *
+ * @param c connessione
+ * @param iov vettore di almeno OUT_IOV elementi
+ * @return numero di buffer raccolti (0 se la coda è vuota o inizia con un file)
+ */
+int outIov(conn_t * c, struct iovec * iov){
+	int n=0;
+	for(outbuf_t * ob=c->outhead; ob && ob->kind!=OUT_FILE && n<OUT_IOV; ob=ob->next, n++){
+		iov[n].iov_base=ob->buf+ob->off;
+		iov[n].iov_len=ob->len-ob->off;
+	}
+	return n;
+}
+
+/**
+ * @brief Toglie dalla coda in uscita i primi n byte, già inviati
+ *
+ * @param c connessione
+ * @param n byte inviati
+ */
+void outSent(conn_t * c, size_t n){
+	c->outbytes-=n;
+	//Rilascio i buffer inviati completamente, avanzo l'ultimo parziale
+	while(n>0){
+		outbuf_t * ob=c->outhead;
+		size_t left=ob->len-ob->off;
+		if(n<left){
+			ob->off+=n;
+			break;
+		}
+		n-=left;
+		c->outhead=ob->next;
+		if(!c->outhead) c->outtail=NULL;
+		releaseOut(ob);
+	}
+}
+
+/**
+ * @brief Invia i dati in coda con writev finchè il socket li accetta
+ *
+ * @param c connessione
+ * @return 1 se la coda è stata svuotata
+ * @return 0 se restano dati da inviare (il socket è pieno)
+ * @return -1 in caso di errore (errno settato)
+ */
+int flushConn(conn_t * c){
+	struct iovec iov[OUT_IOV];
+	while(c->outhead){
+		ssize_t wt;
+		if(c->outhead->kind==OUT_FILE) wt=sendFileOut(c,c->outhead);
+		else wt=writev(c->fd,iov,outIov(c,iov));
+		if(wt<0){
+			if(errno==EINTR) continue;
+			if(errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+			return -1;
+		}
+		outSent(c,wt);
+	}
+	return 1;
+}
+
+/**
+ * @brief Libera lo stato della connessione (non chiude il fd)
+ * @param c connessione
+ */
+void destroyConn(conn_t * c){
+	if(!c) return;
+	resetConn(c);
+	free(c->rbuf);
+	while(c->outhead){
+		outbuf_t * next=c->outhead->next;
+		releaseOut(c->outhead);
+		c->outhead=next;
+	}
+	free(c);
+}
+
+/**
+ * @brief Crea una mailbox vuota
+ * @return la mailbox
+ */
+mailbox_t * createMailbox(void){
+	mailbox_t * mb=malloc(sizeof(mailbox_t));
+	if(!mb){
+		perror("malloc in createMailbox");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&(mb->mtx),NULL);
+	mb->head=mb->tail=NULL;
+	return mb;
+}
+
+/**
+ * @brief funzione interna che aggancia una mail in fondo alla mailbox
+ * @return 1 se la mailbox era vuota, 0 altrimenti
+ */
+static int appendMail(mailbox_t * mb, mail_t * m){
+	m->next=NULL;
+	pthread_mutex_lock(&(mb->mtx));
+	int wasEmpty=(mb->head==NULL);
+	if(wasEmpty) mb->head=m;
+	else mb->tail->next=m;
+	mb->tail=m;
+	pthread_mutex_unlock(&(mb->mtx));
+	return wasEmpty;
+}
+
+/**
+ * @brief Inserisce in coda alla mailbox una copia di un messaggio
+ *
+ * La copia viene fatta fuori dalla mutex, che protegge solo l'aggancio alla lista.
+ *
+ * @return 1 se la mailbox era vuota, 0 altrimenti, -1 in caso di errore
+ */
+int postMail(mailbox_t * mb, conn_t * c, message_hdr_t * hdr, message_data_t * data){
+	mail_t * m=malloc(sizeof(mail_t));
+	if(!m) return -1;
+	m->fd=c->fd;
+	m->id=c->id;
+	m->resume=0;
+	m->hdr=*hdr;
+	m->data=*data;
+	m->data.buf=NULL;
+	if(data->hdr.len>0){
+		if((m->data.buf=malloc(data->hdr.len))==NULL){
+			free(m);
+			return -1;
+		}
+		memcpy(m->data.buf,data->buf,data->hdr.len);
+	}
+	return appendMail(mb,m);
+}
+
+/**
+ * @brief Restituisce una connessione al worker proprietario attraverso la sua mailbox
+ * @return 1 se la mailbox era vuota, 0 altrimenti, -1 in caso di errore
+ */
+int postResume(mailbox_t * mb, conn_t * c){
+	mail_t * m=calloc(1,sizeof(mail_t));
+	if(!m) return -1;
+	m->fd=c->fd;
+	m->id=c->id;
+	m->resume=1;
+	return appendMail(mb,m);
+}
+
+/**
+ * @brief Estrae tutti i messaggi della mailbox
+ * @return la lista dei messaggi (NULL se vuota)
+ */
+mail_t * takeMail(mailbox_t * mb){
+	pthread_mutex_lock(&(mb->mtx));
+	mail_t * list=mb->head;
+	mb->head=mb->tail=NULL;
+	pthread_mutex_unlock(&(mb->mtx));
+	return list;
+}
+
+/**
+ * @brief Libera un messaggio estratto con takeMail
+ */
+void freeMail(mail_t * m){
+	if(!m) return;
+	free(m->data.buf);
+	free(m);
+}
+
+/**
+ * @brief Libera la mailbox e i messaggi non ancora estratti
+ */
+void destroyMailbox(mailbox_t * mb){
+	mail_t * m=takeMail(mb);
+	while(m){
+		mail_t * next=m->next;
+		freeMail(m);
+		m=next;
+	}
+	pthread_mutex_destroy(&(mb->mtx));
+	free(mb);
+}
@@ -0,0 +1,444 @@
+/**
+ * Connlib implementa lo stato delle connessioni lato server: il parser
+ * incrementale dei messaggi in arrivo su socket non bloccanti e la coda
+ * dei dati in uscita. Le funzioni sono usate solo dal server, il client
+ * continua ad usare le funzioni bloccanti di connections.h.
+ *
+ * @file connlib.h
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Libreria che gestisce lo stato delle connessioni del server
+ */
+#if !defined(CONNLIB_H_)
+#define CONNLIB_H_
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "message.h"
+#include "connections.h"
+
+//Numero massimo di buffer raccolti da una singola writev
+#define OUT_IOV 64
+
+/**
+ * @enum parse_state_t
+ * @brief stato del parser incrementale di una connessione
+ *
+ * Un messaggio viene letto in più parti: header, header della parte dati e
+ * buffer dati. Una richiesta POSTFILE_OP è seguita da una seconda parte dati
+ * (il contenuto del file) che non viene mai tenuta in memoria: letto il suo
+ * header il parser si ferma finchè il chiamante non indica dove scriverla
+ * (setFileSink), poi la trasferisce a blocchi direttamente nel file.
+ */
+typedef enum {
+	PARSE_HDR,      /// lettura di message_hdr_t
+	PARSE_REQID,    /// lettura dell'id di richiesta (solo se PROTO_REQID è stato negoziato)
+	PARSE_DATAHDR,  /// lettura di message_data_hdr_t
+	PARSE_BODY,     /// lettura del buffer dati
+	PARSE_FILEHDR,  /// lettura dell'header della parte file (solo POSTFILE_OP)
+	PARSE_FILESINK, /// header del file letto, in attesa della destinazione
+	PARSE_FILEBODY, /// trasferimento del contenuto del file (solo POSTFILE_OP)
+	PARSE_DONE      /// messaggio completo, in attesa di essere consumato
+} parse_state_t;
+
+/**
+ * @enum outkind_t
+ * @brief provenienza della memoria di un buffer in uscita
+ */
+typedef enum {
+	OUT_HEAP,  /// buffer allocato con malloc (rilasciato con free)
+	OUT_FILE   /// contenuto di un file, inviato con sendfile (fd chiuso dopo l'invio)
+} outkind_t;
+
+/**
+ * @struct outbuf_t
+ * @brief elemento della coda dei dati in uscita di una connessione
+ *
+ * @var outbuf_t::buf
+ * dati da inviare (NULL per OUT_FILE)
+ * @var outbuf_t::len
+ * lunghezza dei dati
+ * @var outbuf_t::off
+ * byte già inviati
+ * @var outbuf_t::kind
+ * come inviare e rilasciare l'elemento
+ * @var outbuf_t::filefd
+ * file da inviare (solo OUT_FILE, l'offset nel file coincide con off)
+ * @var outbuf_t::pipefd
+ * pipe usata da splice quando sendfile non è disponibile
+ * @var outbuf_t::inpipe
+ * byte del file già spostati nella pipe e non ancora inviati
+ * @var outbuf_t::next
+ * elemento successivo
+ */
+typedef struct outbuf_s{
+	char * buf;
+	size_t len;
+	size_t off;
+	outkind_t kind;
+	int filefd;
+	int pipefd[2];
+	size_t inpipe;
+	struct outbuf_s * next;
+}outbuf_t;
+
+/**
+ * @struct conn_t
+ * @brief stato di una connessione lato server (socket non bloccante)
+ *
+ * @var conn_t::fd
+ * descrittore della connessione
+ * @var conn_t::state
+ * parte del messaggio in lettura
+ * @var conn_t::got
+ * byte già letti della parte corrente
+ * @var conn_t::proto
+ * opzioni di protocollo negoziate con CONNECT_OP (vedi connections.h)
+ * @var conn_t::reqid
+ * id della richiesta in costruzione o in esecuzione (0 se non negoziato)
+ * @var conn_t::rbuf
+ * buffer di ricezione, riempito con una read quando è vuoto
+ * @var conn_t::rstart
+ * primo byte ricevuto e non ancora consumato dal parser
+ * @var conn_t::rend
+ * fine dei byte ricevuti nel buffer
+ * @var conn_t::noread
+ * se diverso da 0 il parser usa solo i byte già presenti nel buffer
+ * @var conn_t::msg
+ * messaggio in costruzione
+ * @var conn_t::file
+ * header del file che segue una POSTFILE_OP (file.buf resta NULL)
+ * @var conn_t::sinkfd
+ * file temporaneo in cui viene scritto il file in arrivo (-1 se scartato)
+ * @var conn_t::sinkpath
+ * path del file temporaneo
+ * @var conn_t::pipefd
+ * pipe usata da splice per spostare i byte dal socket al file
+ * @var conn_t::inpipe
+ * byte già spostati nella pipe e non ancora scritti nel file
+ * @var conn_t::outhead
+ * primo buffer della coda in uscita
+ * @var conn_t::outtail
+ * ultimo buffer della coda in uscita
+ * @var conn_t::outbytes
+ * byte ancora da inviare
+ * @var conn_t::readpaused
+ * se diverso da 0 la lettura è sospesa finchè la coda in uscita non scende
+ * sotto OutQueueHighWater (il fd non è armato in lettura)
+ * @var conn_t::worker
+ * indice del worker proprietario della connessione (l'ultimo che l'ha servita)
+ * @var conn_t::loop
+ * indice del reactor che rileva gli eventi della connessione (modalità shared)
+ * @var conn_t::queued
+ * istante (ns, CLOCK_MONOTONIC) in cui l'ultimo messaggio completo è stato accodato ai worker
+ * @var conn_t::id
+ * numero progressivo assegnato all'accept, distingue connessioni con lo stesso fd
+ */
+typedef struct conn_s{
+	long fd;
+	parse_state_t state;
+	size_t got;
+	unsigned int proto;
+	unsigned int reqid;
+	char * rbuf;
+	size_t rstart;
+	size_t rend;
+	int noread;
+	message_t msg;
+	message_data_t file;
+	int sinkfd;
+	char * sinkpath;
+	int pipefd[2];
+	size_t inpipe;
+	outbuf_t * outhead;
+	outbuf_t * outtail;
+	size_t outbytes;
+	int readpaused;
+	int worker;
+	int loop;
+	long long queued;
+	unsigned long id;
+}conn_t;
+
+/**
+ * @struct mail_t
+ * @brief messaggio lasciato nella mailbox del worker proprietario del destinatario
+ *
+ * Una mail può anche restituire al proprietario una connessione (resume): il
+ * pool di I/O, finito il lavoro su file, gli lascia il resto della richiesta.
+ *
+ * @var mail_t::fd
+ * fd del destinatario
+ * @var mail_t::id
+ * conn_t::id del destinatario al momento dell'inserimento
+ * @var mail_t::resume
+ * diverso da 0 se la mail restituisce la connessione (hdr e data non usati)
+ * @var mail_t::hdr
+ * header del messaggio
+ * @var mail_t::data
+ * parte dati del messaggio (copia allocata sullo heap)
+ * @var mail_t::next
+ * messaggio successivo
+ */
+typedef struct mail_s{
+	long fd;
+	unsigned long id;
+	int resume;
+	message_hdr_t hdr;
+	message_data_t data;
+	struct mail_s * next;
+}mail_t;
+
+/**
+ * @struct mailbox_t
+ * @brief lista FIFO di messaggi destinati alle connessioni di un worker
+ *
+ * Qualunque thread può inserire, solo il worker proprietario estrae (tutta
+ * la lista in una volta).
+ *
+ * @var mailbox_t::mtx
+ * mutex che protegge la lista
+ * @var mailbox_t::head
+ * primo messaggio
+ * @var mailbox_t::tail
+ * ultimo messaggio
+ */
+typedef struct mailbox_s{
+	pthread_mutex_t mtx;
+	mail_t * head;
+	mail_t * tail;
+}mailbox_t;
+
+/**
+ * @brief Crea lo stato di una connessione e rende il socket non bloccante
+ *
+ * @param fd descrittore della connessione
+ * @return la connessione, NULL in caso di errore
+ */
+conn_t * createConn(long fd);
+
+/**
+ * @brief Legge dal socket non bloccante i byte disponibili del messaggio corrente
+ *
+ * La lettura riprende dal punto in cui si era fermata la chiamata precedente
+ * e si ferma appena il messaggio è completo, senza mai bloccarsi.
+ *
+ * @param c connessione
+ *
+ * @return 1 se il messaggio (c->msg ed eventualmente c->file) è completo
+ * @return 2 se è stato letto l'header di un file in arrivo: va chiamata setFileSink
+ * @return 0 se la connessione è stata chiusa
+ * @return -1 in caso di errore, con errno==EAGAIN se servono altri byte
+ */
+int readMsgNonBlock(conn_t * c);
+
+/**
+ * @brief Prosegue il parsing usando solo i byte già presenti nel buffer di ricezione
+ *
+ * Un client può inviare più richieste di seguito senza attendere le risposte:
+ * una read può quindi ricevere anche le richieste successive a quella completata.
+ * Dopo aver servito una richiesta la funzione estrae la successiva dal buffer
+ * senza altre chiamate al kernel.
+ *
+ * @param c connessione
+ * @return come readMsgNonBlock, con errno==EAGAIN se i byte ricevuti non bastano
+ */
+int readMsgBuffered(conn_t * c);
+
+/**
+ * @brief Restituisce il buffer di ricezione se il parser lo riempirebbe con la prossima lettura
+ *
+ * Permette di leggere il socket con un altro meccanismo (io_uring) al posto
+ * della read del parser; i byte letti vanno registrati con recvDone.
+ *
+ * @param c connessione
+ * @param buf dove scrivere l'indirizzo del buffer
+ * @return byte che si possono leggere nel buffer (0 se non è vuoto o se il parser
+ * non sta leggendo un messaggio)
+ */
+size_t recvSpace(conn_t * c, char ** buf);
+
+/**
+ * @brief Registra i byte letti nel buffer restituito da recvSpace
+ *
+ * @param c connessione
+ * @param n byte letti
+ */
+void recvDone(conn_t * c, size_t n);
+
+/**
+ * @brief Indica dove scrivere il file in arrivo di una POSTFILE_OP
+ *
+ * Va chiamata quando readMsgNonBlock restituisce 2. Il contenuto del file viene
+ * poi trasferito dal socket a fd a blocchi (con splice quando possibile), senza
+ * mai essere accumulato in memoria. Con fd<0 i byte del file vengono letti e
+ * scartati, ad esempio se l'header indica un file troppo grande.
+ *
+ * @param c connessione
+ * @param fd file temporaneo aperto in scrittura (la connessione ne diventa proprietaria)
+ * @param path path del file temporaneo (copiato, NULL se fd<0)
+ * @return 0 in caso di successo, -1 in caso di errore (fd viene chiuso)
+ */
+int setFileSink(conn_t * c, int fd, const char * path);
+
+/**
+ * @brief Rende definitivo il file ricevuto rinominandolo nella destinazione
+ *
+ * @param c connessione con un messaggio completo
+ * @param path destinazione del file
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int commitFileSink(conn_t * c, const char * path);
+
+/**
+ * @brief Libera il messaggio consumato e prepara la connessione per il successivo
+ *
+ * Un file ricevuto e non reso definitivo con commitFileSink viene eliminato.
+ *
+ * @param c connessione
+ */
+void resetConn(conn_t * c);
+
+/**
+ * @brief Accoda un messaggio (header ed eventuale parte dati) nella coda in uscita
+ *
+ * Header, header dati e buffer vengono copiati in un unico blocco, quindi il
+ * chiamante resta proprietario di data->buf. La coda non è protetta da lock:
+ * è compito del chiamante serializzare gli accessi alla stessa connessione.
+ *
+ * @param c connessione
+ * @param hdr header del messaggio
+ * @param reqid id della richiesta a cui il messaggio risponde (0 per le notifiche)
+ * @param data parte dati (NULL se va inviato solo l'header)
+ * @return 0 in caso di successo, -1 in caso di errore
+ */
+int queueMsg(conn_t * c, message_hdr_t * hdr, unsigned int reqid, message_data_t * data);
+
+/**
+ * @brief Invia un messaggio con una sola writev, accodando la parte non inviata
+ *
+ * Se la coda in uscita è vuota il messaggio viene scritto direttamente dai
+ * buffer del chiamante, senza copie; solo se il socket non lo accetta per intero
+ * il messaggio viene copiato in coda (segnando come inviati i byte già scritti).
+ * Se la coda non è vuota il messaggio viene soltanto accodato, per non
+ * superare i messaggi precedenti.
+ *
+ * @param c connessione
+ * @param hdr header del messaggio
+ * @param reqid id della richiesta a cui il messaggio risponde (0 per le notifiche)
+ * @param data parte dati (NULL se va inviato solo l'header)
+ * @return 1 se il messaggio è stato inviato per intero
+ * @return 0 se il messaggio è (in parte) in coda
+ * @return -1 in caso di errore
+ */
+int sendConnMsg(conn_t * c, message_hdr_t * hdr, unsigned int reqid, message_data_t * data);
+
+/**
+ * @brief Accoda un messaggio il cui buffer dati è il contenuto di un file
+ *
+ * Il file non viene letto in memoria: dopo l'header del messaggio e della parte
+ * dati il contenuto viene inviato con sendfile (o splice se non supportata),
+ * direttamente dalla page cache al socket.
+ *
+ * @param c connessione
+ * @param hdr header del messaggio
+ * @param reqid id della richiesta a cui il messaggio risponde
+ * @param data header della parte dati (data->hdr.len è la dimensione del file)
+ * @param filefd file aperto in lettura (la coda ne diventa proprietaria)
+ * @return 0 in caso di successo, -1 in caso di errore (filefd viene chiuso)
+ */
+int queueFile(conn_t * c, message_hdr_t * hdr, unsigned int reqid, message_data_t * data, int filefd);
+
+/**
+ * @brief Invia i dati in coda con writev finchè il socket li accetta
+ *
+ * Tutti i buffer in coda (più messaggi consecutivi) vengono raccolti in un'unica
+ * writev, gestendo le scritture parziali; i file in coda vengono inviati con sendfile.
+ *
+ * @param c connessione
+ * @return 1 se la coda è stata svuotata
+ * @return 0 se restano dati da inviare (il socket è pieno)
+ * @return -1 in caso di errore (errno settato)
+ */
+int flushConn(conn_t * c);
+
+/**
+ * @brief Raccoglie i buffer in testa alla coda in uscita, fino al primo file
+ *
+ * Insieme ad outSent permette di inviare la coda con un altro meccanismo
+ * (io_uring) al posto della writev di flushConn.
+ *
+ * @param c connessione
+ * @param iov vettore di almeno OUT_IOV elementi
+ * @return numero di buffer raccolti (0 se la coda è vuota o inizia con un file)
+ */
+int outIov(conn_t * c, struct iovec * iov);
+
+/**
+ * @brief Toglie dalla coda in uscita i primi n byte, già inviati
+ *
+ * @param c connessione
+ * @param n byte inviati
+ */
+void outSent(conn_t * c, size_t n);
+
+/**
+ * @brief Libera lo stato della connessione (non chiude il fd)
+ * @param c connessione
+ */
+void destroyConn(conn_t * c);
+
+/**
+ * @brief Crea una mailbox vuota
+ * @return la mailbox
+ */
+mailbox_t * createMailbox(void);
+
+/**
+ * @brief Inserisce in coda alla mailbox una copia di un messaggio
+ *
+ * @param mb mailbox
+ * @param c connessione del destinatario (se ne memorizzano fd e id)
+ * @param hdr header del messaggio
+ * @param data parte dati del messaggio (viene copiata)
+ * @return 1 se la mailbox era vuota (il proprietario va risvegliato), 0 altrimenti
+ * @return -1 in caso di errore (errno settato)
+ */
+int postMail(mailbox_t * mb, conn_t * c, message_hdr_t * hdr, message_data_t * data);
+
+/**
+ * @brief Restituisce una connessione al worker proprietario attraverso la sua mailbox
+ *
+ * @param mb mailbox del proprietario
+ * @param c connessione (disarmata: finchè il proprietario non la riprende nessuno la serve)
+ * @return 1 se la mailbox era vuota (il proprietario va risvegliato), 0 altrimenti
+ * @return -1 in caso di errore (errno settato)
+ */
+int postResume(mailbox_t * mb, conn_t * c);
+
+/**
+ * @brief Estrae tutti i messaggi della mailbox
+ *
+ * @param mb mailbox
+ * @return la lista dei messaggi in ordine di inserimento (NULL se vuota),
+ * ogni elemento va liberato con freeMail
+ */
+mail_t * takeMail(mailbox_t * mb);
+
+/**
+ * @brief Libera un messaggio estratto con takeMail
+ * @param m messaggio
+ */
+void freeMail(mail_t * m);
+
+/**
+ * @brief Libera la mailbox e i messaggi non ancora estratti
+ * @param mb mailbox
+ */
+void destroyMailbox(mailbox_t * mb);
+
+#endif
@@ -0,0 +1,300 @@
+/**
+ * Hashlib implementa una tabella hash ad indirizzamento aperto (robin hood)
+ * con gli hash delle chiavi memorizzati in un vettore separato.
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Libreria che implementa una tabella hash ad indirizzamento aperto
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "hashlib.h"
+
+//Costanti della funzione hash
+#define HASH_SEED 0x2d358dccaa6c78a5ULL
+#define HASH_MUL 0x9e3779b97f4a7c15ULL
+
+/**
+ * @brief Funzione hash delle chiavi
+ *
+ * La stringa viene letta 8 byte alla volta (l'ultimo blocco completato con
+ * zeri), ogni blocco viene mescolato con una moltiplicazione e uno shift e
+ * il risultato passa per il finalizzatore di MurmurHash3, così anche i bit
+ * bassi (usati per scegliere la posizione) dipendono da tutta la chiave.
+ *
+ * @return hash a 32 bit, mai 0 (0 indica una posizione libera)
+ */
+unsigned int hashString(const char * key){
+	size_t len=strlen(key);
+	const unsigned char * p=(const unsigned char *)key;
+	uint64_t h=HASH_SEED ^ (len*HASH_MUL);
+	uint64_t w;
+	while(len>=8){
+		memcpy(&w,p,8);
+		h=(h^w)*HASH_MUL;
+		h^=h>>29;
+		p+=8;
+		len-=8;
+	}
+	if(len>0){
+		w=0;
+		memcpy(&w,p,len);
+		h=(h^w)*HASH_MUL;
+		h^=h>>29;
+	}
+	h^=h>>33;
+	h*=0xff51afd7ed558ccdULL;
+	h^=h>>33;
+	h*=0xc4ceb9fe1a85ec53ULL;
+	h^=h>>33;
+	unsigned int r=(unsigned int)h;
+	return r ? r : 1;
+}
+
+/**
+ * @brief Funzione interna che alloca le posizioni di una tabella
+ * @return 0 in caso di successo, -1 se manca memoria
+ */
+static int allocTable(hashmap_table * t, size_t nslots){
+	t->hashes=calloc(nslots,sizeof(unsigned int));
+	t->entries=malloc(nslots*sizeof(hashmap_entry));
+	if(!t->hashes || !t->entries){
+		free(t->hashes);
+		free(t->entries);
+		return -1;
+	}
+	t->nslots=nslots;
+	t->count=0;
+	return 0;
+}
+
+/**
+ * @brief Funzione interna che libera le posizioni di una tabella
+ */
+static void freeTable(hashmap_table * t){
+	free(t->hashes);
+	free(t->entries);
+	memset(t,0,sizeof(hashmap_table));
+}
+
+/**
+ * @brief Funzione interna: distanza dell'elemento in pos dalla sua posizione ideale
+ */
+static inline size_t distance(hashmap_table * t, unsigned int hash, size_t pos){
+	return (pos-(hash & (t->nslots-1))) & (t->nslots-1);
+}
+
+/**
+ * @brief Funzione interna che cerca una chiave in una tabella
+ * @return posizione della chiave, -1 se non c'è
+ */
+static long lookup(hashmap_table * t, unsigned int hash, const char * key){
+	if(t->nslots==0) return -1;
+	size_t mask=t->nslots-1;
+	size_t pos=hash & mask;
+	for(size_t d=0; ; d++){
+		unsigned int h=t->hashes[pos];
+		//Posizione libera o elemento più vicino a casa: la chiave non c'è
+		if(h==0 || distance(t,h,pos)<d) return -1;
+		if(h==hash && strcmp(t->entries[pos].key,key)==0) return (long)pos;
+		pos=(pos+1) & mask;
+	}
+}
+
+/**
+ * @brief Funzione interna che inserisce un elemento (non presente) in una tabella non piena
+ */
+static void place(hashmap_table * t, unsigned int hash, char * key, void * data){
+	size_t mask=t->nslots-1;
+	size_t pos=hash & mask;
+	size_t d=0;
+	hashmap_entry e={key,data};
+	for(;;){
+		unsigned int h=t->hashes[pos];
+		if(h==0){
+			t->hashes[pos]=hash;
+			t->entries[pos]=e;
+			t->count++;
+			return;
+		}
+		size_t ed=distance(t,h,pos);
+		if(ed<d){//Robin hood: l'elemento più vicino a casa cede il posto
+			hashmap_entry tmp=t->entries[pos];
+			t->hashes[pos]=hash;
+			t->entries[pos]=e;
+			hash=h;
+			e=tmp;
+			d=ed;
+		}
+		pos=(pos+1) & mask;
+		d++;
+	}
+}
+
+/**
+ * @brief Funzione interna che libera una posizione
+ *
+ * Gli elementi successivi lontani dalla propria posizione ideale vengono
+ * spostati indietro di uno (nessuna lapide): le ricerche restano corrette.
+ */
+static void removeAt(hashmap_table * t, size_t pos){
+	size_t mask=t->nslots-1;
+	for(;;){
+		size_t next=(pos+1) & mask;
+		unsigned int h=t->hashes[next];
+		if(h==0 || distance(t,h,next)==0) break;
+		t->hashes[pos]=h;
+		t->entries[pos]=t->entries[next];
+		pos=next;
+	}
+	t->hashes[pos]=0;
+	t->count--;
+}
+
+/**
+ * @brief Funzione interna che sposta in cur al più n posizioni della tabella in svuotamento
+ *
+ * Le posizioni prima di migrate restano sempre libere: quando un elemento
+ * viene spostato, removeAt riporta in migrate gli eventuali elementi dello
+ * stesso gruppo, che verranno spostati ai passi successivi. Quindi in old
+ * non rimangono elementi la cui posizione ideale precede migrate e le
+ * ricerche in old restano corrette.
+ */
+static void migrateStep(hashmap * map, int n){
+	hashmap_table * old=&(map->old);
+	if(old->nslots==0) return;
+	while(n-- > 0 && old->count>0){
+		if(old->hashes[map->migrate]==0){
+			map->migrate++;
+			continue;
+		}
+		place(&(map->cur),old->hashes[map->migrate],old->entries[map->migrate].key,old->entries[map->migrate].data);
+		removeAt(old,map->migrate);
+	}
+	if(old->count==0){
+		freeTable(old);
+		map->migrate=0;
+	}
+}
+
+/**
+ * @brief Crea una tabella
+ * @param nelems numero di elementi previsti
+ * @return la tabella
+ */
+hashmap * createHashMap(size_t nelems){
+	hashmap * map=malloc(sizeof(hashmap));
+	if(!map){
+		perror("malloc in createHashMap");
+		exit(EXIT_FAILURE);
+	}
+	memset(map,0,sizeof(hashmap));
+	size_t nslots=8;
+	while(nslots*HASHMAP_MAX_LOAD/100<nelems) nslots*=2;
+	if(allocTable(&(map->cur),nslots)<0){
+		perror("malloc in createHashMap");
+		exit(EXIT_FAILURE);
+	}
+	return map;
+}
+
+/**
+ * @brief Cerca una chiave (senza modificare la tabella)
+ * @return il valore associato, NULL se la chiave non c'è
+ */
+void * hashMapFind(hashmap * map, const char * key){
+	unsigned int hash=hashString(key);
+	long pos=lookup(&(map->cur),hash,key);
+	if(pos>=0) return map->cur.entries[pos].data;
+	pos=lookup(&(map->old),hash,key);
+	if(pos>=0) return map->old.entries[pos].data;
+	return NULL;
+}
+
+/**
+ * @brief Inserisce un elemento
+ * @return 0 in caso di successo, -1 se la chiave è già presente, -2 se la tabella è piena
+ */
+int hashMapInsert(hashmap * map, char * key, void * data){
+	migrateStep(map,HASHMAP_REHASH_STEP);
+	unsigned int hash=hashString(key);
+	if(lookup(&(map->cur),hash,key)>=0 || lookup(&(map->old),hash,key)>=0) return -1;
+
+	size_t total=map->cur.count+map->old.count+1;
+	if(map->old.nslots==0 && total*100>map->cur.nslots*HASHMAP_MAX_LOAD){
+		//Avvio un ampliamento: cur diventa la tabella da svuotare
+		hashmap_table bigger;
+		if(allocTable(&bigger,map->cur.nslots*2)==0){
+			map->old=map->cur;
+			map->cur=bigger;
+			map->migrate=0;
+			map->nresize++;
+			migrateStep(map,HASHMAP_REHASH_STEP);
+		}
+	}
+	if(map->cur.count==map->cur.nslots) return -2;
+	place(&(map->cur),hash,key,data);
+	return 0;
+}
+
+/**
+ * @brief Elimina un elemento
+ * @return 0 in caso di successo, -1 se la chiave non c'è
+ */
+int hashMapDelete(hashmap * map, const char * key, void (*free_data)(void *)){
+	migrateStep(map,HASHMAP_REHASH_STEP);
+	unsigned int hash=hashString(key);
+	hashmap_table * t=&(map->cur);
+	long pos=lookup(t,hash,key);
+	if(pos<0){
+		t=&(map->old);
+		pos=lookup(t,hash,key);
+		if(pos<0) return -1;
+	}
+	void * data=t->entries[pos].data;
+	removeAt(t,(size_t)pos);
+	if(t==&(map->old) && t->count==0){
+		freeTable(t);
+		map->migrate=0;
+	}
+	if(free_data && data) free_data(data);
+	return 0;
+}
+
+/**
+ * @brief Raccoglie le statistiche di una tabella
+ */
+void hashMapStats(hashmap * map, hashmap_stats * st){
+	memset(st,0,sizeof(hashmap_stats));
+	st->nslots=hashMapSlots(map);
+	st->count=map->cur.count+map->old.count;
+	st->rehashing=map->old.nslots!=0;
+	st->nresize=map->nresize;
+	hashmap_table * tabs[2]={&(map->cur),&(map->old)};
+	for(int k=0; k<2; k++){
+		for(size_t i=0; i<tabs[k]->nslots; i++){
+			unsigned int h=tabs[k]->hashes[i];
+			if(h!=0 && distance(tabs[k],h,i)>st->maxdist) st->maxdist=distance(tabs[k],h,i);
+		}
+	}
+}
+
+/**
+ * @brief Distrugge la tabella
+ */
+void destroyHashMap(hashmap * map, void (*free_data)(void *)){
+	if(!map) return;
+	if(free_data){
+		size_t i; char * kp; void * dp;
+		hashMapForeach(map,i,kp,dp){
+			if(dp) free_data(dp);
+		}
+	}
+	freeTable(&(map->cur));
+	freeTable(&(map->old));
+	free(map);
+}
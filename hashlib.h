@@ -0,0 +1,189 @@
+/**
+ * Hashlib implementa una tabella hash ad indirizzamento aperto per chiavi
+ * stringa (i nickname), alternativa ad icl_hash per il registro utenti.
+ *
+ * Le collisioni sono risolte con il metodo "robin hood": ogni elemento sta
+ * il più vicino possibile alla propria posizione ideale e, durante un
+ * inserimento, chi è più lontano dalla propria posizione ruba il posto a
+ * chi è più vicino. Una ricerca si ferma quindi appena incontra un elemento
+ * più vicino a casa di quanto lo sarebbe la chiave cercata.
+ * Per ogni posizione viene memorizzato l'hash a 32 bit della chiave in un
+ * vettore separato: le ricerche scorrono soltanto quel vettore e confrontano
+ * le stringhe solo quando gli hash coincidono. Non ci sono nodi allocati
+ * per ogni elemento.
+ *
+ * Quando il fattore di carico raggiunge HASHMAP_MAX_LOAD la tabella raddoppia.
+ * Gli elementi vengono spostati HASHMAP_REHASH_STEP posizioni alla volta da
+ * ogni inserimento/cancellazione, così nessuna operazione paga l'intera copia.
+ *
+ * @file hashlib.h
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Libreria che implementa una tabella hash ad indirizzamento aperto
+ */
+#if !defined(HASHLIB_H_)
+#define HASHLIB_H_
+#include <stddef.h>
+
+//Fattore di carico massimo (in percentuale) prima di raddoppiare la tabella
+#define HASHMAP_MAX_LOAD 80
+//Posizioni della vecchia tabella spostate da ogni inserimento/cancellazione
+#define HASHMAP_REHASH_STEP 8
+
+/**
+ * @struct hashmap_entry
+ * @brief Elemento della tabella
+ * @var hashmap_entry::key
+ * chiave (non copiata: deve restare valida finchè l'elemento è nella tabella)
+ * @var hashmap_entry::data
+ * valore associato
+ */
+typedef struct hashmap_entry_struct{
+	char * key;
+	void * data;
+}hashmap_entry;
+
+/**
+ * @struct hashmap_table
+ * @brief Vettore di posizioni della tabella
+ * @var hashmap_table::hashes
+ * hash di ogni posizione (0 se la posizione è libera)
+ * @var hashmap_table::entries
+ * elementi di ogni posizione
+ * @var hashmap_table::nslots
+ * numero di posizioni (potenza di 2, 0 se la tabella non esiste)
+ * @var hashmap_table::count
+ * numero di elementi
+ */
+typedef struct hashmap_table_struct{
+	unsigned int * hashes;
+	hashmap_entry * entries;
+	size_t nslots;
+	size_t count;
+}hashmap_table;
+
+/**
+ * @struct hashmap
+ * @brief Tabella hash ad indirizzamento aperto
+ *
+ * Non è thread safe: le ricerche non la modificano, quindi più thread
+ * possono cercare insieme (es. con un lock in lettura), mentre inserimenti
+ * e cancellazioni vanno eseguiti in mutua esclusione.
+ *
+ * @var hashmap::cur
+ * tabella in cui vengono inseriti i nuovi elementi
+ * @var hashmap::old
+ * tabella in fase di svuotamento durante un ampliamento (nslots==0 altrimenti)
+ * @var hashmap::migrate
+ * prossima posizione di old da spostare
+ * @var hashmap::nresize
+ * numero di ampliamenti
+ */
+typedef struct hashmap_struct{
+	hashmap_table cur;
+	hashmap_table old;
+	size_t migrate;
+	int nresize;
+}hashmap;
+
+/**
+ * @struct hashmap_stats
+ * @brief Statistiche di una tabella (vedi hashMapStats)
+ * @var hashmap_stats::nslots
+ * posizioni (di entrambe le tabelle durante un ampliamento)
+ * @var hashmap_stats::count
+ * elementi
+ * @var hashmap_stats::maxdist
+ * distanza massima di un elemento dalla propria posizione ideale
+ * @var hashmap_stats::rehashing
+ * 1 se è in corso un ampliamento
+ * @var hashmap_stats::nresize
+ * numero di ampliamenti
+ */
+typedef struct hashmap_stats_struct{
+	size_t nslots;
+	size_t count;
+	size_t maxdist;
+	int rehashing;
+	int nresize;
+}hashmap_stats;
+
+/**
+ * @brief Funzione hash delle chiavi (8 byte alla volta)
+ * @param key stringa terminata da '\0'
+ * @return hash a 32 bit, mai 0
+ */
+unsigned int hashString(const char * key);
+
+/**
+ * @brief Crea una tabella
+ * @param nelems numero di elementi previsti (la tabella cresce comunque da sola)
+ * @return la tabella
+ */
+hashmap * createHashMap(size_t nelems);
+
+/**
+ * @brief Cerca una chiave
+ * @param map tabella
+ * @param key chiave da cercare
+ * @return il valore associato, NULL se la chiave non c'è
+ */
+void * hashMapFind(hashmap * map, const char * key);
+
+/**
+ * @brief Inserisce un elemento
+ * @param map tabella
+ * @param key chiave (non copiata)
+ * @param data valore
+ * @return 0 in caso di successo
+ * @return -1 se la chiave è già presente
+ * @return -2 se la tabella è piena e non è stato possibile ampliarla
+ */
+int hashMapInsert(hashmap * map, char * key, void * data);
+
+/**
+ * @brief Elimina un elemento
+ * @param map tabella
+ * @param key chiave da eliminare
+ * @param free_data funzione che libera il valore (può essere NULL)
+ * @return 0 in caso di successo, -1 se la chiave non c'è
+ */
+int hashMapDelete(hashmap * map, const char * key, void (*free_data)(void *));
+
+/**
+ * @brief Raccoglie le statistiche di una tabella
+ * @param map tabella
+ * @param st dove scrivere le statistiche
+ */
+void hashMapStats(hashmap * map, hashmap_stats * st);
+
+/**
+ * @brief Distrugge la tabella
+ * @param map tabella
+ * @param free_data funzione che libera i valori (può essere NULL)
+ */
+void destroyHashMap(hashmap * map, void (*free_data)(void *));
+
+//Numero di posizioni da visitare con hashMapForeach
+#define hashMapSlots(map) ((map)->cur.nslots+(map)->old.nslots)
+
+//i-esima posizione (prima quelle di cur, poi quelle di old)
+#define hashMapHashAt(map,i) \
+	((i)<(map)->cur.nslots ? (map)->cur.hashes[i] : (map)->old.hashes[(i)-(map)->cur.nslots])
+#define hashMapEntryAt(map,i) \
+	((i)<(map)->cur.nslots ? &((map)->cur.entries[i]) : &((map)->old.entries[(i)-(map)->cur.nslots]))
+
+/**
+ * Scorre tutti gli elementi della tabella: i (size_t) è l'indice della posizione,
+ * kp e dp vengono assegnati con chiave e valore di ogni elemento.
+ * La tabella non va modificata durante la visita.
+ */
+#define hashMapForeach(map,i,kp,dp) \
+	for(i=0; i<hashMapSlots(map); i++) \
+		if(hashMapHashAt(map,i)!=0 && \
+			((kp=hashMapEntryAt(map,i)->key)!=NULL) && ((dp=hashMapEntryAt(map,i)->data),1))
+
+#endif
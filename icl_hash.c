@@ -79,7 +79,10 @@ icl_hash_create( int nbuckets, unsigned int (*hash_function)(void*), int (*hash_
 
     ht->nentries = 0;
     ht->buckets = (icl_entry_t**)malloc(nbuckets * sizeof(icl_entry_t*));
-    if(!ht->buckets) return NULL;
+    if(!ht->buckets) {
+        free(ht);
+        return NULL;
+    }
 
     ht->nbuckets = nbuckets;
     for(i=0;i<ht->nbuckets;i++)
@@ -185,7 +188,7 @@ int icl_hash_delete(icl_hash_t *ht, void* key, void (*free_key)(void*), void (*f
             }
             if (*free_key && curr->key) (*free_key)(curr->key);
             if (*free_data && curr->data) (*free_data)(curr->data);
-            ht->nentries++;
+            ht->nentries--;
             free(curr);
             return 0;
         }
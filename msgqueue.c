@@ -17,115 +17,99 @@
 
 /**
  * @brief Crea una coda di messaggi (history) di dimensione dim (historysize)
+ *
+ * Coda, posizioni e buffer dei corpi stanno in un'unica allocazione.
+ * Il buffer dei corpi ha spazio per dim_max+1 messaggi: lo spazio in più copre
+ * quello lasciato libero in fondo al buffer quando un corpo riparte da 0, così
+ * finchè i corpi non superano bodysize non si perde mai un messaggio prima che
+ * la coda sia piena.
+ *
  * @param dim dimensione massima coda
+ * @param bodysize spazio per il corpo di ogni messaggio (almeno MSGQUEUE_MIN_BODY)
  *
  * @return ritorna la coda messaggi (msgqueue_t)
  */
-msgqueue_t * createMsgQueue(int dim){
+msgqueue_t * createMsgQueue(int dim, size_t bodysize){
 	if(dim<1) dim=1;
-	msgqueue_t * new = malloc(sizeof(msgqueue_t));
+	bodysize=msgQueueSlot(bodysize);
+	size_t dim_max=dim+1;
+	size_t bodycap=(dim_max+1)*bodysize;
+	msgqueue_t * new = malloc(sizeof(msgqueue_t)+dim_max*sizeof(msgnode_t)+bodycap);
 	if(new){
 		new->size=0;
-		new->dim_max=dim+1;
-		new->head=new->tail=NULL;
+		new->dim_max=dim_max;
+		new->head=0;
+		new->nodes=(msgnode_t *)(new+1);
+		new->body=(char *)(new->nodes+dim_max);
+		new->bodycap=bodycap;
+		new->bodytail=0;
 	}
 	return new;
 }
 
 /**
- * @brief Crea un elemento per la history (di tipo: msgnode_t) facendone
- * una copia completa
- * @param msgtocpy messaggio che deve essere copiato nella history (message_t)
- *
- * @return ritorna il nodo della lista contenente il messaggio copiato
+ * @brief Funzione interna che elimina il messaggio più vecchio
  */
-msgnode_t * createMsgNode(message_t * msgtocpy){
-	if(msgtocpy){
-		//Allochiamo il nuovo nodo
-		msgnode_t * new = malloc(sizeof(msgnode_t));
-		if(new){
-			//Allochiamo un nuovo buffer per il messaggio e ci copiamo dentro
-			char * buf;
-			buf = malloc(sizeof(char)*(msgtocpy->data.hdr.len));
-			strncpy(buf,msgtocpy->data.buf,msgtocpy->data.hdr.len);
-			//Settiamo il nodo: nodo->msg (1/2)
-			new->msg=malloc(sizeof(message_t));
-			setHeader(&new->msg->hdr, msgtocpy->hdr.op, msgtocpy->hdr.sender);
-			setData(&new->msg->data, msgtocpy->data.hdr.receiver, buf, msgtocpy->data.hdr.len);
-			//Settiamo il nodo: nodo->next(2/2)
-			new->next=NULL;
-			return new;
-		}
-		else{
-			return NULL;
-		}
+static void dropOldest(msgqueue_t * queue){
+	queue->head=(queue->head+1)%queue->dim_max;
+	queue->size--;
+	if(queue->size==0){
+		queue->head=0;
+		queue->bodytail=0;
 	}
-	return NULL;
 }
 
 /**
- * @brief Estrae il primo messaggio dalla hsitory
- * @param queue coda da dove estrarre il messaggio
+ * @brief Funzione interna che cerca len byte contigui liberi nel buffer dei corpi
  *
- * @return ritorno il messaggio estratto
- * @return (NULL se non ci sono messaggi)
+ * I corpi occupano il buffer da quello del messaggio più vecchio fino a
+ * bodytail (eventualmente ripartendo da 0): lo spazio libero è dopo bodytail
+ * e, se i corpi non hanno ancora fatto il giro, anche prima del più vecchio.
+ * I messaggi con corpo vuoto non occupano byte e vengono ignorati.
+ *
+ * @return posizione dove scrivere il corpo, -1 se non c'è spazio
  */
-message_t * popMsgQueue(msgqueue_t * queue){
-	message_t * ret = NULL;
-	if(queue->size>0){
-		if(queue->head->msg!=NULL){
-			ret = malloc(sizeof(message_t)); //alloco messaggio da ritornare
-			message_t * tmp = queue->head->msg; //Prendo il messaggio che sta in testa
-			char * buf = malloc(sizeof(char)*tmp->data.hdr.len);
-			strncpy(buf,tmp->data.buf,tmp->data.hdr.len);
-			setHeader(&ret->hdr,tmp->hdr.op,tmp->hdr.sender);
-			setData(&ret->data,tmp->data.hdr.receiver,buf,tmp->data.hdr.len);
-			//ora che ho copiato il messaggio aggiorno in testa
-			msgnode_t * newhead=queue->head->next; //nuova testa;
-			destroyMsgNode(queue->head);
-			queue->head=newhead; //AGGIORNO IL PUNTATORE IN testa
-			queue->size--; //Diminuisco la dimenesione
-		}
+static long findBody(msgqueue_t * queue, size_t len){
+	//Il primo corpo occupato è quello del più vecchio messaggio non vuoto
+	size_t i=0;
+	while(i<queue->size && msgQueueAt(queue,i)->len==0) i++;
+	if(i==queue->size) return (len<=queue->bodycap) ? 0 : -1;
+	size_t start=msgQueueAt(queue,i)->off;
+	if(queue->bodytail>start){
+		if(queue->bodycap-queue->bodytail>=len) return queue->bodytail;
+		if(start>=len) return 0;
 	}
-	return ret;
+	else if(start-queue->bodytail>=len) return queue->bodytail;
+	return -1;
 }
 
 /**
  * @brief Inserisce a fine coda il messaggio
  * @param queue history dove inserire i messaggi
- * @param msgtocpy il messaggio che deve essere copiato nella history
+ * @param op tipo del messaggio
+ * @param sender id del mittente
+ * @param buf corpo del messaggio (viene copiato)
+ * @param len lunghezza del corpo
  *
- * @return -1 in caso di fallimento (queueu==NULL || msgtocpy ==NULL)
+ * @return -1 in caso di fallimento (queue==NULL o corpo più grande dell'intero buffer)
  * @return 0 in caso di successo
  */
-int pushMsgQueue(msgqueue_t * queue, message_t * msgtocpy){
-
-	int ret=-1;
-	if(queue && msgtocpy){
-		//Creiamo un nuovo nodo
-		msgnode_t * new = createMsgNode(msgtocpy);
-
-		//Inseriamolo
-		if(new){
-			if(!queue->head){ //Se è il 1°
-				queue->head=queue->tail=new;
-				queue->size++;
-			}
-			else{ //Se è in corso
-				queue->tail->next=new;
-				queue->tail=new;
+int pushMsgQueue(msgqueue_t * queue, op_t op, unsigned int sender, const char * buf, unsigned int len){
+	if(!queue || len>queue->bodycap) return -1;
+	//Faccio posto: una posizione libera e len byte contigui per il corpo
+	if(queue->size==queue->dim_max) dropOldest(queue);
+	long off=queue->bodytail;
+	if(len>0) while((off=findBody(queue,len))<0) dropOldest(queue);
 
-				if(queue->size<queue->dim_max) queue->size++;
-				else if(queue->size==queue->dim_max){
-					msgnode_t * newhead=queue->head->next;
-					destroyMsgNode(queue->head);
-					queue->head=newhead;
-				}
-			}
-			ret = 0;
-		}
-	}
-	return ret;
+	msgnode_t * node=&(queue->nodes[(queue->head+queue->size)%queue->dim_max]);
+	node->op=op;
+	node->sender=sender;
+	node->len=len;
+	node->off=off;
+	if(len>0) memcpy(queue->body+off,buf,len);
+	queue->bodytail=off+len;
+	queue->size++;
+	return 0;
 }
 
 /**
@@ -133,23 +117,5 @@ int pushMsgQueue(msgqueue_t * queue, message_t * msgtocpy){
  * @param queue coda dei messaggi da eliminare
  */
 void destroyMsgQueue(msgqueue_t * queue){
-	while(queue->head){
-		msgnode_t * newhead=queue->head->next;
-		destroyMsgNode(queue->head);
-		queue->head=newhead;
-	}
 	free(queue);
 }
-
-/**
- * @function destroyMsgNode
- * @brief Distrugge un nodo della history
- * @param node nodo da deallocare (msgnode_t)
- */
-void destroyMsgNode(msgnode_t * node){
-	free(node->msg->data.buf);//elimino il buffer messaggio.
-	free(node->msg);
-	//Distruggo il nodo
-	free(node);
-	//node=NULL;
-}
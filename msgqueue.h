@@ -1,6 +1,14 @@
 /**
  * Msqueue implementa una coda di messaggi, utilizzata dal server chatty per
  * fare lo store dei messaggi ricevuti fino a un max di "historysize".
+ *
+ * La coda è un vettore circolare di dim_max posizioni e i corpi dei messaggi
+ * stanno in un buffer circolare di byte della coda stessa: tutto viene
+ * allocato (con una sola malloc) alla creazione, quindi inserire un
+ * messaggio non alloca nè libera memoria e l'occupazione di ogni history è
+ * fissata. Se il buffer dei corpi non ha spazio (solo con corpi più grandi
+ * di bodysize) vengono eliminati i messaggi più vecchi, come quando la coda
+ * è piena.
  * @see message.h
  *
  * @file msgqueue.h
@@ -16,73 +24,84 @@
 
 #include "message.h"
 
+//Spazio minimo riservato al corpo di ogni messaggio (i messaggi file contengono il nome del file)
+#define MSGQUEUE_MIN_BODY 256
+//Spazio riservato ad ogni messaggio in una coda creata con bodysize: un corpo più lungo può non entrare
+#define msgQueueSlot(bodysize) (((size_t)(bodysize)<MSGQUEUE_MIN_BODY) ? MSGQUEUE_MIN_BODY : (size_t)(bodysize))
+
 /**
  * @struct msgnode_t
- * @brief Struttura che identifica un messaggio (msg + puntatore a next msg)
- * @var msgnode_t::msg
- * variabile di tipo message_t (contenente il messaggio da salvare)
- * @var msgnode_t::next
- * puntatore al messaggio successivo
+ * @brief Messaggio della history (mittente per id + posizione del corpo)
+ *
+ * Il destinatario è il proprietario della history e il nickname del mittente
+ * sta nella tabella degli utenti (userlib): si memorizza solo il suo id.
+ *
+ * @var msgnode_t::op
+ * tipo del messaggio (TXT_MESSAGE o FILE_MESSAGE)
+ * @var msgnode_t::sender
+ * id del mittente
+ * @var msgnode_t::len
+ * lunghezza del corpo
+ * @var msgnode_t::off
+ * posizione del corpo in msgqueue_t::body
  */
 typedef struct msgnode_s{
-	message_t * msg; //Messaggio da salvare
-	struct msgnode_s * next;
+	op_t op;
+	unsigned int sender;
+	unsigned int len;
+	size_t off;
 }msgnode_t;
 
 /**
  * @struct msgqueue_t
- * @brief Implementazione di una lista di messaggi di dimensione finita (historysize)
+ * @brief Implementazione di una coda circolare di messaggi di dimensione finita (historysize)
  * @var msgqueue_t::size
- * dimensione corrente della lista (<=dim_max)
+ * dimensione corrente della coda (<=dim_max)
  * @var msgqueue_t::dim_max
  * dimensione massima della history (historysize)
  * @var msgqueue_t::head
- * puntatore al messaggio in testa
- * @var msgqueue_t::tail
- * puntatore al messaggio in coda
+ * posizione in nodes del messaggio più vecchio
+ * @var msgqueue_t::nodes
+ * vettore circolare dei messaggi (dim_max posizioni)
+ * @var msgqueue_t::body
+ * buffer circolare dei corpi dei messaggi
+ * @var msgqueue_t::bodycap
+ * dimensione di body
+ * @var msgqueue_t::bodytail
+ * posizione in body dove verrà scritto il prossimo corpo
 */
 typedef struct msgqueue_s{
 	size_t size;
 	size_t dim_max;
-	msgnode_t * head;
-	msgnode_t * tail;
+	size_t head;
+	msgnode_t * nodes;
+	char * body;
+	size_t bodycap;
+	size_t bodytail;
 }msgqueue_t;
 
 /**
  * @brief Crea una coda di messaggi (history) di dimensione dim (historysize)
  * @param dim dimensione massima coda
+ * @param bodysize spazio per il corpo di ogni messaggio (almeno MSGQUEUE_MIN_BODY)
  *
- * @return ritorna la coda messaggi (msgqueue_t)
- */
-msgqueue_t * createMsgQueue(int dim);
-
-/**
- * @brief Crea un elemento per la history (di tipo: msgnode_t) facendone
- * una copia completa
- * @param msgtocpy messaggio che deve essere copiato nella history (message_t)
- *
- * @return ritorna il nodo della lista contenente il messaggio copiato
+ * @return ritorna la coda messaggi (msgqueue_t), NULL se manca memoria
  */
-msgnode_t * createMsgNode();
+msgqueue_t * createMsgQueue(int dim, size_t bodysize);
 
 /**
- * @brief Estrae il primo messaggio dalla hsitory
- * @param queue coda da dove estrarre il messaggio
- *
- * @return ritorno il messaggio estratto
- * @return (NULL se non ci sono messaggi)
- */
-message_t * popMsgQueue(msgqueue_t * queue);
-
-/**
- * @brief Inserisce a fine coda il messaggio
+ * @brief Inserisce a fine coda il messaggio (eliminando i più vecchi se la coda
+ * o il buffer dei corpi sono pieni)
  * @param queue history dove inserire i messaggi
- * @param msgtocpy il messaggio che deve essere copiato nella history
+ * @param op tipo del messaggio
+ * @param sender id del mittente
+ * @param buf corpo del messaggio (viene copiato)
+ * @param len lunghezza del corpo
  *
- * @return -1 in caso di fallimento (queueu==NULL || msgtocpy ==NULL)
+ * @return -1 in caso di fallimento (queue==NULL o corpo più grande dell'intero buffer)
  * @return 0 in caso di successo
  */
-int pushMsgQueue(msgqueue_t * queue, message_t * msg);
+int pushMsgQueue(msgqueue_t * queue, op_t op, unsigned int sender, const char * buf, unsigned int len);
 
 /**
  * @brief Funzione che dealloca dalla memoria tutta la history
@@ -90,11 +109,9 @@ int pushMsgQueue(msgqueue_t * queue, message_t * msg);
  */
 void destroyMsgQueue(msgqueue_t * queue);
 
-/**
- * @function destroyMsgNode
- * @brief Distrugge un nodo della history
- * @param node nodo da deallocare (msgnode_t)
- */
-void destroyMsgNode(msgnode_t * node);
+//i-esimo messaggio della coda (0 è il più vecchio)
+#define msgQueueAt(queue,i) (&((queue)->nodes[((queue)->head+(i))%(queue)->dim_max]))
+//Corpo di un messaggio della coda
+#define msgQueueBody(queue,node) ((queue)->body+(node)->off)
 
 #endif
@@ -13,10 +13,12 @@
 #include <sys/types.h>
 
 #define N 1024 //Supponiamo un massimo di 1024 caratteri per stringa
+#define NREQUIRED 8 //Numero di opzioni obbligatorie (le successive sono facoltative)
+#define NOPTIONS 18 //Numero totale di opzioni riconosciute
 
 //Array di appoggio che ci dice se abbiamo tutti i valori richiesti per avviare il server
-int found[8]={0,0,0,0,0,0,0,0};
-conf_var * config;
+int found[NOPTIONS]={0};
+static conf_var * config;
 
 /**
  * @brief Funzione di supporto a "parse" che serve a estrapolare sottostringhe
@@ -79,6 +81,48 @@ void trova_val(char * buf, int i, int type, int scanned){
 				strncpy(config->StatFileName, tmp, j);
 				found[7]=1;
 				break;
+			case 8 :
+				config->EdgeTriggered=(strcmp(tmp,"edge")==0);
+				found[8]=1;
+				break;
+			case 9 :
+				config->OutQueueHighWater=(size_t)atol(tmp)*1024;
+				found[9]=1;
+				break;
+			case 10 :
+				config->Affinity=(strcmp(tmp,"affinity")==0);
+				found[10]=1;
+				break;
+			case 11 :
+				config->ReactorThreads=atoi(tmp);
+				if(config->ReactorThreads<1) config->ReactorThreads=1;
+				found[11]=1;
+				break;
+			case 12 :
+				config->MinThreadsInPool=atoi(tmp);
+				found[12]=1;
+				break;
+			case 13 :
+				config->MaxThreadsInPool=atoi(tmp);
+				found[13]=1;
+				break;
+			case 14 :
+				config->PoolGrowWait=atol(tmp);
+				found[14]=1;
+				break;
+			case 15 :
+				config->PoolIdleTime=atol(tmp);
+				found[15]=1;
+				break;
+			case 16 :
+				config->FileThreadsInPool=atoi(tmp);
+				if(config->FileThreadsInPool<0) config->FileThreadsInPool=0;
+				found[16]=1;
+				break;
+			case 17 :
+				config->Uring=(strcmp(tmp,"uring")==0);
+				found[17]=1;
+				break;
 		}
 	}
 	free(tmp);
@@ -93,6 +137,17 @@ void trova_val(char * buf, int i, int type, int scanned){
 conf_var * parse(char * conffile){
 
 	config = malloc(sizeof(conf_var));
+	//Valori di default delle opzioni facoltative
+	config->EdgeTriggered=0;
+	config->OutQueueHighWater=256*1024;
+	config->Affinity=0;
+	config->ReactorThreads=1;
+	config->MinThreadsInPool=0;
+	config->MaxThreadsInPool=0;
+	config->PoolGrowWait=50;
+	config->PoolIdleTime=30;
+	config->FileThreadsInPool=2;
+	config->Uring=0;
 
 	FILE *fd;
 	if((fd=fopen(conffile,"r"))==NULL){
@@ -120,15 +175,30 @@ conf_var * parse(char * conffile){
 			else if(strncmp(buffer,"MaxHistMsgs",i)==0){ trova_val(buffer,i,5,scanned); }
 			else if(strncmp(buffer,"DirName",i)==0){ trova_val(buffer,i,6,scanned); }
 			else if(strncmp(buffer,"StatFileName",i)==0){ trova_val(buffer,i,7,scanned); }
+			else if(strncmp(buffer,"EpollTrigger",i)==0){ trova_val(buffer,i,8,scanned); }
+			else if(strncmp(buffer,"OutQueueHighWater",i)==0){ trova_val(buffer,i,9,scanned); }
+			else if(strncmp(buffer,"DispatchMode",i)==0){ trova_val(buffer,i,10,scanned); }
+			else if(strncmp(buffer,"ReactorThreads",i)==0){ trova_val(buffer,i,11,scanned); }
+			else if(strncmp(buffer,"MinThreadsInPool",i)==0){ trova_val(buffer,i,12,scanned); }
+			else if(strncmp(buffer,"MaxThreadsInPool",i)==0){ trova_val(buffer,i,13,scanned); }
+			else if(strncmp(buffer,"PoolGrowWait",i)==0){ trova_val(buffer,i,14,scanned); }
+			else if(strncmp(buffer,"PoolIdleTime",i)==0){ trova_val(buffer,i,15,scanned); }
+			else if(strncmp(buffer,"FileThreadsInPool",i)==0){ trova_val(buffer,i,16,scanned); }
+			else if(strncmp(buffer,"IOEngine",i)==0){ trova_val(buffer,i,17,scanned); }
 		}
 	}
 	free(buffer);
 	int z=0;
-	while(found[z]==1){
+	while(z<NREQUIRED && found[z]==1){
 		z++;
 	}
-	if(z==8){
+	if(z==NREQUIRED){
 		fclose(fd);
+		//Limiti del pool non indicati (o incoerenti): il pool resta fisso a ThreadsInPool
+		if(config->MinThreadsInPool<1 || config->MinThreadsInPool>config->ThreadsInPool)
+			config->MinThreadsInPool=config->ThreadsInPool;
+		if(config->MaxThreadsInPool<config->ThreadsInPool)
+			config->MaxThreadsInPool=config->ThreadsInPool;
 		return config;
 	}
 	else{
@@ -9,6 +9,8 @@
 #if !defined(PARSER_H)
 #define PARSER_H_
 
+#include <stddef.h>
+
 /**
  * @struct conf_var
  * @brief struttura per memorizzare variabili di configurazione
@@ -29,6 +31,34 @@
  * cartella dove salvare file di statistiche
  * @var conf_var::StatFileName
  * nome file di statistiche
+ * @var conf_var::EdgeTriggered
+ * modalità del reactor (opzionale EpollTrigger = level|edge, default level)
+ * @var conf_var::OutQueueHighWater
+ * byte massimi in coda d'uscita per client oltre i quali i messaggi inoltrati
+ * vengono scartati e non si leggono altre richieste del client finchè la coda
+ * non scende sotto la soglia (opzionale OutQueueHighWater in KB, default 256)
+ * @var conf_var::Affinity
+ * se diverso da 0 ogni connessione resta al worker che la riceve all'accept,
+ * che ne gestisce anche gli eventi (opzionale DispatchMode = shared|affinity,
+ * default shared)
+ * @var conf_var::ReactorThreads
+ * numero di reactor fra cui vengono distribuiti i client in modalità shared,
+ * compreso quello del main (opzionale ReactorThreads, default 1)
+ * @var conf_var::MinThreadsInPool
+ * numero minimo di worker attivi (opzionale, default ThreadsInPool)
+ * @var conf_var::MaxThreadsInPool
+ * numero massimo di worker attivi (opzionale, default ThreadsInPool)
+ * @var conf_var::PoolGrowWait
+ * attesa in coda in ms oltre la quale il pool si amplia (opzionale, default 50)
+ * @var conf_var::PoolIdleTime
+ * secondi di inattività dopo i quali un worker termina (opzionale, default 30)
+ * @var conf_var::FileThreadsInPool
+ * thread del pool di I/O che esegue le richieste su file, 0 per eseguirle
+ * nei worker (opzionale, default 2)
+ * @var conf_var::Uring
+ * se diverso da 0 i cicli degli eventi leggono (e i worker in modalità
+ * affinity scrivono) più client con una sola chiamata io_uring, se il kernel
+ * lo supporta (opzionale IOEngine = syscall|uring, default syscall)
  */
 typedef struct confvar{
 	char * UnixPath;
@@ -39,6 +69,16 @@ typedef struct confvar{
 	int MaxHistMsgs;
 	char * DirName;
 	char * StatFileName;
+	int EdgeTriggered;
+	size_t OutQueueHighWater;
+	int Affinity;
+	int ReactorThreads;
+	int MinThreadsInPool;
+	int MaxThreadsInPool;
+	long PoolGrowWait;
+	long PoolIdleTime;
+	int FileThreadsInPool;
+	int Uring;
 }conf_var;
 
 /**
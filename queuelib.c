@@ -4,15 +4,67 @@
  * originale dell'autore
  * @brief Implementazione di una coda che viene acceduta in maniera concorrente
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "queuelib.h"
 
 /**
- * @brief funzione interna che restituisce il modulo positivo
+ * @brief funzione interna che sospende il chiamante finchè *addr vale val
  */
-static inline int pos_mod(int i, int n) {
-    return (i % n + n) % n;
+static inline void futexWait(int * addr, int val){
+	syscall(SYS_futex,addr,FUTEX_WAIT_PRIVATE,val,NULL,NULL,0);
+}
+
+/**
+ * @brief funzione interna che risveglia fino a n thread sospesi su addr
+ */
+static inline void futexWake(int * addr, int n){
+	syscall(SYS_futex,addr,FUTEX_WAKE_PRIVATE,n,NULL,NULL,0);
+}
+
+/**
+ * @brief funzione interna che risveglia un consumatore sospeso, se ce n'è uno
+ *
+ * queue::wake conta i risvegli disponibili: se sono già tanti quanti i
+ * consumatori registrati (ad esempio perchè un consumatore risvegliato non è
+ * ancora tornato in esecuzione) non serve un'altra chiamata di sistema.
+ * Un risveglio non consumato da chi ha trovato l'elemento senza sospendersi
+ * resta disponibile e costa al più un giro a vuoto al prossimo consumatore.
+ */
+static void wakeOne(queue * coda){
+	int s=__atomic_load_n(&(coda->sleepers),__ATOMIC_SEQ_CST);
+	if(s==0) return;
+	int w=__atomic_load_n(&(coda->wake),__ATOMIC_SEQ_CST);
+	while(w<s){
+		if(__atomic_compare_exchange_n(&(coda->wake),&w,w+1,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST)){
+			futexWake(&(coda->wake),1);
+			return;
+		}
+		s=__atomic_load_n(&(coda->sleepers),__ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * @brief funzione interna che sospende un consumatore registrato finchè non
+ * c'è un risveglio da consumare o la coda viene chiusa
+ */
+static void waitWake(queue * coda){
+	for(;;){
+		int w=__atomic_load_n(&(coda->wake),__ATOMIC_SEQ_CST);
+		if(w>0){
+			if(__atomic_compare_exchange_n(&(coda->wake),&w,w-1,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST)) return;
+			continue;
+		}
+		if(__atomic_load_n(&(coda->closed),__ATOMIC_SEQ_CST)) return;
+		futexWait(&(coda->wake),0);
+	}
 }
 
 /**
@@ -21,7 +73,9 @@ static inline int pos_mod(int i, int n) {
  * @return true se la coda è piena, false se la coda è non piena
  */
 int isFull(queue * coda){
-	return ((coda->rear)==pos_mod(coda->front-1,coda->dim));
+	size_t enq=__atomic_load_n(&(coda->enqpos),__ATOMIC_ACQUIRE);
+	size_t deq=__atomic_load_n(&(coda->deqpos),__ATOMIC_ACQUIRE);
+	return (enq-deq>coda->mask);
 }
 
 /**
@@ -30,12 +84,14 @@ int isFull(queue * coda){
  * @return true se la coda è vuota, false se la coda è non vuota
  */
 int isEmpty(queue * coda){
-	return (coda->front==-1);
+	size_t enq=__atomic_load_n(&(coda->enqpos),__ATOMIC_ACQUIRE);
+	size_t deq=__atomic_load_n(&(coda->deqpos),__ATOMIC_ACQUIRE);
+	return (enq==deq);
 }
 
 /**
  * @brief Crea una coda concorrente
- * @param dim dimensione coda
+ * @param dim dimensione coda (arrotondata alla potenza di 2 successiva)
  *
  * @return la coda concorrente
 */
@@ -45,87 +101,155 @@ queue * createQueue(int dim){
 		perror("malloc in createQueue (coda)");
 		exit(EXIT_FAILURE);
 	}
-	coda->front=coda->rear=-1;
-	coda->dim=dim;
-	coda->elem=malloc(sizeof(int)*dim);
-	if(!(coda->elem)){
-		perror("malloc in createQueue (coda->elem)");
+	size_t n=2;
+	while(n<(size_t)dim) n<<=1;
+	coda->slots=malloc(sizeof(qslot)*n);
+	if(!(coda->slots)){
+		perror("malloc in createQueue (coda->slots)");
 		exit(EXIT_FAILURE);
 	}
-	for(int i=0; i<dim; i++){
-		coda->elem[i]=0;
+	for(size_t i=0; i<n; i++){
+		coda->slots[i].seq=i;
+		coda->slots[i].elem=0;
 	}
-	//Inizializzo mutex e var di condizionamento
-	pthread_mutex_init(&(coda->mtx),NULL);
-	pthread_cond_init(&(coda->cnd1),NULL);
+	coda->mask=n-1;
+	long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+	coda->ncpu=(ncpu>1) ? (int)ncpu : 1;
+	coda->enqpos=coda->deqpos=0;
+	coda->spinners=coda->wake=coda->sleepers=coda->closed=0;
 	return coda;
 }
 
 /**
  * @brief Funzione che accoda un elemento alla Coda
  *
- * La procedura di enQueue, inserisce un elemento in coda se e solo se essa è non piena
- * e non appena termina l'inserimento, prima di rilasciare la lock, segnala
- * un eventuale thread che si è sospeso in attesa di estrarre.
+ * Il produttore prenota la posizione enqpos con una compare-and-swap se la
+ * sua cella è libera per il giro corrente, vi scrive l'elemento e poi lo
+ * pubblica aggiornando il numero di sequenza della cella. Una cella non
+ * ancora libera ma già prenotata da un consumatore non rende la coda piena:
+ * il produttore attende che il consumatore finisca di liberarla.
  *
  * @param coda coda da gestire
  * @param elem elemento da accodare
 
  * @return 0 se accoda a buon fine
- * @return -1 se c'è un errore
+ * @return -1 se c'è un errore (coda piena o chiusa)
 */
 int enQueue(queue * coda, int elem){
+	if(__atomic_load_n(&(coda->closed),__ATOMIC_ACQUIRE)) return -1;
 
-	int ret=-1; //Valore di ritorno
-
-	pthread_mutex_lock(&(coda->mtx));
-	int DIM=coda->dim;
-	if(!isFull(coda)){
-		//Se c'è spazio allora scrivo
-		if(coda->front==-1) coda->front=0; //se è il 1° elemento aggiorno il front a 0
-		coda->rear=(coda->rear+1)%DIM;
-		coda->elem[coda->rear]=elem;
-		ret = 0;
-		pthread_cond_signal(&(coda->cnd1));
+	qslot * slot;
+	size_t pos=__atomic_load_n(&(coda->enqpos),__ATOMIC_RELAXED);
+	for(;;){
+		slot=&(coda->slots[pos & coda->mask]);
+		size_t seq=__atomic_load_n(&(slot->seq),__ATOMIC_ACQUIRE);
+		intptr_t dif=(intptr_t)seq-(intptr_t)pos;
+		if(dif==0){
+			if(__atomic_compare_exchange_n(&(coda->enqpos),&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+		}
+		else if(dif<0){
+			//Coda piena, a meno che un consumatore non stia ancora liberando la cella
+			if(pos-__atomic_load_n(&(coda->deqpos),__ATOMIC_ACQUIRE)>coda->mask) return -1;
+			//Il consumatore è stato interrotto a metà: gli cedo il processore
+			sched_yield();
+			pos=__atomic_load_n(&(coda->enqpos),__ATOMIC_RELAXED);
+		}
+		else pos=__atomic_load_n(&(coda->enqpos),__ATOMIC_RELAXED);
 	}
-	pthread_mutex_unlock(&(coda->mtx));
+	slot->elem=elem;
+	__atomic_store_n(&(slot->seq),pos+1,__ATOMIC_RELEASE);
 
-	return ret;
+	//Risveglio un consumatore solo se qualcuno si è sospeso
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	wakeOne(coda);
+	return 0;
+}
+
+/**
+ * @brief Estrae un elemento senza bloccarsi
+ *
+ * @param coda coda da gestire
+ * @param elem dove scrivere l'elemento estratto
+ * @return 1 se è stato estratto un elemento, 0 se la coda è vuota
+ * @return -1 se un produttore ha prenotato la cella in testa ma non l'ha ancora pubblicata
+ */
+int tryDeQueue(queue * coda, int * elem){
+	qslot * slot;
+	size_t pos=__atomic_load_n(&(coda->deqpos),__ATOMIC_RELAXED);
+	for(;;){
+		slot=&(coda->slots[pos & coda->mask]);
+		size_t seq=__atomic_load_n(&(slot->seq),__ATOMIC_ACQUIRE);
+		intptr_t dif=(intptr_t)seq-(intptr_t)(pos+1);
+		if(dif==0){
+			if(__atomic_compare_exchange_n(&(coda->deqpos),&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+		}
+		else if(dif<0){
+			//Vuota, a meno che un produttore non stia ancora scrivendo la cella
+			return (__atomic_load_n(&(coda->enqpos),__ATOMIC_RELAXED)!=pos) ? -1 : 0;
+		}
+		else pos=__atomic_load_n(&(coda->deqpos),__ATOMIC_RELAXED);
+	}
+	*elem=slot->elem;
+	//La cella torna libera per il giro successivo
+	__atomic_store_n(&(slot->seq),pos+coda->mask+1,__ATOMIC_RELEASE);
+	return 1;
 }
 
 /**
  * @brief Funzione che estrae un elemento dalla Coda
  *
- * La funzione deQueue, estrae un elemento per conto del chiamante
- * e lo restituisce se ovviamente la coda è non vuota.
- * In caso di coda vuota, si sospende autonomamente sulla variabile di
- * condizionamento cnd1, in attesa di essere risvegliato da qualche produttore.
- * Caso di riguardo è quando estrae il messaggio KILLTHREAD, esso indica che
- * il chiamante di deQueue, deve terminare.
+ * Il consumatore fa attesa attiva solo se, contando anche lui, i
+ * consumatori in attesa attiva sono meno dei processori: altrimenti
+ * toglierebbe il processore proprio ai produttori che aspetta e si
+ * sospende dopo un solo tentativo.
+ * Prima di sospendersi si registra in sleepers e riprova ad estrarre: un
+ * produttore che pubblica un elemento dopo la registrazione lascia un
+ * risveglio in queue::wake, quindi il risveglio non può andare perso. Il
+ * consumatore si sospende anche se la cella in testa è prenotata ma non
+ * ancora pubblicata: il produttore lo risveglierà dopo averla pubblicata.
  *
  * @param coda coda da gestire
 
  * @return elemento in testa alla coda (si sospende se è vuota)
- * @return -1 se c'è qualche errore
+ * @return -1 se la coda è stata chiusa ed è vuota
 */
 int deQueue(queue * coda){
-	int ret=-1; //Valore di ritorno
-
-	pthread_mutex_lock(&(coda->mtx));
-	int DIM=coda->dim;
-	while(isEmpty(coda)){
-		pthread_cond_wait(&(coda->cnd1),&(coda->mtx)); //Sto in attesa che si riempia
-	}
-	if(!isEmpty(coda)){
-		//estraggo l'elemento
-		ret=coda->elem[coda->front];
-		if(ret==KILLTHREAD) {pthread_mutex_unlock(&(coda->mtx)); return ret;} //Protocollo di terminazione thread
-		if(coda->front==coda->rear) coda->front=coda->rear=-1; //se c'è un solo elmento
-		else coda->front=(coda->front+1)%DIM;
+	int elem, got;
+	for(;;){
+		got=tryDeQueue(coda,&elem);
+		//Attesa attiva breve solo se c'è un processore libero, poi mi sospendo
+		if(got!=1 && coda->ncpu>1){
+			if(__atomic_add_fetch(&(coda->spinners),1,__ATOMIC_SEQ_CST)<coda->ncpu){
+				for(int i=1; i<QUEUE_SPIN && got!=1; i++){
+					//Il produttore è stato interrotto a metà: gli cedo il processore
+					if(got<0) sched_yield();
+					got=tryDeQueue(coda,&elem);
+				}
+			}
+			__atomic_sub_fetch(&(coda->spinners),1,__ATOMIC_SEQ_CST);
+		}
+		if(got==1) return elem;
+		__atomic_add_fetch(&(coda->sleepers),1,__ATOMIC_SEQ_CST);
+		got=tryDeQueue(coda,&elem);
+		if(got!=1 && !__atomic_load_n(&(coda->closed),__ATOMIC_SEQ_CST)) waitWake(coda);
+		__atomic_sub_fetch(&(coda->sleepers),1,__ATOMIC_SEQ_CST);
+		if(got==1 || tryDeQueue(coda,&elem)==1){
+			//Passo il risveglio ad un altro consumatore se restano elementi
+			if(!isEmpty(coda)) wakeOne(coda);
+			return elem;
+		}
+		if(isEmpty(coda) && __atomic_load_n(&(coda->closed),__ATOMIC_SEQ_CST)) return -1; //Protocollo di terminazione thread
 	}
-	pthread_mutex_unlock(&(coda->mtx));
+}
 
-	return ret;
+/**
+ * @brief Chiude la coda e risveglia tutti i thread sospesi in deQueue
+ * @param coda coda da chiudere
+ */
+void closeQueue(queue * coda){
+	__atomic_store_n(&(coda->closed),1,__ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&(coda->wake),1,__ATOMIC_SEQ_CST);
+	futexWake(&(coda->wake),INT_MAX);
 }
 
 /**
@@ -133,9 +257,6 @@ int deQueue(queue * coda){
  * @param coda coda da eliminare
 */
 void destroyQueue(queue * coda){
-	pthread_mutex_lock(&(coda->mtx));
-	pthread_mutex_destroy(&(coda->mtx));
-	pthread_cond_destroy(&(coda->cnd1));
-	free(coda->elem);
+	free(coda->slots);
 	free(coda);
 }
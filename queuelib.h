@@ -5,49 +5,86 @@
  * originale dell'autore
  * @brief Implementazione di una coda che viene acceduta in maniera concorrente
  */
-#if !defined(QUEUELIB_H)
+#if !defined(QUEUELIB_H_)
 #define QUEUELIB_H_
-#define KILLTHREAD 99999999
-#include <pthread.h>
+#include <stddef.h>
+
+//Tentativi di estrazione prima che un consumatore si sospenda sulla coda vuota (con un processore libero)
+#define QUEUE_SPIN 128
+//Dimensione di una linea di cache (separa i contatori dei produttori e dei consumatori)
+#define QUEUE_LINE 64
+
+/**
+ * @struct qslot
+ * @brief Posizione della coda
+ *
+ * @var qslot::seq
+ * numero di sequenza: uguale alla posizione se la cella è libera per
+ * l'inserimento, alla posizione+1 se contiene un elemento da estrarre
+ * @var qslot::elem
+ * elemento della coda (fd client accodato)
+ */
+typedef struct qslot_struct{
+	size_t seq;
+	int elem;
+}qslot;
 
 /**
  * @struct queue
  * @brief Struttura che implemente una coda concorrente
  *
- * La coda è strutturata in modo tale da essere usata in maniera concorrente
- * fra più thread, quindi utilizza una variabile di mutua esclusione che ne
- * garantisce la consistenza. Inoltre il comportamento della coda è modellato
- * con la caratteristica di bloccare (sospendere) chi richiede di estrarre
- * un elemento se essa è vuota, quindi utilizza una variabile di condizione
- * utilizzata in modo da far sospende il thread che voglia estrarre un elemento
- * dalla coda vuota, e svegliato dal primo che ne inserisce un elemento.
+ * La coda è un buffer circolare limitato senza lock (multi produttore, multi
+ * consumatore): ogni cella ha un numero di sequenza che indica se è libera
+ * o piena per il "giro" corrente, quindi produttori e consumatori si
+ * contendono soltanto il proprio contatore con una compare-and-swap e
+ * non si bloccano mai a vicenda.
+ * Chi richiede di estrarre un elemento dalla coda vuota si sospende su una
+ * futex (queue::wake) e viene svegliato dal primo che inserisce un elemento;
+ * prima di sospendersi riprova per qualche volta solo se c'è un processore
+ * libero, cioè se i consumatori in attesa attiva sono meno dei processori.
+ * I produttori fanno la chiamata di sistema solo se ci sono consumatori
+ * registrati che non hanno già un risveglio a disposizione.
  *
- * @var queue::front
- * primo elemento da estrarre nella coda
- * @var queue::rear
- * ultimo elemento inserito nella coda
- * @var queue::dim
- * dimensione della coda
- * @var queue::elem
- * elemento della coda (fd client accodato)
- * @var queue::mtx
- * variabile di mutua esclusione per accesso concorrente
- * @var queue::cnd1
- * variabile di condizione per coda vuota
-*/
+ * @var queue::slots
+ * celle della coda (in numero potenza di 2)
+ * @var queue::mask
+ * numero di celle - 1
+ * @var queue::ncpu
+ * numero di processori disponibili
+ * @var queue::enqpos
+ * prossima posizione in cui inserire
+ * @var queue::deqpos
+ * prossima posizione da cui estrarre
+ * @var queue::spinners
+ * numero di consumatori in attesa attiva
+ * @var queue::wake
+ * futex su cui si sospendono i consumatori: numero di risvegli disponibili
+ * (ogni consumatore che si sospende ne consuma uno)
+ * @var queue::sleepers
+ * numero di consumatori sospesi (o in procinto di sospendersi)
+ * @var queue::closed
+ * diverso da 0 se la coda è stata chiusa con closeQueue
+ */
 typedef struct queue_struct{
-	int front;
-	int rear;
-	int dim;
-	int * elem;
-	pthread_mutex_t mtx;
-	pthread_cond_t cnd1;
+	qslot * slots;
+	size_t mask;
+	int ncpu;
+	char pad0[QUEUE_LINE];
+	size_t enqpos;
+	char pad1[QUEUE_LINE];
+	size_t deqpos;
+	char pad2[QUEUE_LINE];
+	int spinners;
+	int wake;
+	int sleepers;
+	int closed;
 }queue;
 
 /**
  * @param coda
  *
  * @return true se la coda è piena, false se la coda è non piena
+ * (il risultato è indicativo se altri thread la stanno modificando)
  */
 int isFull(queue * coda);
 
@@ -55,12 +92,13 @@ int isFull(queue * coda);
  * @param coda
  *
  * @return true se la coda è vuota, false se la coda è non vuota
+ * (il risultato è indicativo se altri thread la stanno modificando)
  */
 int isEmpty(queue * coda);
 
 /**
  * @brief Crea una coda concorrente
- * @param dim dimensione coda
+ * @param dim dimensione coda (arrotondata alla potenza di 2 successiva)
  *
  * @return la coda concorrente
 */
@@ -70,14 +108,13 @@ queue * createQueue(int dim);
  * @brief Funzione che accoda un elemento alla Coda
  *
  * La procedura di enQueue, inserisce un elemento in coda se e solo se essa è non piena
- * e non appena termina l'inserimento, prima di rilasciare la lock, segnala
- * un eventuale thread che si è sospeso in attesa di estrarre.
+ * e, se c'è un thread che si è sospeso in attesa di estrarre, lo risveglia.
  *
  * @param coda coda da gestire
  * @param elem elemento da accodare
 
  * @return 0 se accoda a buon fine
- * @return -1 se c'è un errore
+ * @return -1 se c'è un errore (coda piena o chiusa)
 */
 int enQueue(queue * coda, int elem);
 
@@ -86,18 +123,37 @@ int enQueue(queue * coda, int elem);
  *
  * La funzione deQueue, estrae un elemento per conto del chiamante
  * e lo restituisce se ovviamente la coda è non vuota.
- * In caso di coda vuota, si sospende autonomamente sulla variabile di
- * condizionamento cnd1, in attesa di essere risvegliato da qualche produttore.
- * Caso di riguardo è quando estrae il messaggio KILLTHREAD, esso indica che
- * il chiamante di deQueue, deve terminare.
+ * In caso di coda vuota, si sospende autonomamente sulla futex della coda,
+ * in attesa di essere risvegliato da qualche produttore.
+ * Quando la coda viene chiusa (closeQueue) gli elementi rimasti vengono
+ * comunque estratti, poi deQueue restituisce -1: il chiamante deve terminare.
  *
  * @param coda coda da gestire
 
  * @return elemento in testa alla coda (si sospende se è vuota)
- * @return -1 se c'è qualche errore
+ * @return -1 se la coda è stata chiusa ed è vuota
 */
 int deQueue(queue * coda);
 
+/**
+ * @brief Estrae un elemento senza bloccarsi
+ *
+ * Può essere usata da qualunque thread, anche su una coda su cui altri
+ * thread sono sospesi in deQueue.
+ *
+ * @param coda coda da gestire
+ * @param elem dove scrivere l'elemento estratto
+ * @return 1 se è stato estratto un elemento, 0 se la coda è vuota
+ * @return -1 se un produttore ha prenotato la cella in testa ma non l'ha ancora pubblicata
+ */
+int tryDeQueue(queue * coda, int * elem);
+
+/**
+ * @brief Chiude la coda e risveglia tutti i thread sospesi in deQueue
+ * @param coda coda da chiudere
+ */
+void closeQueue(queue * coda);
+
 /**
  * @brief libera la memoria da tutte le strutture utilizzate dalla coda
  * @param coda coda da eliminare
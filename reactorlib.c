@@ -0,0 +1,208 @@
+/**
+ * Reactorlib implementa il demultiplexing degli eventi di I/O del server
+ * tramite epoll.
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Libreria che implementa il reactor (epoll) del server
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "reactorlib.h"
+
+/**
+ * @brief Funzione interna che esegue la epoll_ctl sul fd
+ */
+static int reactorCtl(int epfd, int op, int fd, unsigned int events){
+	struct epoll_event ev;
+	memset(&ev,0,sizeof(ev));
+	ev.events=events;
+	ev.data.fd=fd;
+	return epoll_ctl(epfd,op,fd,&ev);
+}
+
+/**
+ * @brief Funzione interna che restituisce la maschera di eventi per un client
+ */
+static inline unsigned int clientEvents(reactor * r){
+	unsigned int events=EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	if(r->edge) events|=EPOLLET;
+	return events;
+}
+
+/**
+ * @brief Crea un reactor
+ *
+ * @param edge 1 per la modalità edge-triggered, 0 per quella level-triggered
+ * @param nevents numero massimo di eventi da estrarre ad ogni attesa
+ *
+ * @return il reactor creato
+ */
+reactor * createReactor(int edge, int nevents){
+	if(nevents<1) nevents=1;
+
+	reactor * r=malloc(sizeof(reactor));
+	if(!r){
+		perror("malloc in createReactor (reactor)");
+		exit(EXIT_FAILURE);
+	}
+	r->epfd=epoll_create1(EPOLL_CLOEXEC);
+	if(r->epfd<0){
+		perror("epoll_create1 in createReactor");
+		exit(EXIT_FAILURE);
+	}
+	//Canale di notifica: sempre armato, level-triggered
+	r->wakefd=eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+	if(r->wakefd<0){
+		perror("eventfd in createReactor");
+		exit(EXIT_FAILURE);
+	}
+	if(reactorCtl(r->epfd,EPOLL_CTL_ADD,r->wakefd,EPOLLIN)==-1){
+		perror("epoll_ctl in createReactor (wakefd)");
+		exit(EXIT_FAILURE);
+	}
+	//Attese di scrivibilità
+	r->wepfd=epoll_create1(EPOLL_CLOEXEC);
+	if(r->wepfd<0){
+		perror("epoll_create1 in createReactor (wepfd)");
+		exit(EXIT_FAILURE);
+	}
+	if(reactorCtl(r->epfd,EPOLL_CTL_ADD,r->wepfd,EPOLLIN)==-1){
+		perror("epoll_ctl in createReactor (wepfd)");
+		exit(EXIT_FAILURE);
+	}
+	r->edge=edge;
+	r->nevents=nevents;
+	r->events=malloc(sizeof(struct epoll_event)*nevents);
+	r->wevents=malloc(sizeof(struct epoll_event)*nevents);
+	if(!(r->events) || !(r->wevents)){
+		perror("malloc in createReactor (events)");
+		exit(EXIT_FAILURE);
+	}
+	return r;
+}
+
+/**
+ * @brief Registra il socket di ascolto del server
+ *
+ * @param r reactor
+ * @param fd socket di ascolto
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorListen(reactor * r, int fd){
+	return reactorCtl(r->epfd,EPOLL_CTL_ADD,fd,EPOLLIN | EPOLLONESHOT);
+}
+
+/**
+ * @brief Registra il fd di un client appena accettato
+ *
+ * @param r reactor
+ * @param fd fd del client
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorAdd(reactor * r, int fd){
+	return reactorCtl(r->epfd,EPOLL_CTL_ADD,fd,clientEvents(r));
+}
+
+/**
+ * @brief Riarma un fd precedentemente consegnato da reactorWait
+ *
+ * @param r reactor
+ * @param fd fd da riarmare
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorRearm(reactor * r, int fd){
+	return reactorCtl(r->epfd,EPOLL_CTL_MOD,fd,clientEvents(r));
+}
+
+/**
+ * @brief Riarma il socket di ascolto
+ *
+ * @param r reactor
+ * @param fd socket di ascolto
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorRearmListen(reactor * r, int fd){
+	return reactorCtl(r->epfd,EPOLL_CTL_MOD,fd,EPOLLIN | EPOLLONESHOT);
+}
+
+/**
+ * @brief Risveglia il thread in attesa su reactorWait
+ *
+ * @param r reactor
+ */
+void reactorWakeup(reactor * r){
+	uint64_t one=1;
+	int saved=errno; //Può essere chiamata da un signal handler
+	if(write(r->wakefd,&one,sizeof(one))<0){
+		//EAGAIN: il contatore è saturo, il thread verrà comunque risvegliato
+	}
+	errno=saved;
+}
+
+/**
+ * @brief Consuma le notifiche pendenti sul canale di risveglio
+ *
+ * @param r reactor
+ */
+void reactorDrainWakeup(reactor * r){
+	uint64_t cnt;
+	while(read(r->wakefd,&cnt,sizeof(cnt))>0);
+}
+
+/**
+ * @brief Attende (una sola volta) che il fd di un client diventi scrivibile
+ *
+ * @param r reactor
+ * @param fd fd del client
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorWatchWrite(reactor * r, int fd){
+	unsigned int events=EPOLLOUT | EPOLLONESHOT;
+	if(reactorCtl(r->wepfd,EPOLL_CTL_MOD,fd,events)==0) return 0;
+	if(errno!=ENOENT) return -1;
+	return reactorCtl(r->wepfd,EPOLL_CTL_ADD,fd,events);
+}
+
+/**
+ * @brief Estrae, senza bloccarsi, i fd diventati scrivibili
+ *
+ * @param r reactor
+ * @return numero di fd pronti in r->wevents
+ * @return -1 in caso di errore (errno settato)
+ */
+int reactorWritable(reactor * r){
+	return epoll_wait(r->wepfd,r->wevents,r->nevents,0);
+}
+
+/**
+ * @brief Attende che uno o più fd siano pronti
+ *
+ * @param r reactor
+ * @param timeout tempo massimo di attesa in millisecondi (-1 attesa infinita)
+ * @return numero di eventi pronti in r->events
+ * @return -1 in caso di errore (errno settato, EINTR se interrotta da un segnale)
+ */
+int reactorWait(reactor * r, int timeout){
+	return epoll_wait(r->epfd,r->events,r->nevents,timeout);
+}
+
+/**
+ * @brief Libera le risorse del reactor
+ * @param r reactor da eliminare
+ */
+void destroyReactor(reactor * r){
+	close(r->epfd);
+	close(r->wakefd);
+	close(r->wepfd);
+	free(r->events);
+	free(r->wevents);
+	free(r);
+}
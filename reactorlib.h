@@ -0,0 +1,171 @@
+/**
+ * Reactorlib implementa il demultiplexing degli eventi di I/O del server
+ * tramite epoll. Ogni fd dei client viene registrato con EPOLLONESHOT:
+ * non appena diventa leggibile viene consegnato ad un solo Worker e resta
+ * disarmato finchè il Worker non lo riarma, in questo modo il costo di
+ * ogni risveglio dipende soltanto dalle connessioni attive e non dal
+ * valore del fd più alto (come accadeva con la select).
+ * Il reactor contiene inoltre un canale di notifica (eventfd) con cui gli
+ * altri thread, o un signal handler, possono risvegliare subito il thread
+ * in attesa senza che questo debba usare un timeout di polling.
+ * Le attese di scrivibilità (code in uscita non svuotate) sono registrate
+ * su una seconda istanza epoll, annidata nella prima: in questo modo lo
+ * stesso fd può essere atteso in lettura ed in scrittura in modo
+ * indipendente.
+ *
+ * @file reactorlib.h
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Libreria che implementa il reactor (epoll) del server
+ */
+#if !defined(REACTORLIB_H_)
+#define REACTORLIB_H_
+
+#include <sys/epoll.h>
+
+/**
+ * @struct reactor
+ * @brief struttura che incapsula un'istanza epoll
+ *
+ * @var reactor::epfd
+ * file descriptor dell'istanza epoll
+ * @var reactor::wakefd
+ * eventfd usato come canale di notifica verso il thread in attesa
+ * @var reactor::wepfd
+ * istanza epoll delle attese di scrivibilità (registrata in epfd)
+ * @var reactor::edge
+ * se diverso da 0 i fd dei client vengono registrati in modalità edge-triggered
+ * @var reactor::nevents
+ * numero massimo di eventi restituiti da una singola reactorWait
+ * @var reactor::events
+ * vettore degli eventi pronti (riempito da reactorWait)
+ * @var reactor::wevents
+ * vettore dei fd scrivibili (riempito da reactorWritable)
+ */
+typedef struct reactor_struct{
+	int epfd;
+	int wakefd;
+	int wepfd;
+	int edge;
+	int nevents;
+	struct epoll_event * events;
+	struct epoll_event * wevents;
+}reactor;
+
+/**
+ * @brief Crea un reactor
+ *
+ * @param edge 1 per la modalità edge-triggered, 0 per quella level-triggered
+ * @param nevents numero massimo di eventi da estrarre ad ogni attesa
+ *
+ * @return il reactor creato
+ */
+reactor * createReactor(int edge, int nevents);
+
+/**
+ * @brief Registra il socket di ascolto del server
+ *
+ * Il socket di ascolto viene sempre registrato level-triggered e con
+ * EPOLLONESHOT, così il main può sospendere le accept (non riarmandolo)
+ * quando viene raggiunto il numero massimo di connessioni.
+ *
+ * @param r reactor
+ * @param fd socket di ascolto
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorListen(reactor * r, int fd);
+
+/**
+ * @brief Registra il fd di un client appena accettato
+ *
+ * @param r reactor
+ * @param fd fd del client
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorAdd(reactor * r, int fd);
+
+/**
+ * @brief Riarma un fd precedentemente consegnato da reactorWait
+ *
+ * Può essere chiamata da qualunque thread (epoll_ctl è thread-safe).
+ * Riarmando il fd il kernel ne ricontrolla lo stato, quindi eventuali dati
+ * già arrivati nel frattempo generano subito un nuovo evento anche in
+ * modalità edge-triggered.
+ *
+ * @param r reactor
+ * @param fd fd da riarmare
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorRearm(reactor * r, int fd);
+
+/**
+ * @brief Riarma il socket di ascolto
+ *
+ * @param r reactor
+ * @param fd socket di ascolto
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorRearmListen(reactor * r, int fd);
+
+/**
+ * @brief Risveglia il thread in attesa su reactorWait
+ *
+ * Esegue soltanto una write sull'eventfd, quindi è async-signal-safe e
+ * può essere chiamata anche da un signal handler. Il thread risvegliato
+ * riceve un evento con data.fd uguale a r->wakefd.
+ *
+ * @param r reactor
+ */
+void reactorWakeup(reactor * r);
+
+/**
+ * @brief Consuma le notifiche pendenti sul canale di risveglio
+ *
+ * Va chiamata dal thread in attesa quando riceve l'evento relativo a r->wakefd.
+ *
+ * @param r reactor
+ */
+void reactorDrainWakeup(reactor * r);
+
+/**
+ * @brief Attende (una sola volta) che il fd di un client diventi scrivibile
+ *
+ * Quando il fd diventa scrivibile il thread in attesa su reactorWait riceve un
+ * evento con data.fd uguale a r->wepfd, e deve chiamare reactorWritable per
+ * sapere quali fd sono pronti.
+ *
+ * @param r reactor
+ * @param fd fd del client
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato)
+ */
+int reactorWatchWrite(reactor * r, int fd);
+
+/**
+ * @brief Estrae, senza bloccarsi, i fd diventati scrivibili
+ *
+ * @param r reactor
+ * @return numero di fd pronti in r->wevents
+ * @return -1 in caso di errore (errno settato)
+ */
+int reactorWritable(reactor * r);
+
+/**
+ * @brief Attende che uno o più fd siano pronti
+ *
+ * @param r reactor
+ * @param timeout tempo massimo di attesa in millisecondi (-1 attesa infinita)
+ * @return numero di eventi pronti in r->events
+ * @return -1 in caso di errore (errno settato, EINTR se interrotta da un segnale)
+ */
+int reactorWait(reactor * r, int timeout);
+
+/**
+ * @brief Libera le risorse del reactor
+ * @param r reactor da eliminare
+ */
+void destroyReactor(reactor * r);
+
+#endif
@@ -30,6 +30,7 @@ struct statistics {
     unsigned long nfiledelivered;               /**< n. di file consegnati */
     unsigned long nfilenotdelivered;            /**< n. di file non ancora consegnati */
     unsigned long nerrors;                      /**< n. di messaggi di errore */
+    unsigned long nworkers;                     /**< n. di worker attivi nel pool */
 };
 
 /* aggiungere qui altre funzioni di utilita' per le statistiche */
@@ -44,7 +45,7 @@ struct statistics {
 static inline int printStats(FILE *fout) {
     extern struct statistics chattyStats;
 
-    if (fprintf(fout, "%ld - %ld %ld %ld %ld %ld %ld %ld\n",
+    if (fprintf(fout, "%ld - %ld %ld %ld %ld %ld %ld %ld %ld\n",
 		(unsigned long)time(NULL),
 		chattyStats.nusers,
 		chattyStats.nonline,
@@ -52,7 +53,8 @@ static inline int printStats(FILE *fout) {
 		chattyStats.nnotdelivered,
 		chattyStats.nfiledelivered,
 		chattyStats.nfilenotdelivered,
-		chattyStats.nerrors
+		chattyStats.nerrors,
+		chattyStats.nworkers
 		) < 0) return -1;
     fflush(fout);
     return 0;
@@ -14,10 +14,17 @@ fi
 ./client -l $1 -k paperino -R -1 &
 pid=$!
 
+# unica modifica al test originale: al posto del binario del client (che con
+# le informazioni di debug supera MaxFileSize, 50KB in chatty.conf2) si spedisce
+# un file di dimensione nota, rimosso su ogni percorso di uscita
+fixture=$(mktemp /tmp/chatty_fixture.XXXXXX) || exit 1
+trap 'rm -f $fixture' EXIT
+head -c $((40*1024)) /dev/urandom > $fixture
+
 for((i=0;i<50;++i)); do 
     ./client -l $1 -k pippo -S "ciao":pluto; 
     ./client -l $1 -k pluto -S "ciao":pippo;  
-    ./client -l $1 -k minni -s client:pluto -s client:pippo; 
+    ./client -l $1 -k minni -s $fixture:pluto -s $fixture:pippo; 
 done
 
 # messaggio di errore che mi aspetto
@@ -9,42 +9,202 @@
  *
  * @brief Libreria che implementa un pool di thread.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "threadlib.h"
 
+/**
+ * @brief funzione interna che sospende il chiamante finchè *addr vale val
+ */
+static inline void futexWait(int * addr, int val){
+	syscall(SYS_futex,addr,FUTEX_WAIT_PRIVATE,val,NULL,NULL,0);
+}
+
+/**
+ * @brief funzione interna che sospende il chiamante finchè *addr vale val, al più per ms millisecondi
+ * @return 0 se è stato risvegliato, -1 se è scaduto il tempo (o in caso di errore)
+ */
+static inline int futexWaitFor(int * addr, int val, long ms){
+	struct timespec ts;
+	ts.tv_sec=ms/1000;
+	ts.tv_nsec=(ms%1000)*1000000L;
+	return (syscall(SYS_futex,addr,FUTEX_WAIT_PRIVATE,val,&ts,NULL,0)==-1 && errno==ETIMEDOUT) ? -1 : 0;
+}
+
+/**
+ * @brief funzione interna che restituisce l'istante corrente in ns (CLOCK_MONOTONIC)
+ */
+static long long nowNs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+/**
+ * @brief funzione interna che risveglia fino a n thread sospesi su addr
+ */
+static inline void futexWake(int * addr, int n){
+	syscall(SYS_futex,addr,FUTEX_WAKE_PRIVATE,n,NULL,NULL,0);
+}
+
+/**
+ * @brief funzione interna che risveglia un worker sospeso, se ce n'è uno
+ *
+ * Come in queuelib pool::wake conta i risvegli disponibili: la chiamata di
+ * sistema si fa solo se sono meno dei worker registrati, quindi un worker
+ * risvegliato e non ancora in esecuzione non ne causa altre.
+ */
+static void wakeOne(pool * pool){
+	int s=__atomic_load_n(&(pool->sleepers),__ATOMIC_SEQ_CST);
+	if(s==0) return;
+	int w=__atomic_load_n(&(pool->wake),__ATOMIC_SEQ_CST);
+	while(w<s){
+		if(__atomic_compare_exchange_n(&(pool->wake),&w,w+1,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST)){
+			futexWake(&(pool->wake),1);
+			return;
+		}
+		s=__atomic_load_n(&(pool->sleepers),__ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * @brief funzione interna che sospende un worker registrato finchè non c'è
+ * un risveglio da consumare o il pool viene chiuso
+ *
+ * @param ms attesa massima in millisecondi (negativa per attendere senza limite);
+ * ricomincia se il worker viene risvegliato senza trovare un risveglio disponibile
+ * @return 0 se il worker è stato risvegliato, -1 se è scaduto il tempo
+ */
+static int waitWake(pool * pool, long ms){
+	for(;;){
+		int w=__atomic_load_n(&(pool->wake),__ATOMIC_SEQ_CST);
+		if(w>0){
+			if(__atomic_compare_exchange_n(&(pool->wake),&w,w-1,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST)) return 0;
+			continue;
+		}
+		if(__atomic_load_n(&(pool->closed),__ATOMIC_SEQ_CST)) return 0;
+		if(ms<0) futexWait(&(pool->wake),0);
+		else if(futexWaitFor(&(pool->wake),0,ms)==-1) return -1;
+	}
+}
+
+/**
+ * @brief funzione interna che estrae un lavoro dalla coda locale o da quelle degli altri
+ *
+ * Le code degli altri worker vengono visitate a partire da quella successiva
+ * a self, così i furti si distribuiscono fra tutti i worker.
+ *
+ * @return 1 se è stato estratto un lavoro, 0 se tutte le code sono vuote
+ * @return -1 se un lavoro sta per essere pubblicato in una delle code
+ */
+static int takeAny(pool * pool, int self, int * elem){
+	int busy=0;
+	for(int i=0; i<pool->size; i++){
+		int ret=tryDeQueue(pool->local[(self+i)%pool->size],elem);
+		if(ret==1) return 1;
+		if(ret<0) busy=1;
+	}
+	return busy ? -1 : 0;
+}
+
+/**
+ * @brief funzione interna che verifica se tutte le code locali sono vuote
+ */
+static int poolEmpty(pool * pool){
+	for(int i=0; i<pool->size; i++){
+		if(!isEmpty(pool->local[i])) return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief funzione interna che avvia un thread nel posto i (mtx acquisita)
+ * @return 0 in caso di successo, -1 in caso di errore
+ */
+static int startThread(pool * pool, long i){
+	//Raccolgo il thread che occupava il posto, se è terminato per inattività
+	if(pool->state[i]==POOL_ZOMBIE) pthread_join(pool->thread[i],NULL);
+	pool->state[i]=POOL_FREE;
+	if(pthread_create(&(pool->thread[i]),NULL,pool->routine,(void *)i)!=0) return -1;
+	pool->state[i]=POOL_RUNNING;
+	__atomic_add_fetch(&(pool->active),1,__ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/**
+ * @brief funzione interna che ritira il worker self se il pool può ridursi
+ * @return 1 se il worker è stato ritirato e deve terminare, 0 altrimenti
+ */
+static int retire(pool * pool, int self){
+	int from=-1;
+	pthread_mutex_lock(&(pool->mtx));
+	if(!__atomic_load_n(&(pool->closed),__ATOMIC_SEQ_CST) && pool->active>pool->policy.min){
+		from=pool->active;
+		pool->state[self]=POOL_ZOMBIE;
+		__atomic_sub_fetch(&(pool->active),1,__ATOMIC_SEQ_CST);
+		if(pool->policy.report) pool->policy.report(from,from-1,0);
+	}
+	pthread_mutex_unlock(&(pool->mtx));
+	return (from>=0);
+}
+
 /**
  * @brief crea un pool di numt threads
  *
  * @param numt numero di thread worker che si vogliono creare
+ * @param qdim dimensione della coda locale di ogni worker
+ * @param policy parametri del dimensionamento adattivo (NULL per un pool fisso)
  * @return pool ritorna un pool di numt threads
  */
-pool * createPool(int numt){
+pool * createPool(int numt, int qdim, pool_policy * policy){
 	//Controllo i vincoli del pool e in caso esco
-	if(numt<0){
+	if(numt<1 || (policy && (policy->min<1 || policy->max<policy->min))){
 		fprintf(stderr,"errore createPool: deve essereci almeno 1 thread");
 		exit(EXIT_FAILURE);
 	}
-
 	//Alloco il pool
 	pool * pool=malloc(sizeof(struct pool_struct));
 	if(!pool){
 		perror("Errore malloc pool in createPool");
 		exit(EXIT_FAILURE);
 	}
-
-	//Alloco i thread del pool
-	pool->size=numt;
-	pool->thread=malloc(sizeof(pthread_t)*numt);
-	if((pool->thread)==NULL){
+	//Senza politica il pool resta fisso a numt thread
+	if(policy) pool->policy=*policy;
+	else{
+		memset(&(pool->policy),0,sizeof(pool_policy));
+		pool->policy.min=pool->policy.max=numt;
+	}
+	if(numt<pool->policy.min) numt=pool->policy.min;
+	if(numt>pool->policy.max) numt=pool->policy.max;
+	pool->active=numt; //Thread che avvierà initPool
+	//Alloco i posti per il numero massimo di thread
+	pool->size=pool->policy.max;
+	pool->thread=malloc(sizeof(pthread_t)*pool->size);
+	pool->state=calloc(pool->size,sizeof(int));
+	if((pool->thread)==NULL || (pool->state)==NULL){
 		perror("Errore malloc pthread_t in createPool");
 		exit(EXIT_FAILURE);
 	}
-
+	//Alloco le code locali dei worker
+	pool->local=malloc(sizeof(queue *)*pool->size);
+	if((pool->local)==NULL){
+		perror("Errore malloc code locali in createPool");
+		exit(EXIT_FAILURE);
+	}
+	for(int i=0; i<pool->size; i++) pool->local[i]=createQueue(qdim);
+	pool->routine=NULL;
+	pool->lastgrow=0;
+	pthread_mutex_init(&(pool->mtx),NULL);
+	pool->wake=pool->sleepers=pool->closed=0;
 	return pool;
 }
 
@@ -55,9 +215,133 @@ pool * createPool(int numt){
  * @param start_routine il task da voler passare ai threads
  */
 void initPool(pool * pool, void *(*start_routine) (void *)){
+	int numt=pool->active;
+	pool->routine=start_routine;
+	pool->active=0;
+	pthread_mutex_lock(&(pool->mtx));
+	for(long i=0; i<numt; i++){
+		if(startThread(pool,i)==-1){
+			perror("pthread_create in initPool");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_mutex_unlock(&(pool->mtx));
+}
+
+/**
+ * @brief Accoda un lavoro nella coda locale di un worker
+ *
+ * @param pool pool di thread
+ * @param worker indice del worker proprietario del lavoro
+ * @param elem lavoro da accodare
+ * @return 0 in caso di successo, -1 se la coda è piena o il pool è chiuso
+ */
+int poolSubmit(pool * pool, int worker, int elem){
+	if(__atomic_load_n(&(pool->closed),__ATOMIC_ACQUIRE)) return -1;
+	if(enQueue(pool->local[worker],elem)<0) return -1;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	wakeOne(pool);
+	return 0;
+}
+
+/**
+ * @brief Estrae il prossimo lavoro per un worker
+ *
+ * La sospensione segue lo stesso protocollo di deQueue (queuelib.c), ma su
+ * una futex comune a tutto il pool: un lavoro accodato a qualunque worker
+ * può risvegliare chiunque.
+ *
+ * Un worker di un pool adattivo si sospende al più per policy.idle ms: se
+ * scade il tempo senza che sia arrivato alcun lavoro prova a ritirarsi.
+ * Il controllo finale delle code avviene dopo il risveglio (o la scadenza),
+ * quindi un lavoro accodato mentre il worker si ritira non va perso: lo
+ * trova questo worker o, se era già vuoto, uno di quelli rimasti attivi.
+ *
+ * @param pool pool di thread
+ * @param self indice del worker chiamante
+ * @return il lavoro estratto (si sospende se non ce ne sono)
+ * @return -1 se il pool è stato chiuso e non ci sono altri lavori o se il worker è stato ritirato
+ */
+int poolTake(pool * pool, int self){
+	int elem, got;
+	int adaptive=(pool->policy.min<pool->policy.max && pool->policy.idle>0);
+	for(;;){
+		int expired=0;
+		if(takeAny(pool,self,&elem)==1) return elem;
+		__atomic_add_fetch(&(pool->sleepers),1,__ATOMIC_SEQ_CST);
+		got=takeAny(pool,self,&elem);
+		if(got!=1 && !__atomic_load_n(&(pool->closed),__ATOMIC_SEQ_CST)){
+			expired=(waitWake(pool,adaptive ? pool->policy.idle : -1)==-1);
+		}
+		__atomic_sub_fetch(&(pool->sleepers),1,__ATOMIC_SEQ_CST);
+		if(got==1 || takeAny(pool,self,&elem)==1){
+			//Passo il risveglio ad un altro worker se restano lavori
+			if(!poolEmpty(pool)) wakeOne(pool);
+			return elem;
+		}
+		if(poolEmpty(pool) && __atomic_load_n(&(pool->closed),__ATOMIC_SEQ_CST)) return -1;
+		//Inattivo per un intero periodo: il pool si riduce se è sopra il minimo
+		if(expired && retire(pool,self)) return -1;
+	}
+}
+
+/**
+ * @brief Comunica al pool quanto ha atteso in coda l'ultimo lavoro estratto
+ *
+ * @param pool pool di thread
+ * @param wait attesa in coda in ns
+ */
+void poolObserve(pool * pool, long wait){
+	if(wait<=pool->policy.growwait || pool->policy.growwait<=0) return;
+	if(__atomic_load_n(&(pool->active),__ATOMIC_RELAXED)>=pool->policy.max) return;
+	long long now=nowNs();
+	if(now-__atomic_load_n(&(pool->lastgrow),__ATOMIC_RELAXED)<pool->policy.growwait) return;
+
+	pthread_mutex_lock(&(pool->mtx));
+	if(!__atomic_load_n(&(pool->closed),__ATOMIC_SEQ_CST) && pool->active<pool->size
+		&& now-pool->lastgrow>=pool->policy.growwait){
+		int from=pool->active;
+		for(long i=0; i<pool->size; i++){
+			if(pool->state[i]==POOL_RUNNING) continue;
+			if(startThread(pool,i)==0){
+				pool->lastgrow=now;
+				if(pool->policy.report) pool->policy.report(from,from+1,wait);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(pool->mtx));
+}
+
+/**
+ * @brief Chiude il pool e risveglia tutti i worker sospesi in poolTake
+ *
+ * @param pool pool di thread
+ */
+void closePool(pool * pool){
+	//Sotto mtx: dopo la chiusura nessun thread viene più avviato o ritirato
+	pthread_mutex_lock(&(pool->mtx));
+	__atomic_store_n(&(pool->closed),1,__ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&(pool->mtx));
+	__atomic_add_fetch(&(pool->wake),1,__ATOMIC_SEQ_CST);
+	futexWake(&(pool->wake),INT_MAX);
+}
+
+/**
+ * @brief Attende la terminazione di tutti i thread del pool (dopo closePool)
+ *
+ * @param pool pool di thread
+ * @return numero di thread raccolti
+ */
+int joinPool(pool * pool){
+	int n=0;
 	for(int i=0; i<pool->size; i++){
-		pthread_create(&(pool->thread[i]),NULL,start_routine,NULL);
+		if(pool->state[i]==POOL_FREE) continue;
+		pthread_join(pool->thread[i],NULL);
+		pool->state[i]=POOL_FREE;
+		n++;
 	}
+	return n;
 }
 
 /**
@@ -66,6 +350,10 @@ void initPool(pool * pool, void *(*start_routine) (void *)){
  * @param pool il pool di thread da deallocare
 */
 void destroyPool(pool * pool){
+	for(int i=0; i<pool->size; i++) destroyQueue(pool->local[i]);
+	free(pool->local);
 	free(pool->thread);
+	free(pool->state);
+	pthread_mutex_destroy(&(pool->mtx));
 	free(pool);
 }
@@ -3,6 +3,18 @@
  * Nella libreria inoltre vengono implementate delle funzioni per istanziare
  * ed avviare i thread con dei task e una funzione per eseguire una cleanup.
  *
+ * I lavori (fd dei client da servire) non passano per un'unica coda globale:
+ * ogni worker ha la propria coda locale, il Master accoda ogni lavoro nella
+ * coda del worker che ne è proprietario e un worker senza lavoro lo "ruba"
+ * dalle code degli altri prima di sospendersi.
+ *
+ * Il pool può essere adattivo (pool_policy): il numero di worker attivi
+ * varia fra un minimo ed un massimo, cresce quando i lavori restano in coda
+ * troppo a lungo e cala quando un worker resta senza lavoro per un intero
+ * periodo di inattività. Le code locali vengono create per il numero massimo
+ * di worker, quindi i lavori accodati ad un worker non attivo vengono
+ * comunque rubati dagli altri.
+ *
  * @file threadlib.h
  *
  * @author Stefano Spadola 534919
@@ -11,40 +23,165 @@
  *
  * @brief Libreria che implementa un pool di thread.
  */
-#if !defined(THREADLIB_H)
+#if !defined(THREADLIB_H_)
 #define THREADLIB_H_
-
 #include <pthread.h>
+#include "queuelib.h"
+
+//Stati di un posto (thread) del pool
+#define POOL_FREE 0    //Thread mai creato o già raccolto con pthread_join
+#define POOL_RUNNING 1 //Thread in esecuzione
+#define POOL_ZOMBIE 2  //Thread terminato perchè inattivo, da raccogliere
+
+/**
+ * @struct pool_policy
+ * @brief parametri del dimensionamento adattivo di un pool
+ *
+ * @var pool_policy::min
+ * numero minimo di worker attivi
+ * @var pool_policy::max
+ * numero massimo di worker attivi
+ * @var pool_policy::growwait
+ * attesa in coda (ns) oltre la quale viene avviato un nuovo worker
+ * @var pool_policy::idle
+ * inattività (ms) dopo la quale un worker termina
+ * @var pool_policy::report
+ * funzione chiamata ad ogni ridimensionamento con la dimensione precedente,
+ * quella nuova e l'attesa in coda che lo ha causato (0 per le riduzioni);
+ * può essere NULL
+ */
+typedef struct pool_policy_struct{
+	int min;
+	int max;
+	long growwait;
+	long idle;
+	void (*report)(int from, int to, long wait);
+}pool_policy;
 
 /**
  * @struct pool
  * @brief struttura che implementa un pool di thread
  * @var pool::size
- * numero di thread da voler creare nel pool
+ * numero massimo di thread del pool (posti in thread, local e state)
+ * @var pool::active
+ * numero di thread attivi
  * @var pool::thread
  * thread del pool
+ * @var pool::state
+ * stato di ogni posto (POOL_FREE, POOL_RUNNING, POOL_ZOMBIE)
+ * @var pool::local
+ * code locali dei worker (una per thread)
+ * @var pool::routine
+ * task eseguito dai thread (passato ad initPool)
+ * @var pool::policy
+ * parametri del dimensionamento adattivo (min==max se il pool è fisso)
+ * @var pool::lastgrow
+ * istante (ns, CLOCK_MONOTONIC) dell'ultimo ampliamento
+ * @var pool::mtx
+ * mutex che serializza i ridimensionamenti
+ * @var pool::wake
+ * futex su cui si sospendono i worker senza lavoro: numero di risvegli
+ * disponibili (ogni worker che si sospende ne consuma uno)
+ * @var pool::sleepers
+ * numero di worker sospesi (o in procinto di sospendersi)
+ * @var pool::closed
+ * diverso da 0 se il pool è stato chiuso con closePool
  */
 typedef struct pool_struct{
 	int size;
+	int active;
 	pthread_t * thread;
+	int * state;
+	queue ** local;
+	void *(*routine) (void *);
+	pool_policy policy;
+	long long lastgrow;
+	pthread_mutex_t mtx;
+	int wake;
+	int sleepers;
+	int closed;
 }pool;
 
 /**
  * @brief crea un pool di numt threads
  *
  * @param numt numero di thread worker che si vogliono creare
+ * @param qdim dimensione della coda locale di ogni worker
+ * @param policy parametri del dimensionamento adattivo (NULL per un pool fisso);
+ * numt viene ricondotto fra policy->min e policy->max
  * @return pool ritorna un pool di numt threads
  */
-pool * createPool(int numt);
+pool * createPool(int numt, int qdim, pool_policy * policy);
 
 /**
  * @brief Inizializza un pool di thread con un task (routine)
  *
+ * Ogni thread riceve come argomento il proprio indice nel pool (castato a
+ * void *), da usare con poolTake. Gli indici dei thread attivi non sono
+ * necessariamente contigui.
+ *
  * @param pool il pool di thread da voler inizializzare
  * @param start_routine il task da voler passare ai threads
  */
 void initPool(pool * pool, void *(*start_routine) (void *));
 
+/**
+ * @brief Accoda un lavoro nella coda locale di un worker
+ *
+ * Se ci sono worker sospesi ne risveglia uno: se il proprietario è occupato
+ * sarà questo a rubare il lavoro.
+ *
+ * @param pool pool di thread
+ * @param worker indice del worker proprietario del lavoro
+ * @param elem lavoro da accodare
+ * @return 0 in caso di successo, -1 se la coda è piena o il pool è chiuso
+ */
+int poolSubmit(pool * pool, int worker, int elem);
+
+/**
+ * @brief Estrae il prossimo lavoro per un worker
+ *
+ * Il worker estrae dalla propria coda locale, se è vuota prova a rubare un
+ * lavoro dalle code degli altri worker, se sono tutte vuote si sospende.
+ *
+ * In un pool adattivo, se il worker resta sospeso per policy.idle ms e i
+ * worker attivi sono più di policy.min, il worker viene ritirato.
+ *
+ * @param pool pool di thread
+ * @param self indice del worker chiamante
+ * @return il lavoro estratto (si sospende se non ce ne sono)
+ * @return -1 se il pool è stato chiuso e non ci sono altri lavori, o se il
+ * worker è stato ritirato: in entrambi i casi il thread deve terminare
+ */
+int poolTake(pool * pool, int self);
+
+/**
+ * @brief Comunica al pool quanto ha atteso in coda l'ultimo lavoro estratto
+ *
+ * In un pool adattivo, se l'attesa supera policy.growwait e i worker attivi
+ * sono meno di policy.max, viene avviato un nuovo worker (al più uno ogni
+ * policy.growwait ns, così un picco non porta subito il pool al massimo).
+ *
+ * @param pool pool di thread
+ * @param wait attesa in coda in ns
+ */
+void poolObserve(pool * pool, long wait);
+
+/**
+ * @brief Chiude il pool e risveglia tutti i worker sospesi in poolTake
+ *
+ * @param pool pool di thread
+ */
+void closePool(pool * pool);
+
+/**
+ * @brief Attende la terminazione di tutti i thread del pool (dopo closePool)
+ *
+ * @param pool pool di thread
+ * @return numero di thread raccolti
+ */
+int joinPool(pool * pool);
+
 /**
  * @brief Ripulisce le strutture utilizzate dal pool e il pool stesso
  *
@@ -0,0 +1,193 @@
+/**
+ * Uringlib implementa un'interfaccia minima ad io_uring tramite le
+ * chiamate di sistema io_uring_setup e io_uring_enter.
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Libreria che implementa una coda io_uring
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uringlib.h"
+
+/**
+ * @brief Funzione interna che invia to_submit operazioni ed attende min_complete completamenti
+ */
+static inline int uringEnter(int fd, unsigned to_submit, unsigned min_complete){
+	return syscall(__NR_io_uring_enter,fd,to_submit,min_complete,IORING_ENTER_GETEVENTS,NULL,0);
+}
+
+/**
+ * @brief Funzione interna che prende la prossima sqe libera
+ * @return la sqe azzerata, NULL se la coda di sottomissione è piena
+ */
+static struct io_uring_sqe * getSqe(uring * r){
+	unsigned tail=*(r->sqtail);
+	unsigned head=__atomic_load_n(r->sqhead,__ATOMIC_ACQUIRE);
+	if(tail-head>=r->entries) return NULL;
+	struct io_uring_sqe * sqe=&(r->sqes[tail & *(r->sqmask)]);
+	memset(sqe,0,sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/**
+ * @brief Funzione interna che pubblica la sqe presa con getSqe
+ */
+static void pushSqe(uring * r){
+	unsigned tail=*(r->sqtail);
+	unsigned idx=tail & *(r->sqmask);
+	r->sqarray[idx]=idx;
+	__atomic_store_n(r->sqtail,tail+1,__ATOMIC_RELEASE);
+	r->prepared++;
+}
+
+/**
+ * @brief Crea un'istanza io_uring
+ *
+ * @param entries numero di operazioni che possono essere preparate insieme
+ * @return l'istanza, NULL se io_uring non è disponibile (errno settato)
+ */
+uring * createUring(unsigned entries){
+	struct io_uring_params p;
+	memset(&p,0,sizeof(p));
+	int fd=syscall(__NR_io_uring_setup,entries,&p);
+	if(fd<0) return NULL;
+
+	uring * r=malloc(sizeof(uring));
+	if(!r){
+		perror("malloc in createUring");
+		exit(EXIT_FAILURE);
+	}
+	memset(r,0,sizeof(uring));
+	r->fd=fd;
+	r->entries=p.sq_entries;
+	r->sqsize=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	r->cqsize=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	//Con IORING_FEAT_SINGLE_MMAP le due code stanno nella stessa mappatura
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(r->cqsize>r->sqsize) r->sqsize=r->cqsize;
+		r->cqsize=r->sqsize;
+	}
+	r->sqring=mmap(NULL,r->sqsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	if(r->sqring==MAP_FAILED) goto fail;
+	if(p.features & IORING_FEAT_SINGLE_MMAP) r->cqring=r->sqring;
+	else{
+		r->cqring=mmap(NULL,r->cqsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+		if(r->cqring==MAP_FAILED){
+			r->cqring=NULL;
+			goto fail;
+		}
+	}
+	r->sqesize=p.sq_entries*sizeof(struct io_uring_sqe);
+	r->sqes=mmap(NULL,r->sqesize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQES);
+	if(r->sqes==MAP_FAILED){
+		r->sqes=NULL;
+		goto fail;
+	}
+
+	char * sq=r->sqring;
+	r->sqhead=(unsigned *)(sq+p.sq_off.head);
+	r->sqtail=(unsigned *)(sq+p.sq_off.tail);
+	r->sqmask=(unsigned *)(sq+p.sq_off.ring_mask);
+	r->sqarray=(unsigned *)(sq+p.sq_off.array);
+	char * cq=r->cqring;
+	r->cqhead=(unsigned *)(cq+p.cq_off.head);
+	r->cqtail=(unsigned *)(cq+p.cq_off.tail);
+	r->cqmask=(unsigned *)(cq+p.cq_off.ring_mask);
+	r->cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+	return r;
+
+fail:
+	{
+		int err=errno;
+		destroyUring(r);
+		errno=err;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Prepara la lettura di un socket (IORING_OP_RECV)
+ * @return 0 in caso di successo, -1 se la coda di sottomissione è piena
+ */
+int uringPrepRecv(uring * r, int fd, void * buf, size_t len, unsigned long long tag){
+	struct io_uring_sqe * sqe=getSqe(r);
+	if(!sqe) return -1;
+	sqe->opcode=IORING_OP_RECV;
+	sqe->fd=fd;
+	sqe->addr=(unsigned long)buf;
+	sqe->len=len;
+	sqe->user_data=tag;
+	pushSqe(r);
+	return 0;
+}
+
+/**
+ * @brief Prepara una scrittura vettoriale (IORING_OP_WRITEV)
+ * @return 0 in caso di successo, -1 se la coda di sottomissione è piena
+ */
+int uringPrepWritev(uring * r, int fd, const struct iovec * iov, int iovcnt, unsigned long long tag){
+	struct io_uring_sqe * sqe=getSqe(r);
+	if(!sqe) return -1;
+	sqe->opcode=IORING_OP_WRITEV;
+	sqe->fd=fd;
+	sqe->addr=(unsigned long)iov;
+	sqe->len=iovcnt;
+	sqe->user_data=tag;
+	pushSqe(r);
+	return 0;
+}
+
+/**
+ * @brief Invia al kernel tutte le operazioni preparate e ne attende il completamento
+ *
+ * Quante operazioni restano da inviare e quanti completamenti mancano viene
+ * ricalcolato dalle code ad ogni tentativo, così una chiamata interrotta da un
+ * segnale riprende senza inviare due volte la stessa operazione.
+ *
+ * @return numero di operazioni completate da estrarre con uringReap, -1 in caso di errore
+ */
+int uringRun(uring * r){
+	unsigned want=r->prepared;
+	r->prepared=0;
+	for(;;){
+		unsigned pending=*(r->sqtail)-__atomic_load_n(r->sqhead,__ATOMIC_ACQUIRE);
+		unsigned ready=__atomic_load_n(r->cqtail,__ATOMIC_ACQUIRE)-*(r->cqhead);
+		if(pending==0 && ready>=want) return ready;
+		if(uringEnter(r->fd,pending,(ready>=want) ? 0 : want-ready)<0 && errno!=EINTR) return -1;
+	}
+}
+
+/**
+ * @brief Estrae l'esito di un'operazione completata
+ * @return 1 se è stato estratto un esito, 0 se non ce ne sono
+ */
+int uringReap(uring * r, unsigned long long * tag, int * res){
+	unsigned head=*(r->cqhead);
+	if(head==__atomic_load_n(r->cqtail,__ATOMIC_ACQUIRE)) return 0;
+	struct io_uring_cqe * cqe=&(r->cqes[head & *(r->cqmask)]);
+	*tag=cqe->user_data;
+	*res=cqe->res;
+	__atomic_store_n(r->cqhead,head+1,__ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * @brief Chiude l'istanza e ne libera le risorse
+ */
+void destroyUring(uring * r){
+	if(!r) return;
+	if(r->sqes) munmap(r->sqes,r->sqesize);
+	if(r->cqring && r->cqring!=r->sqring) munmap(r->cqring,r->cqsize);
+	if(r->sqring && r->sqring!=MAP_FAILED) munmap(r->sqring,r->sqsize);
+	close(r->fd);
+	free(r);
+}
@@ -0,0 +1,148 @@
+/**
+ * Uringlib implementa un'interfaccia minima ad io_uring (senza liburing):
+ * le operazioni vengono preparate nella coda di sottomissione condivisa con
+ * il kernel e inviate tutte insieme con una sola chiamata di sistema, che
+ * attende anche i loro completamenti. Il server la usa per raccogliere in
+ * un'unica chiamata le letture (o le scritture) di più client pronti.
+ * Se il kernel non supporta io_uring createUring restituisce NULL e il
+ * chiamante continua ad usare le normali chiamate di sistema.
+ *
+ * @file uringlib.h
+ *
+ * @author Stefano Spadola 534919
+ * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+ * originale dell'autore
+ *
+ * @brief Libreria che implementa una coda io_uring
+ */
+#if !defined(URINGLIB_H_)
+#define URINGLIB_H_
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**
+ * @struct uring
+ * @brief istanza io_uring con le due code mappate in memoria
+ *
+ * Ogni istanza va usata da un solo thread.
+ *
+ * @var uring::fd
+ * file descriptor dell'istanza
+ * @var uring::entries
+ * numero di posizioni della coda di sottomissione
+ * @var uring::sqhead
+ * testa della coda di sottomissione (avanzata dal kernel)
+ * @var uring::sqtail
+ * coda della coda di sottomissione (avanzata dal chiamante)
+ * @var uring::sqmask
+ * maschera degli indici della coda di sottomissione
+ * @var uring::sqarray
+ * indici delle sqe da inviare
+ * @var uring::sqes
+ * descrittori delle operazioni (sqe)
+ * @var uring::cqhead
+ * testa della coda di completamento (avanzata dal chiamante)
+ * @var uring::cqtail
+ * coda della coda di completamento (avanzata dal kernel)
+ * @var uring::cqmask
+ * maschera degli indici della coda di completamento
+ * @var uring::cqes
+ * esiti delle operazioni completate (cqe)
+ * @var uring::sqring
+ * mappatura della coda di sottomissione
+ * @var uring::sqsize
+ * dimensione della mappatura sqring
+ * @var uring::cqring
+ * mappatura della coda di completamento (uguale a sqring se il kernel usa una sola mappatura)
+ * @var uring::cqsize
+ * dimensione della mappatura cqring
+ * @var uring::sqesize
+ * dimensione della mappatura sqes
+ * @var uring::prepared
+ * operazioni preparate dall'ultima uringRun
+ */
+typedef struct uring_struct{
+	int fd;
+	unsigned entries;
+	unsigned * sqhead;
+	unsigned * sqtail;
+	unsigned * sqmask;
+	unsigned * sqarray;
+	struct io_uring_sqe * sqes;
+	unsigned * cqhead;
+	unsigned * cqtail;
+	unsigned * cqmask;
+	struct io_uring_cqe * cqes;
+	void * sqring;
+	size_t sqsize;
+	void * cqring;
+	size_t cqsize;
+	size_t sqesize;
+	unsigned prepared;
+}uring;
+
+/**
+ * @brief Crea un'istanza io_uring
+ *
+ * @param entries numero di operazioni che possono essere preparate insieme
+ * (il kernel lo arrotonda alla potenza di 2 successiva)
+ * @return l'istanza, NULL se io_uring non è disponibile (errno settato)
+ */
+uring * createUring(unsigned entries);
+
+/**
+ * @brief Prepara la lettura di un socket (IORING_OP_RECV)
+ *
+ * @param r istanza
+ * @param fd socket da leggere
+ * @param buf destinazione dei byte
+ * @param len byte massimi da leggere
+ * @param tag valore restituito da uringReap insieme all'esito
+ * @return 0 in caso di successo, -1 se la coda di sottomissione è piena
+ */
+int uringPrepRecv(uring * r, int fd, void * buf, size_t len, unsigned long long tag);
+
+/**
+ * @brief Prepara una scrittura vettoriale (IORING_OP_WRITEV)
+ *
+ * iov deve restare valido fino al completamento dell'operazione.
+ *
+ * @param r istanza
+ * @param fd fd su cui scrivere
+ * @param iov buffer da scrivere
+ * @param iovcnt numero di buffer
+ * @param tag valore restituito da uringReap insieme all'esito
+ * @return 0 in caso di successo, -1 se la coda di sottomissione è piena
+ */
+int uringPrepWritev(uring * r, int fd, const struct iovec * iov, int iovcnt, unsigned long long tag);
+
+/**
+ * @brief Invia al kernel tutte le operazioni preparate e ne attende il completamento
+ *
+ * Una sola chiamata di sistema nel caso comune (più di una solo se
+ * interrotta da un segnale).
+ *
+ * @param r istanza
+ * @return numero di operazioni completate da estrarre con uringReap
+ * @return -1 in caso di errore (errno settato)
+ */
+int uringRun(uring * r);
+
+/**
+ * @brief Estrae l'esito di un'operazione completata
+ *
+ * @param r istanza
+ * @param tag dove scrivere il valore passato alla preparazione
+ * @param res dove scrivere l'esito (come la chiamata di sistema corrispondente, -errno in caso di errore)
+ * @return 1 se è stato estratto un esito, 0 se non ce ne sono
+ */
+int uringReap(uring * r, unsigned long long * tag, int * res);
+
+/**
+ * @brief Chiude l'istanza e ne libera le risorse
+ * @param r istanza
+ */
+void destroyUring(uring * r);
+
+#endif
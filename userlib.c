@@ -1,9 +1,12 @@
 /**
  * Userlib è il core di tutta la memorizzazione degli utenti riguardo le principali
  * operazioni di: registrazione/deregistrazione login/disconnessione, e della memorizzazione
- * dei messaggi/file inviati, si serve di due strutture hash: <users> e <fdusr> nei quali
- * si memorizzano i nicname degli user e i relativi filedescriptor nel momento in cui
- * emettono richieste al server, inoltre sono memorizzate alcune info di utilità per il runtime.
+ * dei messaggi/file inviati, si serve di una struttura hash <users> per i nickname degli user
+ * e di un vettore <fdusr> indicizzato per filedescriptor per gli user online, inoltre sono
+ * memorizzate alcune info di utilità per il runtime.
+ * La tabella <users> è divisa in partizioni (user_shard_t) ognuna con il proprio lock lettori/scrittori.
+ * Ogni nickname riceve alla prima registrazione un id numerico (indice nella tabella <ids>): history,
+ * liste di consegna e utenti online si riferiscono agli utenti per id e non per nickname.
  *
  * @author Stefano Spadola 534919
  * Si dichiara che il contenuto di questo file e' in ogni sua parte opera
@@ -11,9 +14,11 @@
  *
  * @brief  Implementazione registrazione utenti + Implementazione operazione utenti
 */
+#define _POSIX_C_SOURCE 200809L
 #include "userlib.h"
 #include "msgqueue.h"
 #include "config.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 /**
@@ -21,51 +26,188 @@
 */
 void free_data(void * arg){
 	user_data_t * data=(user_data_t*)arg;
-	destroyMsgQueue(data->msgq);
+	if(data->msgq) destroyMsgQueue(data->msgq);
 	free(data);
 }
 
 /**
- * @brief Funzione di supporto per convertire in stringa un long
+ * @brief Funzione di supporto che associa un fd all'id di un utente in fdusr (tab->mtx acquisita)
+ *
+ * Se fd supera la dimensione del vettore questo viene ampliato (almeno raddoppiato).
+ *
+ * @return 0 in caso di successo, -1 se manca memoria
+*/
+static int setFdUser(users_struct_t * tab, unsigned long fd, unsigned int id){
+	if(fd>=tab->nfd){
+		unsigned long n=(tab->nfd*2>fd) ? tab->nfd*2 : fd+1;
+		unsigned int * tmp=realloc(tab->fdusr,sizeof(unsigned int)*n);
+		if(!tmp) return -1;
+		memset(tmp+tab->nfd,0xff,sizeof(unsigned int)*(n-tab->nfd)); //USER_NOID
+		tab->fdusr=tmp;
+		tab->nfd=n;
+	}
+	tab->fdusr[fd]=id;
+	return 0;
+}
+
+/**
+ * @brief Funzione di supporto che rimuove l'associazione fd -> id da fdusr (tab->mtx acquisita)
+*/
+static void clearFdUser(users_struct_t * tab, unsigned long fd, unsigned int id){
+	if(fd<tab->nfd && tab->fdusr[fd]==id) tab->fdusr[fd]=USER_NOID;
+}
+
+/**
+ * @brief Funzione di supporto che restituisce la partizione di un nickname
+ *
+ * Si usa FNV-1a e non hashString (che sceglie la posizione dentro la partizione):
+ * con lo stesso hash gli utenti di una partizione finirebbero tutti in una
+ * parte della sua tabella.
 */
-static char * toString(unsigned long fd){
-	const int n = snprintf(NULL, 0, "%lu", fd);
-	assert(n > 0);
-	char *keytemp=malloc(sizeof(char)*(n+1));
-	int c = snprintf(keytemp, n+1, "%lu", fd);
-	assert(keytemp[n] == '\0');
-	assert(c == n);
-	return keytemp;
+static unsigned int shardOf(const char * nick){
+	unsigned int h=2166136261u;
+	for(; *nick; nick++){
+		h^=(unsigned char)*nick;
+		h*=16777619u;
+	}
+	return h & (USER_SHARDS-1);
+}
+
+/**
+ * @brief Funzione di supporto che restituisce l'utente con un certo id (senza lock)
+ * @return NULL se l'id non è assegnato
+*/
+static user_data_t * userById(users_struct_t * tab, unsigned int id){
+	if(id>=__atomic_load_n(&(tab->nids),__ATOMIC_ACQUIRE)) return NULL;
+	user_data_t ** chunk=__atomic_load_n(&(tab->ids[id/USER_ID_CHUNK]),__ATOMIC_ACQUIRE);
+	if(!chunk) return NULL;
+	return __atomic_load_n(&(chunk[id%USER_ID_CHUNK]),__ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Funzione di supporto che assegna il prossimo id ad un utente e lo pubblica in ids
+ * @return 0 in caso di successo, -1 se gli id sono esauriti o manca memoria
+*/
+static int assignId(users_struct_t * tab, user_data_t * user){
+	int ret=-1;
+	pthread_mutex_lock(tab->mtx);
+	unsigned int id=tab->nids;
+	if(id<USER_ID_CHUNK*USER_ID_CHUNKS){
+		user_data_t ** chunk=tab->ids[id/USER_ID_CHUNK];
+		if(!chunk && (chunk=calloc(USER_ID_CHUNK,sizeof(user_data_t *)))!=NULL)
+			__atomic_store_n(&(tab->ids[id/USER_ID_CHUNK]),chunk,__ATOMIC_RELEASE);
+		if(chunk){
+			user->id=id;
+			__atomic_store_n(&(chunk[id%USER_ID_CHUNK]),user,__ATOMIC_RELEASE);
+			__atomic_store_n(&(tab->nids),id+1,__ATOMIC_RELEASE);
+			ret=0;
+		}
+	}
+	pthread_mutex_unlock(tab->mtx);
+	return ret;
+}
+
+/**
+ * @brief Funzione di supporto che mette un utente online (tab->mtx acquisita)
+ *
+ * L'utente viene aggiunto in fondo all'indice online (ampliato se pieno)
+ * e associato ad fd in fdusr.
+ *
+ * @return 0 in caso di successo, -1 se manca memoria
+*/
+static int addOnline(users_struct_t * tab, user_data_t * user, unsigned long fd){
+	if(tab->usersOnline==tab->onlinecap){
+		unsigned int n=tab->onlinecap*2;
+		online_user_t * tmp=realloc(tab->online,sizeof(online_user_t)*n);
+		if(!tmp) return -1;
+		tab->online=tmp;
+		tab->onlinecap=n;
+	}
+	if(setFdUser(tab,fd,user->id)<0) return -1;
+	user->onlinepos=tab->usersOnline;
+	tab->online[tab->usersOnline].fd=fd;
+	tab->online[tab->usersOnline].id=user->id;
+	tab->usersOnline++;
+	tab->onlineEpoch++;
+	return 0;
+}
+
+/**
+ * @brief Funzione di supporto che toglie un utente online dall'indice (tab->mtx acquisita)
+ *
+ * Al suo posto viene spostato l'ultimo elemento dell'indice, di cui si aggiorna onlinepos.
+*/
+static void removeOnline(users_struct_t * tab, user_data_t * user){
+	unsigned int pos=user->onlinepos;
+	unsigned int last=--tab->usersOnline;
+	tab->onlineEpoch++;
+	clearFdUser(tab,user->fd,user->id);
+	if(pos!=last){
+		tab->online[pos]=tab->online[last];
+		userById(tab,tab->online[pos].id)->onlinepos=pos;
+	}
 }
 
 /**
  * @brief Crea la struttura principale per memorizzare gli utenti.
  *
- * Per la memorizzazione di un utente si utilizzano due strutture hash:
- * 1) per memorizzare la stringa dell'utente con le relative informazione di utilità
- * 2)per memorizzare il file descriptor dell'user che richiede di loggarsi associandolo con il relativo nickname.
+ * Per la memorizzazione di un utente si utilizzano tre strutture:
+ * 1) una tabella hash per memorizzare la stringa dell'utente con le relative informazione di utilità
+ * (divisa in USER_SHARDS partizioni)
+ * 2) la tabella degli id, con l'utente associato ad ogni id
+ * 3) un vettore indicizzato per file descriptor con l'id dell'user collegato su ogni fd
+ * 4) l'indice compatto (fd, id) degli utenti online.
  * Il motivo di tale scelta implementativa è che il client potrebbe disconnettersi in "maniera implicita"
  * rendendo la disconnessione possibile soltanto per mezzo del suo file descriptor.
  *
  * @param historysize dimensione massima coda messaggi ricevuti
- * @param nbuckets dimensione inziale tabella hash utenti
+ * @param msgsize dimensione massima di un messaggio (spazio riservato ad ogni messaggio della history)
+ * @param nbuckets dimensione inziale tabella hash utenti (ripartita fra le partizioni,
+ * le tabelle crescono da sole all'aumentare degli utenti)
+ * @param nfd dimensione iniziale del vettore indicizzato per fd (es. RLIMIT_NOFILE)
  *
  * @return puntatore a users_struct_t
 */
-users_struct_t * createUsersStruct(unsigned long historysize, unsigned long nbuckets){
+users_struct_t * createUsersStruct(unsigned long historysize, unsigned long msgsize, unsigned long nbuckets, unsigned long nfd){
 
 	if(historysize<1) historysize=1;
-	if(nbuckets<0) nbuckets=4;
+	if(nbuckets<1) nbuckets=4;
+	if(nfd<1) nfd=64;
 
 	users_struct_t * us = malloc(sizeof(users_struct_t));
+	if(!us){
+		perror("malloc in createUsersStruct");
+		exit(EXIT_FAILURE);
+	}
 
-	us->users=icl_hash_create(nbuckets,NULL,NULL);
-	us->fdusr=icl_hash_create(nbuckets,NULL,NULL);
+	for(int i=0; i<USER_SHARDS; i++){
+		us->shards[i].users=createHashMap(nbuckets/USER_SHARDS+1);
+		pthread_rwlock_init(&(us->shards[i].lock),NULL);
+	}
+	memset(us->ids,0,sizeof(us->ids));
+	us->nids=0;
+	us->fdusr=malloc(sizeof(unsigned int)*nfd);
+	if(!us->fdusr){
+		perror("malloc in createUsersStruct");
+		exit(EXIT_FAILURE);
+	}
+	memset(us->fdusr,0xff,sizeof(unsigned int)*nfd); //USER_NOID
+	us->nfd=nfd;
+	us->onlinecap=64;
+	us->online=malloc(sizeof(online_user_t)*us->onlinecap);
+	if(!us->online){
+		perror("malloc in createUsersStruct");
+		exit(EXIT_FAILURE);
+	}
+
+	us->onlineEpoch=0;
+	us->onlineList=NULL;
 
 	us->mtx=malloc(sizeof(pthread_mutex_t));
 	pthread_mutex_init(us->mtx,NULL);
 
 	us->historysize=historysize;
+	us->msgsize=msgsize;
 	us->usersOnline=0;
 
 	return us;
@@ -73,6 +215,10 @@ users_struct_t * createUsersStruct(unsigned long historysize, unsigned long nbuc
 
 /**
  * @brief Funzione che registra gli utenti nell'apposita struttura dati e li connette
+ *
+ * Un nickname registrato per la prima volta riceve un nuovo id, uno che era già
+ * stato registrato (e poi deregistrato) riprende il proprio.
+ *
  * @param tab struttura dove registrare l'utente
  * @param nick username utente che vuole essere registrato
  * @param fd filedescriptor utente che vuole essere connesso
@@ -83,23 +229,44 @@ users_struct_t * createUsersStruct(unsigned long historysize, unsigned long nbuc
  */
 int registerUser(users_struct_t * tab, char * nick, unsigned long fd){
 	int ret=-1;
-	pthread_mutex_lock(tab->mtx);
-	if(!icl_hash_find(tab->users,nick)){//Se è NULL => è un User nuovo
-		user_data_t * data = malloc(sizeof(user_data_t));
-		//Alloco il nome sulla struttura permamente
-		strncpy(data->name,nick,MAX_NAME_LENGTH+1);
-		data->fd=fd;
-		data->msgq=createMsgQueue(tab->historysize);
-		//Inserisco negli user registrati
-		icl_entry_t * entry1=icl_hash_insert(tab->users,data->name,data);
-		if(!entry1) ret=-2;
-		//Inserisco negli user online
-		char *keytemp=toString(fd);
-		icl_entry_t * entry2=icl_hash_insert(tab->fdusr,keytemp,data->name);
-		if(entry2) ret=0;
-		tab->usersOnline++;
+	unsigned int s=shardOf(nick);
+	user_shard_t * sh=&(tab->shards[s]);
+	pthread_rwlock_wrlock(&(sh->lock));
+	user_data_t * data=hashMapFind(sh->users,nick);
+	if(!data){//Se è NULL => è un nickname nuovo
+		ret=-2;
+		data = malloc(sizeof(user_data_t));
+		if(data){
+			//Alloco il nome sulla struttura permamente
+			strncpy(data->name,nick,MAX_NAME_LENGTH+1);
+			data->name[MAX_NAME_LENGTH]='\0';
+			data->shard=s;
+			data->fd=-1;
+			data->msgq=NULL;
+			//Inserisco fra i nickname e gli assegno un id
+			if(hashMapInsert(sh->users,data->name,data)!=0){
+				free(data);
+				data=NULL;
+			}
+			else if(assignId(tab,data)!=0){
+				hashMapDelete(sh->users,data->name,free_data);
+				data=NULL;
+			}
+		}
 	}
-	pthread_mutex_unlock(tab->mtx);
+	if(data && !data->msgq){//Se non è registrato
+		ret=-2;
+		if((data->msgq=createMsgQueue(tab->historysize,tab->msgsize))!=NULL){
+			//Inserisco negli user online
+			pthread_mutex_lock(tab->mtx);
+			if(addOnline(tab,data,fd)==0){
+				data->fd=fd;
+				ret=0;
+			}
+			pthread_mutex_unlock(tab->mtx);
+		}
+	}
+	pthread_rwlock_unlock(&(sh->lock));
 	return ret;
 }
 
@@ -115,26 +282,31 @@ int registerUser(users_struct_t * tab, char * nick, unsigned long fd){
  */
 int connectUser(users_struct_t * tab, char * nick, unsigned long fd){//Work
 	int ret=-1;
-	pthread_mutex_lock(tab->mtx);
-	user_data_t * user = icl_hash_find(tab->users,nick);
-	if(user){//Se è registrato
+	user_shard_t * sh=&(tab->shards[shardOf(nick)]);
+	pthread_rwlock_wrlock(&(sh->lock));
+	user_data_t * user = hashMapFind(sh->users,nick);
+	if(user && user->msgq){//Se è registrato
 		if(user->fd==-1){//E se deve ancora collegarsi
-			user->fd=fd;
-			tab->usersOnline++;
-			//Aggiungiamo alla seconda tabella hash
-			//Convertiamo il fd in stringa:
-			char *keytemp=toString(fd);
-			icl_entry_t * entry=icl_hash_insert(tab->fdusr,keytemp,user->name);
-			if(entry) ret=0; //Collegato!
+			//Aggiungiamo all'indice degli user online
+			pthread_mutex_lock(tab->mtx);
+			if(addOnline(tab,user,fd)==0){
+				user->fd=fd;
+				ret=0; //Collegato!
+			}
+			else ret=-2;
+			pthread_mutex_unlock(tab->mtx);
 		}
 		else ret=-2; //!già collegato
 	}
-	pthread_mutex_unlock(tab->mtx);
+	pthread_rwlock_unlock(&(sh->lock));
 	return ret;
 }
 
 /**
  * @brief Deregistra l'utente che ne fa richiesta (disconnettendolo prima)
+ *
+ * La history viene eliminata, il nickname e il suo id restano nella tabella.
+ *
  * @param tab struttura dove è registrato l'utente
  * @param nick username utente che vuole essere deregistrato
  * @param fd filedescriptor utente che vuole deregistrarsi
@@ -144,17 +316,21 @@ int connectUser(users_struct_t * tab, char * nick, unsigned long fd){//Work
  */
 int unregisterUser(users_struct_t * tab, char * nick, int fd){
 	int ret=-1;
-	pthread_mutex_lock(tab->mtx);
-	user_data_t * user = icl_hash_find(tab->users,nick);
-	if(user){
+	user_shard_t * sh=&(tab->shards[shardOf(nick)]);
+	pthread_rwlock_wrlock(&(sh->lock));
+	user_data_t * user = hashMapFind(sh->users,nick);
+	if(user && user->msgq){
+		if(user->fd!=-1){
+			pthread_mutex_lock(tab->mtx);
+			removeOnline(tab,user);
+			pthread_mutex_unlock(tab->mtx);
+		}
 		user->fd=-1;
-		if(icl_hash_delete(tab->users,nick,NULL,free_data)==0) ret=0;
-		char * tmp=toString(fd);
-		if(icl_hash_delete(tab->fdusr,tmp,free,NULL)==0) ret=0;
-		free(tmp);
-		tab->usersOnline--;
+		destroyMsgQueue(user->msgq);
+		user->msgq=NULL;
+		ret=0;
 	}
-	pthread_mutex_unlock(tab->mtx);
+	pthread_rwlock_unlock(&(sh->lock));
 	return ret;
 }
 
@@ -168,6 +344,11 @@ int unregisterUser(users_struct_t * tab, char * nick, int fd){
  * implementato in modo tale che prende come paramentri sia l'username che il filedescriptor
  * e qual'ora l'username passato sia NULL, la disconnessione verrà trattata in modo implicito.
  *
+ * Nella disconnessione implicita l'utente si ricava dall'id in fdusr (gli utenti non
+ * vengono mai liberati), poi, preso il lock della sua partizione, si controlla che sia
+ * ancora collegato proprio con fd. In quella esplicita fd viene ignorato e si usa
+ * quello con cui l'utente è collegato.
+ *
  * @param tab struttura dove è registrato l'utente
  * @param nick username utente che vuole essere disconnesso
  *
@@ -177,53 +358,100 @@ int unregisterUser(users_struct_t * tab, char * nick, int fd){
  */
 int disconnectUser(users_struct_t * tab, char * nick, unsigned long fd){
 	int ret=-1;
-	pthread_mutex_lock(tab->mtx);
-	char *keytemp=toString(fd);
+	int implicit=(nick==NULL);
+	user_data_t * user=NULL;
+	user_shard_t * sh;
 	//Nick==NULL -->(Disconnessione implicita)
-	if(!nick){
-		nick=icl_hash_find(tab->fdusr,keytemp);
+	if(implicit){
+		pthread_mutex_lock(tab->mtx);
+		unsigned int id=(fd<tab->nfd) ? tab->fdusr[fd] : USER_NOID;
+		pthread_mutex_unlock(tab->mtx);
+		if(id==USER_NOID || (user=userById(tab,id))==NULL) return -2;
+		sh=&(tab->shards[user->shard]);
+		pthread_rwlock_wrlock(&(sh->lock));
 	}
-	user_data_t * user = icl_hash_find(tab->users,nick);
-	if(user){
-		if(user->fd!=-1){
+	else{
+		sh=&(tab->shards[shardOf(nick)]);
+		pthread_rwlock_wrlock(&(sh->lock));
+		user=hashMapFind(sh->users,nick);
+	}
+	if(user && user->msgq){
+		if(user->fd!=-1 && (!implicit || user->fd==fd)){
 			printf("Disconnetto client: [%lu]\n",user->fd);
-			tab->usersOnline--;
+			pthread_mutex_lock(tab->mtx);
+			removeOnline(tab,user);
+			pthread_mutex_unlock(tab->mtx);
 			user->fd=-1;
-			ret=icl_hash_delete(tab->fdusr,keytemp,free,NULL);//0 on Success -1 on failure
+			ret=0;
 		}
 	}
 	else ret=-2;
-	free(keytemp);
-	pthread_mutex_unlock(tab->mtx);
+	pthread_rwlock_unlock(&(sh->lock));
 	return ret;
 }
 
 /**
- * @brief Funzione che inizializza list con i nickname degli utenti attualmente online
+ * @brief Funzione di supporto che serializza l'indice degli utenti online (tab->mtx acquisita)
+ *
+ * I nickname si leggono dalla tabella degli id (sono immutabili). La lista
+ * nasce con due riferimenti: quello della tabella e quello del chiamante.
+ *
+ * @return la nuova lista, NULL se manca memoria
+*/
+static online_list_t * buildOnlineList(users_struct_t * tab){
+	int n=tab->usersOnline;
+	size_t slots=(size_t)n*(MAX_NAME_LENGTH+1);
+	//Slot a dimensione fissa seguiti dalla versione compattata (al più altrettanto lunga)
+	online_list_t * list=malloc(sizeof(online_list_t)+2*slots+1);
+	if(!list) return NULL;
+	list->refs=2;
+	list->epoch=tab->onlineEpoch;
+	list->n=n;
+	list->packed=list->names+slots;
+	list->packedlen=0;
+	for(int i=0; i<n; i++){
+		const char * name=getUserName(tab,tab->online[i].id);
+		strncpy(list->names+i*(MAX_NAME_LENGTH+1),name,(MAX_NAME_LENGTH+1));
+		size_t l=strlen(list->names+i*(MAX_NAME_LENGTH+1))+1;
+		memcpy(list->packed+list->packedlen,list->names+i*(MAX_NAME_LENGTH+1),l);
+		list->packedlen+=l;
+	}
+	return list;
+}
+
+/**
+ * @brief Funzione che restituisce la lista degli utenti attualmente online
+ *
+ * La lista corrente viene riusata finchè onlineEpoch non cambia, così una
+ * raffica di login ricostruisce la lista una volta per ogni cambiamento e
+ * non una volta per ogni risposta.
+ *
  * @param tab struttura dove è registrato l'utente
- * @param list puntatore ad array di caratteri
  *
- * @return -1 Se c'è un errore //Impossibile
- * @return >=0 #utenti online
+ * @return NULL Se c'è un errore
+ * @return lista da rilasciare con releaseOnlineList
  */
-int getOnlineList(users_struct_t * tab, char ** list){
-	int ret=-1;
+online_list_t * getOnlineList(users_struct_t * tab){
+	online_list_t * list;
 	pthread_mutex_lock(tab->mtx);
-	//Allochiamo la lista
-	int dim=tab->usersOnline;
-	*list=malloc(sizeof(char)*dim*(MAX_NAME_LENGTH+1));
-	char *tmp=*list;
-	//Scorriamo l'hashmap degli utenti
-	int i; icl_entry_t * entry; char *kp; user_data_t *dp; //variabile che servono al foreachs
-	icl_hash_foreach(tab->users,i,entry,kp,dp){
-		if(dp->fd!=-1){
-			strncpy(tmp,dp->name,(MAX_NAME_LENGTH+1));
-			tmp+=(MAX_NAME_LENGTH+1);
-		}
+	list=tab->onlineList;
+	if(list && list->epoch==tab->onlineEpoch){//Nessun cambiamento: la condivido
+		__atomic_add_fetch(&(list->refs),1,__ATOMIC_RELAXED);
+	}
+	else if((list=buildOnlineList(tab))!=NULL){
+		if(tab->onlineList) releaseOnlineList(tab->onlineList);
+		tab->onlineList=list;
 	}
-	ret=dim;
 	pthread_mutex_unlock(tab->mtx);
-	return ret;
+	return list;
+}
+
+/**
+ * @brief Rilascia una lista restituita da getOnlineList
+ * @param list lista da rilasciare
+ */
+void releaseOnlineList(online_list_t * list){
+	if(list && __atomic_sub_fetch(&(list->refs),1,__ATOMIC_ACQ_REL)==0) free(list);
 }
 
 /**
@@ -233,31 +461,86 @@ int getOnlineList(users_struct_t * tab, char ** list){
  * Si preferisce farne una copia intera per motivi di consistenza,
  * in quanto un altro thread del server, potrebbe voler registrare un
  * messaggio mandato da un altro utente.
+ * Gli id dei mittenti vengono tradotti nei nickname con la tabella degli id.
  *
  * @param tab struttura dove è registrato l'utente
  * @param nick username dell'Utente
+ * @param msgs dove scrivere il vettore dei messaggi
  *
- * @return NULL se l'utente è offline
- * @return msgqueue contenente la history di "nick"
+ * @return -1 se l'utente non è registrato o manca memoria
+ * @return numero di messaggi in msgs
  */
-msgqueue_t * getHistory(users_struct_t *tab, char * nick){
-	msgqueue_t * ret = NULL;
-	pthread_mutex_lock(tab->mtx);
-	user_data_t * user = icl_hash_find(tab->users,nick);
-	if(user){//devo farne una copia completa (altre strutture potrebbero accedervi)
+int getHistory(users_struct_t *tab, char * nick, message_t ** msgs){
+	int ret=-1;
+	user_shard_t * sh=&(tab->shards[shardOf(nick)]);
+	pthread_rwlock_rdlock(&(sh->lock));
+	user_data_t * user = hashMapFind(sh->users,nick);
+	if(user && user->msgq){//devo farne una copia completa (altre strutture potrebbero accedervi)
 		printf("Ho %zu mex in coda!!!!\n",user->msgq->size);
-		if((ret=createMsgQueue(user->msgq->size))!=NULL){
-			msgnode_t * curr = user->msgq->head;
-			while(curr){ //Deep Copy di tutti i messaggi nella nuova coda
-				pushMsgQueue(ret,curr->msg);
-				curr=curr->next;
+		int n=user->msgq->size;
+		if((*msgs=malloc(sizeof(message_t)*(n>0 ? n : 1)))!=NULL){
+			ret=0;
+			while(ret<n){ //Deep Copy di tutti i messaggi nel vettore (dal più vecchio)
+				msgnode_t * curr = msgQueueAt(user->msgq,ret);
+				char * buf=malloc(sizeof(char)*(curr->len>0 ? curr->len : 1));
+				if(!buf) break;
+				memcpy(buf,msgQueueBody(user->msgq,curr),curr->len);
+				const char * sender=getUserName(tab,curr->sender);
+				setHeader(&((*msgs)[ret].hdr),curr->op,(char *)(sender ? sender : ""));
+				setData(&((*msgs)[ret].data),user->name,buf,curr->len);
+				ret++;
+			}
+			if(ret<n){//Memoria esaurita
+				freeHistory(*msgs,ret);
+				ret=-1;
 			}
 		}
 	}
-	pthread_mutex_unlock(tab->mtx);
+	pthread_rwlock_unlock(&(sh->lock));
 	return ret;
 }
 
+/**
+ * @brief Libera il vettore restituito da getHistory
+ * @param msgs vettore dei messaggi
+ * @param n numero di messaggi
+ */
+void freeHistory(message_t * msgs, int n){
+	for(int i=0; i<n; i++) free(msgs[i].data.buf);
+	free(msgs);
+}
+
+/**
+ * @brief Funzione che restituisce l'id dell'utente "nick"
+ * @param tab struttura dove è registrato l'utente
+ * @param nick username dell'Utente
+ *
+ * @return USER_NOID se nick non è mai stato registrato
+ * @return id di nick
+ */
+unsigned int getUserId(users_struct_t * tab, const char * nick){
+	unsigned int ret=USER_NOID;
+	user_shard_t * sh=&(tab->shards[shardOf(nick)]);
+	pthread_rwlock_rdlock(&(sh->lock));
+	user_data_t * user = hashMapFind(sh->users,nick);
+	if(user) ret=user->id;
+	pthread_rwlock_unlock(&(sh->lock));
+	return ret;
+}
+
+/**
+ * @brief Funzione che restituisce il nickname di un id (senza lock)
+ * @param tab struttura dove è registrato l'utente
+ * @param id id dell'Utente
+ *
+ * @return NULL se l'id non è assegnato
+ * @return nickname
+ */
+const char * getUserName(users_struct_t * tab, unsigned int id){
+	user_data_t * user=userById(tab,id);
+	return user ? user->name : NULL;
+}
+
 /**
  * @brief Funzione che restituisce il file descriptor associato all'utente "nick"
  * @param tab struttura dove è registrato l'utente
@@ -269,18 +552,23 @@ msgqueue_t * getHistory(users_struct_t *tab, char * nick){
  */
 int getUserFD(users_struct_t * tab, char * nick){
 	int ret=-1;
-	pthread_mutex_lock(tab->mtx);
-	user_data_t * user = icl_hash_find(tab->users,nick);
-	if(user){//Se c'è l'user
+	user_shard_t * sh=&(tab->shards[shardOf(nick)]);
+	pthread_rwlock_rdlock(&(sh->lock));
+	user_data_t * user = hashMapFind(sh->users,nick);
+	if(user && user->msgq){//Se c'è l'user
 		ret=0;
 		if(user->fd!=-1) ret=user->fd; //Se è connesso Prendo il relativo fd
 	}
-	pthread_mutex_unlock(tab->mtx);
+	pthread_rwlock_unlock(&(sh->lock));
 	return ret;
 }
 
 /**
  * @brief Funzione che riempie il vettore di interi fds con i fd degli user online
+ *
+ * Come getOnlineList scorre soltanto l'indice degli utenti online. Il richiedente
+ * viene escluso confrontando gli id.
+ *
  * @param tab struttura dove è registrato l'utente
  * @param nick username dell'Utente che ne fa richiesta
  * @param fds puntatore a vettore di filedescriptor
@@ -289,27 +577,29 @@ int getUserFD(users_struct_t * tab, char * nick){
  * @return #user online on success
  */
 int getAllUsersFD(users_struct_t * tab, char * nick, int ** fds){
-	int ret=-1;
+	unsigned int self=getUserId(tab,nick);
 	pthread_mutex_lock(tab->mtx);
-	ret=tab->usersOnline-1; //Tutti, meno chi ne fa richiesta
-	*fds=malloc(sizeof(int)*ret);
-	int *tmp=*fds;
+	int n=tab->usersOnline;
+	*fds=malloc(sizeof(int)*(n>0 ? n : 1));
+	if(!*fds){
+		pthread_mutex_unlock(tab->mtx);
+		return -1;
+	}
 	int j=0;
-	int i; icl_entry_t * entry; char *kp; user_data_t *dp; //variabile che servono al foreachs
-	icl_hash_foreach(tab->users,i,entry,kp,dp){//Per tutti gli utenti (copiati)
-		if(strcmp(dp->name,nick)!=0){//Se non voglio inviare un messaggio a se stesso
-			if(dp->fd!=-1) {
-				tmp[j]=dp->fd;
-				j++;
-			}
-		}
+	for(int i=0; i<n; i++){
+		//Se non voglio inviare un messaggio a se stesso
+		if(tab->online[i].id!=self) (*fds)[j++]=tab->online[i].fd;
 	}
 	pthread_mutex_unlock(tab->mtx);
-	return ret;
+	return j;
 }
 
 /**
  * @brief Funzione che posta un msg nella history di msg->receiver
+ *
+ * Nella history viene memorizzato l'id del mittente, cercato prima di
+ * prendere il lock (in scrittura) della partizione del destinatario.
+ *
  * @param tab struttura dove è registrato l'utente
  * @param msg messaggio da postare
  *
@@ -318,48 +608,90 @@ int getAllUsersFD(users_struct_t * tab, char * nick, int ** fds){
  */
 int postOnHistory(users_struct_t *tab, message_t * msg){
 	int ret=-1;
-	pthread_mutex_lock(tab->mtx);
-	user_data_t * user = icl_hash_find(tab->users,msg->data.hdr.receiver);
-	if(user){//Se l'user esiste
-		if(pushMsgQueue(user->msgq,msg)==0){//Se lo inserisco
+	unsigned int sender=getUserId(tab,msg->hdr.sender);
+	user_shard_t * sh=&(tab->shards[shardOf(msg->data.hdr.receiver)]);
+	pthread_rwlock_wrlock(&(sh->lock));
+	user_data_t * user = hashMapFind(sh->users,msg->data.hdr.receiver);
+	if(user && user->msgq){//Se l'user esiste
+		if(pushMsgQueue(user->msgq,msg->hdr.op,sender,msg->data.buf,msg->data.hdr.len)==0){//Se lo inserisco
 			ret=0;
 		}
 	}
-	pthread_mutex_unlock(tab->mtx);
+	pthread_rwlock_unlock(&(sh->lock));
 	return ret;
 }
 
 /**
- * @brief Funzione che posta un msg nella history di tutti gli utenti online
+ * @brief Funzione che posta un msg nella history di tutti gli utenti registrati
+ *
+ * Le partizioni vengono bloccate (in scrittura) una alla volta, il mittente
+ * viene escluso confrontando gli id.
+ *
  * @param tab struttura dove è registrato l'utente
  * @param msg messaggio da postare
  *
  * @return -1 on failure
- * @return 0 in caso di successo
+ * @return #messaggi postati in caso di successo
  */
 int postOnHistoryAll(users_struct_t *tab, message_t * msg){
 	int ret=0;
 	int fail=0;
-	pthread_mutex_lock(tab->mtx);
-	int i; icl_entry_t * entry; char *kp; user_data_t *dp; //variabile che servono al foreachs
-	icl_hash_foreach(tab->users,i,entry,kp,dp){//Per tutti gli utenti (copiati)
-		if(strcmp(dp->name,msg->hdr.sender)!=0){//Se non voglio inviare un messaggio a se stesso
-			if(pushMsgQueue(dp->msgq,msg)==0) ret++; //Se va a buon fine!
-			else fail=1;
+	unsigned int sender=getUserId(tab,msg->hdr.sender);
+	for(int s=0; s<USER_SHARDS; s++){
+		user_shard_t * sh=&(tab->shards[s]);
+		pthread_rwlock_wrlock(&(sh->lock));
+		size_t i; char *kp; user_data_t *dp; //variabile che servono al foreachs
+		hashMapForeach(sh->users,i,kp,dp){//Per tutti gli utenti registrati
+			if(dp->msgq && dp->id!=sender){//Se non voglio inviare un messaggio a se stesso
+				if(pushMsgQueue(dp->msgq,msg->hdr.op,sender,msg->data.buf,msg->data.hdr.len)==0) ret++; //Se va a buon fine!
+				else fail=1;
+			}
 		}
+		pthread_rwlock_unlock(&(sh->lock));
 	}
 	if(fail)ret=-1;
-	pthread_mutex_unlock(tab->mtx);
 	return ret;
 }
 
+/**
+ * @brief Funzione che raccoglie le statistiche delle tabelle hash degli utenti registrati
+ * @param tab struttura dove sono registrati gli utenti
+ * @param st dove scrivere le statistiche
+ *
+ * @return numero di partizioni lette (quelle bloccate in scrittura vengono saltate)
+ */
+int getUsersHashStats(users_struct_t * tab, hashmap_stats * st){
+	int read=0;
+	hashmap_stats one;
+	memset(st,0,sizeof(hashmap_stats));
+	for(int s=0; s<USER_SHARDS; s++){
+		user_shard_t * sh=&(tab->shards[s]);
+		if(pthread_rwlock_tryrdlock(&(sh->lock))!=0) continue;
+		hashMapStats(sh->users,&one);
+		pthread_rwlock_unlock(&(sh->lock));
+		st->nslots+=one.nslots;
+		st->count+=one.count;
+		st->rehashing+=one.rehashing;
+		st->nresize+=one.nresize;
+		if(one.maxdist>st->maxdist) st->maxdist=one.maxdist;
+		read++;
+	}
+	return read;
+}
+
 /**
  * @brief Distrugge le strutture dati relative alla memorizzazione utenti
  * @param tab tabella utenti
 */
 void destroyUsersStruct(users_struct_t * tab){
-	icl_hash_destroy(tab->users,NULL,free_data);
-	icl_hash_destroy(tab->fdusr,free,NULL);
+	for(int i=0; i<USER_SHARDS; i++){
+		destroyHashMap(tab->shards[i].users,free_data);
+		pthread_rwlock_destroy(&(tab->shards[i].lock));
+	}
+	for(int i=0; i<USER_ID_CHUNKS; i++) free(tab->ids[i]);
+	free(tab->fdusr);
+	free(tab->online);
+	releaseOnlineList(tab->onlineList);
 	pthread_mutex_destroy(tab->mtx);
 	free(tab->mtx);
 	free(tab);
@@ -1,9 +1,11 @@
 /**
  * Userlib è il core di tutta la memorizzazione degli utenti riguardo le principali
  * operazioni di: registrazione/deregistrazione login/disconnessione, e della memorizzazione
- * dei messaggi/file inviati, si serve di due strutture hash: <users> e <fdusr> nei quali
- * si memorizzano i nicname degli user e i relativi filedescriptor nel momento in cui
- * emettono richieste al serve, inoltre sono memorizzate alcune info di utilità per il runtime.
+ * dei messaggi/file inviati, si serve di una struttura hash <users> per i nickname degli user
+ * e di un vettore <fdusr> indicizzato per filedescriptor per gli user online, inoltre sono
+ * memorizzate alcune info di utilità per il runtime.
+ * La tabella <users> è divisa in USER_SHARDS partizioni, ognuna con il proprio lock
+ * lettori/scrittori, così le operazioni su utenti diversi non si serializzano.
  *
  * @file userlib.h
  *
@@ -16,64 +18,189 @@
 #ifndef USERLIB_H_
 #define USERLIB_H_
 
-#include "icl_hash.h"
+//pthread_rwlock_t richiede POSIX.1-2001 (con -std=c99)
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "hashlib.h"
 #include "msgqueue.h"
 #include <pthread.h>
 
+//Numero di partizioni (shard) della tabella utenti (potenza di 2)
+#define USER_SHARDS 16
+//Gli id utente sono indici di un vettore a blocchi: USER_ID_CHUNKS blocchi da USER_ID_CHUNK utenti
+#define USER_ID_CHUNK 1024
+#define USER_ID_CHUNKS 4096
+//Id non valido (fd senza utente collegato)
+#define USER_NOID ((unsigned int)-1)
+
+/**
+ * @struct user_shard_t
+ * @brief Partizione della tabella utenti
+ *
+ * Ogni utente appartiene alla partizione scelta dall'hash del suo nickname.
+ * Le letture (ricerca del fd, copia della history, lista utenti online)
+ * prendono il lock in lettura e procedono in parallelo, mentre le modifiche
+ * (registrazione, connessione, messaggi in history) lo prendono in scrittura
+ * bloccando soltanto gli utenti della stessa partizione.
+ *
+ * @var user_shard_t::users
+ * tabella hash (ad indirizzamento aperto, hashlib) dei nickname della partizione
+ *			  <key,data>=<nickname,user_data_t>
+ * @var user_shard_t::lock
+ * lock lettori/scrittori della partizione
+ */
+typedef struct user_shard_s{
+	hashmap * users;
+	pthread_rwlock_t lock;
+}user_shard_t;
+
+/**
+ * @struct online_user_t
+ * @brief Elemento dell'indice degli utenti online
+ * @var online_user_t::fd
+ * file descriptor su cui l'utente è collegato
+ * @var online_user_t::id
+ * id dell'utente
+ */
+typedef struct online_user_s{
+	int fd;
+	unsigned int id;
+}online_user_t;
+
+/**
+ * @struct online_list_t
+ * @brief Lista degli utenti online già serializzata, condivisa in sola lettura
+ *
+ * Viene ricostruita soltanto quando cambia l'insieme degli utenti online
+ * (users_struct_t::onlineEpoch), altrimenti tutte le risposte usano la stessa
+ * copia. Ogni utilizzatore la rilascia con releaseOnlineList: viene liberata
+ * quando non la usa più nessuno (e non è più quella corrente).
+ *
+ * @var online_list_t::refs
+ * riferimenti alla lista (la tabella ne tiene uno finchè è quella corrente)
+ * @var online_list_t::epoch
+ * valore di onlineEpoch con cui è stata costruita
+ * @var online_list_t::n
+ * numero di utenti online
+ * @var online_list_t::packedlen
+ * lunghezza di packed
+ * @var online_list_t::packed
+ * nomi uno dopo l'altro, ciascuno con il proprio terminatore (formato v2)
+ * @var online_list_t::names
+ * nomi in slot di MAX_NAME_LENGTH+1 caratteri (n*(MAX_NAME_LENGTH+1) byte)
+ */
+typedef struct online_list_s{
+	unsigned int refs;
+	unsigned long epoch;
+	int n;
+	unsigned int packedlen;
+	char * packed;
+	char names[];
+}online_list_t;
+
 /**
  * @struct users_struct_t
  * @brief Struttura utilizzata dal Server chatty,
  * per memorizzare gli utenti che iscrivono e i loro messaggi
- * @var users_struct_t::users
- * 1° tabella hash usata per la memorizzazione degli utenti registrati
- *			  <key,data>=<nickname,user_data_t>
+ * @var users_struct_t::shards
+ * partizioni degli utenti registrati (USER_SHARDS)
+ * @var users_struct_t::ids
+ * tabella dei nickname: ids[id/USER_ID_CHUNK][id%USER_ID_CHUNK] è l'utente con
+ * quell'id. I blocchi e gli utenti non vengono mai spostati nè liberati (fino a
+ * destroyUsersStruct), quindi si possono leggere senza lock
+ * @var users_struct_t::nids
+ * numero di id assegnati
  * @var users_struct_t::fdusr
- * 2° tabella hash usata per la memorizzazione dei file descriptor degli utenti online
- *			  <key,data>=<fd(stringa),nickname>
+ * vettore indicizzato per file descriptor: fdusr[fd] è l'id dell'utente online
+ * collegato su fd (USER_NOID se nessuno), così una disconnessione implicita non richiede ricerche
+ * @var users_struct_t::nfd
+ * dimensione di fdusr (ampliato se arriva un fd più grande)
+ * @var users_struct_t::online
+ * indice degli utenti online: vettore compatto di (fd, id) senza buchi. Un utente
+ * che si disconnette viene sostituito dall'ultimo elemento (user_data_t::onlinepos
+ * dice dove si trova), quindi lista utenti e consegna a tutti costano O(utenti online)
+ * @var users_struct_t::onlinecap
+ * dimensione di online (raddoppiato quando è pieno)
+ * @var users_struct_t::onlineEpoch
+ * incrementato ad ogni modifica di online
+ * @var users_struct_t::onlineList
+ * ultima lista serializzata (NULL se non è ancora stata chiesta)
  * @var users_struct_t::mtx
- * Variabile di mutua esclusione usate per accedere alla struttura
+ * Variabile di mutua esclusione usata per accedere a fdusr, online, onlineList e per assegnare nuovi id
+ * (presa sempre dopo il lock di una partizione, mai prima)
  * @var users_struct_t::historysize
  * Dimensione della History dei messaggi
+ * @var users_struct_t::msgsize
+ * Spazio riservato al corpo di ogni messaggio della History (MaxMsgSize)
+ * @var users_struct_t::usersOnline
+ * Numero di utenti online (elementi di online)
  */
 typedef struct users_struct_s{
-	icl_hash_t * users;
-	icl_hash_t * fdusr;
+	user_shard_t shards[USER_SHARDS];
+	struct user_data_s ** ids[USER_ID_CHUNKS];
+	unsigned int nids;
+	unsigned int * fdusr;
+	unsigned long nfd;
+	online_user_t * online;
+	unsigned int onlinecap;
+	unsigned long onlineEpoch;
+	online_list_t * onlineList;
 	pthread_mutex_t * mtx;
 	unsigned int historysize;
+	unsigned int msgsize;
 	unsigned int usersOnline;
 }users_struct_t;
 
 /**
  * @struct user_data_t
  * @brief Struttura dati utilizzata come "value" per la 1° mappa utenti (users)
+ *
+ * Viene creata alla prima registrazione di un nickname e non viene eliminata
+ * quando l'utente si deregistra (msgq torna NULL): così l'id resta associato
+ * sempre allo stesso nickname, anche nelle history degli altri utenti.
+ *
  * @var user_data_t::name
- * Nickname user registrato
+ * Nickname user (immutabile)
+ * @var user_data_t::id
+ * id dell'utente (indice in users_struct_t::ids, immutabile)
+ * @var user_data_t::shard
+ * partizione dell'utente (immutabile)
  * @var user_data_t::fd
- * Relativo file descriptor
+ * Relativo file descriptor (-1 se offline)
+ * @var user_data_t::onlinepos
+ * posizione dell'utente in users_struct_t::online (valida solo se online)
  * @var user_data_t::msgq
- * Coda messaggi ricevuti (history)
+ * Coda messaggi ricevuti (history), NULL se l'utente non è registrato
 */
 typedef struct user_data_s{
 	char name[MAX_NAME_LENGTH+1];
+	unsigned int id;
+	unsigned int shard;
 	unsigned long fd;
+	unsigned int onlinepos;
 	msgqueue_t * msgq;
 }user_data_t;
 
 /**
  * @brief Crea la struttura principale per memorizzare gli utenti.
  *
- * Per la memorizzazione di un utente si utilizzano due strutture hash: 1) per memorizzare
- * la stringa dell'utente con le relative informazione di utilità e
- * 2)per memorizzare il file descriptor dell'user che richiede di loggarsi associandolo con il relativo nickname.
+ * Per la memorizzazione di un utente si utilizzano quattro strutture: 1) una tabella hash per memorizzare
+ * la stringa dell'utente con le relative informazione di utilità,
+ * 2) la tabella degli id, 3) un vettore indicizzato per file descriptor con l'user collegato
+ * su ogni fd e 4) l'indice compatto degli utenti online.
  * Il motivo di tale scelta implementativa è che il client potrebbe disconnettersi in "maniera implicita"
  * rendendo la disconnessione possibile soltanto per mezzo del suo file descriptor.
  *
  * @param historysize dimensione massima coda messaggi ricevuti
+ * @param msgsize dimensione massima di un messaggio (spazio riservato ad ogni messaggio della history)
  * @param nbuckets dimensione inziale tabella hash utenti
+ * @param nfd dimensione iniziale del vettore indicizzato per fd (es. RLIMIT_NOFILE)
  *
  * @return puntatore a users_struct_t
 */
-users_struct_t * createUsersStruct(unsigned long history, unsigned long nbuckets);
+users_struct_t * createUsersStruct(unsigned long history, unsigned long msgsize, unsigned long nbuckets, unsigned long nfd);
 
 /**
  * @brief Funzione che registra gli utenti nell'apposita struttura dati
@@ -127,14 +254,24 @@ int unregisterUser(users_struct_t * tab, char * nick, int fd);
 int disconnectUser(users_struct_t * tab, char * nick, unsigned long fd);
 
 /**
- * @brief Funzione che inizializza list con i nickname degli utenti attualmente online
+ * @brief Funzione che restituisce la lista degli utenti attualmente online
+ *
+ * Se dall'ultima richiesta nessuno si è collegato o disconnesso si restituisce
+ * la stessa lista (incrementandone i riferimenti), altrimenti viene ricostruita
+ * dall'indice degli utenti online. La lista non va modificata.
+ *
  * @param tab struttura dove è registrato l'utente
- * @param list puntatore ad array di caratteri
  *
- * @return -1 Se c'è un errore
- * @return >=0 #utenti online
+ * @return NULL Se c'è un errore
+ * @return lista da rilasciare con releaseOnlineList
+ */
+online_list_t * getOnlineList(users_struct_t * tab);
+
+/**
+ * @brief Rilascia una lista restituita da getOnlineList
+ * @param list lista da rilasciare
  */
-int getOnlineList(users_struct_t * tab, char ** list);
+void releaseOnlineList(online_list_t * list);
 
 /**
  * @brief Funzione che restituisce una copia dei messaggi in coda
@@ -143,14 +280,43 @@ int getOnlineList(users_struct_t * tab, char ** list);
  * Si preferisce farne una copia intera per motivi di consistenza,
  * in quanto un altro thread del server, potrebbe voler registrare un
  * messaggio mandato da un altro utente.
+ * Gli id dei mittenti vengono tradotti nei rispettivi nickname.
  *
  * @param tab struttura dove è registrato l'utente
  * @param nick username dell'Utente
+ * @param msgs dove scrivere il vettore dei messaggi (da liberare con freeHistory)
  *
- * @return NULL se l'utente è offline
- * @return msgqueue contenente la history di "nick"
+ * @return -1 se l'utente non è registrato o manca memoria
+ * @return numero di messaggi in msgs
  */
-msgqueue_t * getHistory(users_struct_t *tab, char * nick);
+int getHistory(users_struct_t *tab, char * nick, message_t ** msgs);
+
+/**
+ * @brief Libera il vettore restituito da getHistory
+ * @param msgs vettore dei messaggi
+ * @param n numero di messaggi
+ */
+void freeHistory(message_t * msgs, int n);
+
+/**
+ * @brief Funzione che restituisce l'id dell'utente "nick"
+ * @param tab struttura dove è registrato l'utente
+ * @param nick username dell'Utente
+ *
+ * @return USER_NOID se nick non è mai stato registrato
+ * @return id di nick
+ */
+unsigned int getUserId(users_struct_t * tab, const char * nick);
+
+/**
+ * @brief Funzione che restituisce il nickname di un id (senza lock)
+ * @param tab struttura dove è registrato l'utente
+ * @param id id dell'Utente
+ *
+ * @return NULL se l'id non è assegnato
+ * @return nickname
+ */
+const char * getUserName(users_struct_t * tab, unsigned int id);
 
 /**
  * @brief Funzione che restituisce il file descriptor associato all'utente "nick"
@@ -165,6 +331,9 @@ int getUserFD(users_struct_t * tab, char * nick);
 
 /**
  * @brief Funzione che riempie il vettore di interi fds con i fd degli user online
+ *
+ * Scorre soltanto l'indice degli utenti online.
+ *
  * @param tab struttura dove è registrato l'utente
  * @param nick username dell'Utente che ne fa richiesta
  * @param fds puntatore a vettore di filedescriptor
@@ -185,7 +354,11 @@ int getAllUsersFD(users_struct_t * tab, char * nick, int ** fds);
 int postOnHistory(users_struct_t *tab,message_t * msg);
 
 /**
- * @brief Funzione che posta un msg nella history di tutti gli utenti online
+ * @brief Funzione che posta un msg nella history di tutti gli utenti registrati
+ *
+ * Anche gli utenti offline ricevono il messaggio nella history, quindi qui
+ * si scorrono le partizioni e non l'indice degli utenti online.
+ *
  * @param tab struttura dove è registrato l'utente
  * @param msg messaggio da postare
  *
@@ -194,6 +367,21 @@ int postOnHistory(users_struct_t *tab,message_t * msg);
  */
 int postOnHistoryAll(users_struct_t *tab, message_t * msg);
 
+/**
+ * @brief Funzione che raccoglie le statistiche delle tabelle hash degli utenti registrati
+ *
+ * Somma le statistiche (posizioni, elementi, ampliamenti e tabelle in rehash)
+ * di tutte le partizioni, maxdist è la distanza massima fra tutte.
+ * Le partizioni bloccate in scrittura vengono saltate, così la funzione può
+ * essere chiamata anche dal gestore di SIGUSR1.
+ *
+ * @param tab struttura dove sono registrati gli utenti
+ * @param st dove scrivere le statistiche
+ *
+ * @return numero di partizioni lette
+ */
+int getUsersHashStats(users_struct_t * tab, hashmap_stats * st);
+
 /**
  * @brief Distrugge le strutture dati relative alla memorizzazione utenti
  * @param tab tabella utenti